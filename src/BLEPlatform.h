@@ -0,0 +1,51 @@
+#pragma once
+
+// Thin platform layer so the sync engine builds both as an Arduino sketch and
+// as a host-native program (the [env:native] simulator).
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+// Minimal stand-in for the Arduino Serial object. The simulator mutes it
+// when running many nodes.
+class NativeSerial {
+public:
+  bool enabled = true;
+  // Told the length of every write, muted or not, so the simulator can
+  // charge the time a UART would hold the writer
+  void (*writeHook)(void* context, size_t bytes) = nullptr;
+  void* writeHookContext = nullptr;
+
+  void printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    va_list args;
+    if (writeHook) {
+      va_start(args, fmt);
+      int n = vsnprintf(nullptr, 0, fmt, args);
+      va_end(args);
+      writeHook(writeHookContext, n > 0 ? n : 0);
+    }
+    if (!enabled) return;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+  }
+  void println(const char* s) {
+    if (writeHook) writeHook(writeHookContext, strlen(s) + 1);
+    if (enabled) puts(s);
+  }
+};
+
+extern NativeSerial Serial;
+
+inline long random(long howsmall, long howbig) {
+  if (howsmall >= howbig) return howsmall;
+  return howsmall + (rand() % (howbig - howsmall));
+}
+#endif
@@ -1,504 +1,1356 @@
 
 #include "BLESync.h"
-#include <BLEDevice.h>
-#include <BLEUtils.h>
-#include <BLEServer.h>
-#include <BLEClient.h>
-#include <BLEScan.h>
-#include <BLEAdvertisedDevice.h>
-#include <BLE2902.h>
 #include <stdlib.h>
-
-// Service and Characteristic UUIDs for counter synchronization
-#define SERVICE_UUID "21e862dc-87da-4130-9991-2a5a49b4d949"
-#define COUNTER_CHARACTERISTIC_UUID "4027ce63-bdf0-4158-9426-6c8203185e00"
-#define SYNC_CHARACTERISTIC_UUID "e0368f9c-d3d2-4588-b033-1355ac7dc562"
-#define TIMESTAMP_CHARACTERISTIC_UUID "f0368f9c-d3d2-4588-b033-1355ac7dc563"
+#include <algorithm>
+#ifdef ARDUINO
+#include "BLESyncTask.h"
+#ifdef BLESYNC_NIMBLE
+#include "BLETransportNimBLE.h"
+typedef BLETransportNimBLE BLETransportDevice;
+#define BLESYNC_STACK_NAME "NimBLE"
+#else
+#include "BLETransportArduino.h"
+typedef BLETransportArduino BLETransportDevice;
+#define BLESYNC_STACK_NAME "Bluedroid"
+#endif
+#endif
 
 // Timing constants
 #define COUNTER_INTERVAL 3000  // Increment counter every 1 second
-#define SYNC_INTERVAL 10000     // Sync every 10 seconds
+#define COUNTER_INTERVAL_US (COUNTER_INTERVAL * 1000UL)
 #define SCAN_TIME 3            // Scan for 3 seconds
+#define SCAN_STALL_GRACE 2000  // Abandon a scan whose completion never arrived
 #define RESCAN_INTERVAL 10000  // Rescan every 10 seconds if not connected
 #define STATUS_PRINT_INTERVAL 20000 // Print status every 20 seconds
-#define CONNECTION_TIMEOUT 10000  // 10 second timeout for connection attempts
-
-// Global variables
-static uint32_t localCounter = 0;
-static uint32_t remoteCounter = 0;
-static unsigned long lastCounterUpdate = 0;
-static unsigned long lastSyncTime = 0;
-static unsigned long lastScanAttempt = 0;
-static unsigned long bootTimestamp = 0;
-static String deviceName;
-
-// Role management
-static bool isMaster = false;
-static bool isClient = false;
-static bool roleAssigned = false;
-
-// BLE Server components
-static BLEServer* pServer = nullptr;
-static BLEService* pService = nullptr;
-static BLECharacteristic* pCounterCharacteristic = nullptr;
-static BLECharacteristic* pSyncCharacteristic = nullptr;
-static BLECharacteristic* pTimestampCharacteristic = nullptr;
-
-// BLE Client components
-static BLEClient* pClient = nullptr;
-static BLERemoteService* pRemoteService = nullptr;
-static BLERemoteCharacteristic* pRemoteCounterCharacteristic = nullptr;
-static BLERemoteCharacteristic* pRemoteSyncCharacteristic = nullptr;
-static BLERemoteCharacteristic* pRemoteTimestampCharacteristic = nullptr;
-
-// Connection states
-static bool serverConnected = false;
-static bool clientConnected = false;
-static bool doConnect = false;
-static bool doScan = false;
-static bool doRoleNegotiation = false;
-static unsigned long connectAttemptStartTime = 0;
-static BLEAdvertisedDevice* targetDevice = nullptr;
-
-// Add a random delay (0-1000ms) before scanning/connecting after disconnect
-static unsigned long randomScanDelay = 0;
-static unsigned long scanDelayStart = 0;
+#define METRICS_PUBLISH_INTERVAL 5000  // Refresh CHAR_METRICS every 5 seconds
+#define BACKOFF_MIN 200        // Random delay before rescanning after a lost link
+#define BACKOFF_MAX 1200
+#define ROLE_TOKEN_INTERVAL 1000  // Refresh the advertised uptime every second
+#define ROLE_UPTIME_MARGIN 1      // Uptimes (s) this close are a tie
+#define CLOCK_SAMPLES_ON_CONNECT 4  // Timed reads to seed a new peer's clock filter
+#define SYNC_ERROR_HIGH_US 500      // Phase error that halves a peer's sync interval
+#define SYNC_ERROR_LOW_US 100       // Phase error below which it doubles
+#define SYNC_APPLY_GRACE_MS 500     // A frame sent this recently may still be queued on the client
+#define RECONNECT_SCAN_MS 2000      // Whole seconds, as the stacks scan; over one 1349 ms scan interval
+#define RECONNECT_WAIT_MS 2500      // Extra backoff a client gives its master to reconnect; over RECONNECT_SCAN_MS
+#define RECONNECT_CONNECT_TIMEOUT_MS 1000  // Bounds a direct attempt, whose peer may be gone
 
-// Server callbacks
-class MyServerCallbacks: public BLEServerCallbacks {
-    void onConnect(BLEServer* pServer) {
-      serverConnected = true;
-      Serial.println("Server: Client connected");
-      uint32_t currentUptime = millis();
-      pTimestampCharacteristic->setValue((uint8_t*)&currentUptime, 4);
-      doRoleNegotiation = true;
-    };
-    void onDisconnect(BLEServer* pServer) {
-      Serial.println("Server: Client disconnected");
-      serverConnected = false;
-      if (roleAssigned && isMaster) {
-        Serial.println("Server: Master lost client, resetting roles and restarting advertising");
-        roleAssigned = false;
-        isMaster = false;
-        isClient = false;
-        randomScanDelay = random(200, 1200);
-        scanDelayStart = millis();
+// Move a link back to LINK_PROFILE_SYNC this long before its sync. From
+// idle the peripheral hears the request within 1 + latency events and the
+// update lands six events after that: 2.2 s at worst.
+#define LINK_PROFILE_LEAD_MS 2500
+#define LINK_PROFILE_IDLE_MIN_MS (2 * LINK_PROFILE_LEAD_MS)  // shorter gaps stay on LINK_PROFILE_SYNC
+#define LINK_PROFILE_RETRY_MS 250   // Between attempts at a switch the stack refused
+
+#define LINK_BIT(state) (1u << (state))
+
+// How far due lies ahead, in whatever unit both are in
+static uint64_t timeUntil(uint64_t now, uint64_t due) {
+  return due > now ? due - now : 0;
+}
+
+BLESyncNode::BLESyncNode(BLETransport& transport) : transport(transport) {
+  transport.setListener(this);
+}
+
+// Connect and discover block until the transport gives up, so those two
+// never time out here. Idle and master rescan every RESCAN_INTERVAL from
+// the start of the last scan; negotiating, backoff and reconnecting arm
+// their own delay. Wherever a scan would start, clients waiting in
+// lostPeers are looked for first (seekPeers).
+const BLESyncNode::LinkStateSpec BLESyncNode::stateSpecs[] = {
+  // LINK_IDLE
+  {"IDLE", LINK_BIT(LINK_SCANNING) | LINK_BIT(LINK_CLIENT) | LINK_BIT(LINK_RECONNECTING),
+   0, &BLESyncNode::enterRest, nullptr, &BLESyncNode::rescanDue},
+  // LINK_SCANNING
+  {"SCANNING", LINK_BIT(LINK_IDLE) | LINK_BIT(LINK_MASTER) | LINK_BIT(LINK_NEGOTIATING) |
+               LINK_BIT(LINK_CLIENT) | LINK_BIT(LINK_BACKOFF) | LINK_BIT(LINK_RECONNECTING),
+   SCAN_TIME * 1000 + SCAN_STALL_GRACE, &BLESyncNode::enterScanning, &BLESyncNode::exitScanning,
+   &BLESyncNode::scanStalled},
+  // LINK_NEGOTIATING
+  {"NEGOTIATING", LINK_BIT(LINK_CONNECTING) | LINK_BIT(LINK_CLIENT) | LINK_BIT(LINK_SCANNING),
+   0, nullptr, nullptr, &BLESyncNode::connectDue},
+  // LINK_CONNECTING
+  {"CONNECTING", LINK_BIT(LINK_DISCOVERING) | LINK_BIT(LINK_SCANNING) | LINK_BIT(LINK_RECONNECTING),
+   0, nullptr, nullptr, nullptr},
+  // LINK_DISCOVERING
+  {"DISCOVERING", LINK_BIT(LINK_MASTER) | LINK_BIT(LINK_IDLE) | LINK_BIT(LINK_SCANNING) |
+                  LINK_BIT(LINK_RECONNECTING),
+   0, nullptr, nullptr, nullptr},
+  // LINK_MASTER
+  {"MASTER", LINK_BIT(LINK_SCANNING) | LINK_BIT(LINK_CLIENT) | LINK_BIT(LINK_BACKOFF) |
+             LINK_BIT(LINK_RECONNECTING),
+   0, &BLESyncNode::enterRest, nullptr, &BLESyncNode::rescanDue},
+  // LINK_CLIENT
+  {"CLIENT", LINK_BIT(LINK_BACKOFF) | LINK_BIT(LINK_SCANNING),
+   0, &BLESyncNode::enterClient, nullptr, nullptr},
+  // LINK_BACKOFF
+  {"BACKOFF", LINK_BIT(LINK_SCANNING) | LINK_BIT(LINK_CLIENT) | LINK_BIT(LINK_RECONNECTING),
+   0, &BLESyncNode::enterBackoff, nullptr, &BLESyncNode::backoffElapsed},
+  // LINK_RECONNECTING
+  {"RECONNECTING", LINK_BIT(LINK_CONNECTING) | LINK_BIT(LINK_CLIENT) | LINK_BIT(LINK_SCANNING),
+   RECONNECT_SCAN_MS, &BLESyncNode::enterReconnecting, &BLESyncNode::exitScanning,
+   &BLESyncNode::reconnectDue},
+};
+
+const char* BLESyncNode::stateName(LinkState state) {
+  return state < LINK_STATE_COUNT ? stateSpecs[state].name : "?";
+}
+
+// Moves to next if the table allows it, charging the time spent in the
+// state being left. Re-entering the current state is a no-op.
+bool BLESyncNode::transitionTo(LinkState next) {
+  static_assert(sizeof(stateSpecs) / sizeof(stateSpecs[0]) == LINK_STATE_COUNT,
+                "stateSpecs needs one entry per LinkState");
+  LinkState prev = linkState;
+  if (next == prev) {
+    return true;
+  }
+  if (!(stateSpecs[prev].next & LINK_BIT(next))) {
+    BLESYNC_LOGW("FSM: Illegal transition %s -> %s ignored", stateName(prev), stateName(next));
+    return false;
+  }
+  uint64_t nowUs = transport.micros();
+  uint64_t dwellUs = nowUs - stateEnteredUs;
+  syncStats.stateTimeUs[prev] += dwellUs;
+  syncStats.stateEntries[next]++;
+  recordStateMetrics(prev, next, dwellUs);
+  BLESYNC_LOGI("FSM: %s -> %s after %llu ms", stateName(prev), stateName(next), (unsigned long long)(dwellUs / 1000));
+  if (stateSpecs[prev].onExit) {
+    (this->*stateSpecs[prev].onExit)();
+  }
+  eventTrace.add(TRACE_STATE, nowUs, prev, next);
+  linkState = next;
+  stateEnteredUs = nowUs;
+  stateDeadline = transport.now() + stateSpecs[next].timeoutMs;
+  if (stateHook) {
+    stateHook(stateHookContext, prev, next, dwellUs);
+  }
+  if (stateSpecs[next].onEnter) {
+    (this->*stateSpecs[next].onEnter)();
+  }
+  return true;
+}
+
+// Scan, connect and discovery times are the time spent in their states
+void BLESyncNode::recordStateMetrics(LinkState prev, LinkState next, uint64_t dwellUs) {
+  switch (prev) {
+    case LINK_SCANNING:
+      healthMetrics.record(METRIC_SCAN_US, (unsigned long)dwellUs);
+      break;
+    case LINK_CONNECTING:
+      healthMetrics.record(METRIC_CONNECT_US, (unsigned long)dwellUs);
+      if (next != LINK_DISCOVERING) {
+        healthMetrics.count(METRIC_CONNECT_FAILED);
       }
-      pServer->startAdvertising();
-      Serial.println("Server: Restarted advertising after client disconnect");
+      break;
+    case LINK_DISCOVERING:
+      healthMetrics.record(METRIC_DISCOVER_US, (unsigned long)dwellUs);
+      if (next != LINK_MASTER) {
+        healthMetrics.count(METRIC_DISCOVER_FAILED);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// Where a finished scan or connect attempt leaves us
+void BLESyncNode::settle() {
+  transitionTo(peerCount > 0 ? LINK_MASTER : LINK_IDLE);
+}
+
+void BLESyncNode::armStateTimer(unsigned long ms) {
+  stateDeadline = transport.now() + ms;
+}
+
+void BLESyncNode::serviceStateTimer(uint64_t currentTime) {
+  const LinkStateSpec& spec = stateSpecs[linkState];
+  if (spec.onTimeout && currentTime >= stateDeadline) {
+    (this->*spec.onTimeout)();
+  }
+}
+
+void BLESyncNode::enterRest() {
+  stateDeadline = lastScanAttempt + RESCAN_INTERVAL;
+}
+
+void BLESyncNode::enterScanning() {
+  BLESYNC_LOGI("Starting BLE scan...");
+  lastScanAttempt = transport.now();
+  if (!transport.startScan(SCAN_TIME * 1000)) {
+    BLESYNC_LOGW("Failed to start scan");
+    settle();
+  }
+}
+
+void BLESyncNode::exitScanning() {
+  transport.stopScan();
+}
+
+// A peer only connects to us after deciding from our token that it is
+// master, so an inbound link makes us its client
+void BLESyncNode::enterClient() {
+  targetAddress.clear();
+  lostPeerCount = 0;
+  if (config.directReconnect) {
+    transport.rememberPeer(std::string());
+  }
+  transport.stopAdvertising();
+  BLESYNC_LOGI("ROLE: This device is CLIENT (master connected to us)");
+}
+
+// Spreads out the rescans of nodes that lost the same link
+void BLESyncNode::enterBackoff() {
+  armStateTimer(random(BACKOFF_MIN, BACKOFF_MAX));
+  advertiseRoleToken();
+}
+
+// A master with free slots keeps scanning to pick up new nodes
+void BLESyncNode::rescanDue() {
+  if (peerCount >= BLESYNC_MAX_PEERS) {
+    armStateTimer(RESCAN_INTERVAL);
+    return;
+  }
+  BLESYNC_LOGI("%s", peerCount > 0 ? "Free peer slots, starting periodic scan..."
+                                   : "No connection or role, starting periodic scan...");
+  seekPeers();
+}
+
+void BLESyncNode::scanStalled() {
+  BLESYNC_LOGI("Scan did not complete, stopping it");
+  settle();
+}
+
+void BLESyncNode::connectDue() {
+  if (connectToServer()) {
+    BLESYNC_LOGI("Successfully connected to server and role assigned");
+  } else {
+    BLESYNC_LOGW("Failed to connect to server or assign role");
+  }
+}
+
+void BLESyncNode::backoffElapsed() {
+  BLESYNC_LOGI("Randomized delay complete, starting scan.");
+  seekPeers();
+}
+
+// Lost clients are only connected to once their advertised role token is
+// in, so this scans for them (reconnectSeen) rather than connecting blind
+void BLESyncNode::enterReconnecting() {
+  BLESYNC_LOGI("Scanning for %d lost clients", lostPeerCount);
+  if (!transport.startScan(RECONNECT_SCAN_MS)) {
+    BLESYNC_LOGW("Failed to start scan");
+    reconnectDue();
+  }
+}
+
+// Clients that did not show up within the window, or came back as masters
+// that outrank us, are left to the normal scan and negotiation
+void BLESyncNode::reconnectDue() {
+  for (int i = 0; i < lostPeerCount; i++) {
+    lostPeers[i].clear();
+  }
+  lostPeerCount = 0;
+  transitionTo(LINK_SCANNING);
+}
+
+// A lost client's advertisement while reconnecting. Its token decides, as
+// in a scan, except that there is no backoff: an unassigned client, or one
+// we still outrank, is connected to straight away. One that has become a
+// master we lose to is left alone, since the losing side never initiates.
+void BLESyncNode::reconnectSeen(const std::string& address, const RoleToken& peer) {
+  int i = 0;
+  while (i < lostPeerCount && lostPeers[i] != address) {
+    i++;
+  }
+  if (i == lostPeerCount || findPeer(address) != nullptr) {
+    return;
+  }
+  for (; i + 1 < lostPeerCount; i++) {
+    lostPeers[i] = lostPeers[i + 1];
+  }
+  lostPeers[--lostPeerCount].clear();
+  bool tieBroken;
+  if ((peer.flags & ROLE_FLAG_MASTER) && !winsAgainst(peer, address, tieBroken)) {
+    BLESYNC_LOGI("Lost client %s is a master now, leaving it to negotiation", address.c_str());
+    if (lostPeerCount == 0) {
+      transitionTo(LINK_SCANNING);
     }
-};
+    return;
+  }
+  targetAddress = address;
+  BLESYNC_LOGI("Reconnecting directly to %s", targetAddress.c_str());
+  if (connectToServer(RECONNECT_CONNECT_TIMEOUT_MS)) {
+    healthMetrics.count(METRIC_DIRECT_RECONNECTS);
+  } else {
+    BLESYNC_LOGW("Direct reconnect failed");
+  }
+}
+
+// Where we go to look for clients: lost ones first, then a scan
+void BLESyncNode::seekPeers() {
+  transitionTo(lostPeerCount > 0 ? LINK_RECONNECTING : LINK_SCANNING);
+}
 
-// Client callbacks
-class MyClientCallback : public BLEClientCallbacks {
-  void onConnect(BLEClient* pclient) {
-    Serial.println("Client: Connected to server");
-  }
-  void onDisconnect(BLEClient* pclient) {
-    clientConnected = false;
-    Serial.println("Client: Disconnected from server");
-    if (roleAssigned) {
-      Serial.println("Client: Resetting role assignment due to disconnection");
-      roleAssigned = false;
-      isMaster = false;
-      isClient = false;
-      randomScanDelay = random(200, 1200);
-      scanDelayStart = millis();
-    }
-    pRemoteService = nullptr;
-    pRemoteCounterCharacteristic = nullptr;
-    pRemoteSyncCharacteristic = nullptr;
-    pRemoteTimestampCharacteristic = nullptr;
-    if (targetDevice != nullptr) {
-        delete targetDevice;
-        targetDevice = nullptr;
-    }
-    BLEDevice::startAdvertising();
-    Serial.println("Client: Restarted server advertising and scanning after disconnect");
+void BLESyncNode::queueReconnect(const std::string& address) {
+  for (int i = 0; i < lostPeerCount; i++) {
+    if (lostPeers[i] == address) {
+      return;
+    }
   }
-};
+  if (lostPeerCount < BLESYNC_MAX_PEERS) {
+    lostPeers[lostPeerCount++] = address;
+  }
+}
+
+// Little-endian so the advertisement layout doesn't depend on the CPU
+static void encodeRoleToken(const RoleToken& token, uint8_t* out) {
+  out[0] = token.version;
+  out[1] = token.flags;
+  for (int i = 0; i < 4; i++) {
+    out[2 + i] = (uint8_t)(token.uptimeSec >> (8 * i));
+  }
+}
 
-// Sync characteristic callback
-class MySyncCallback: public BLECharacteristicCallbacks {
-    void onWrite(BLECharacteristic* pCharacteristic) {
-      std::string value = pCharacteristic->getValue();
-      struct {
-        uint32_t counter;
-        uint32_t timeSinceLastUpdate;
-      } syncPacket;
-      memcpy(&syncPacket, value.data(), 8);
-      localCounter = syncPacket.counter;
-      unsigned long currentTime = millis();
-      unsigned long masterTimeSinceUpdate = syncPacket.timeSinceLastUpdate;
-      lastCounterUpdate = currentTime - masterTimeSinceUpdate;
-      Serial.printf("Timing Sync: Counter=%d, MasterTimeSinceUpdate=%lu, Current=%lu\n", 
-                    syncPacket.counter, masterTimeSinceUpdate, currentTime);
-      Serial.printf("Timing Sync: Set lastCounterUpdate to %lu (next increment in %lu ms)\n", 
-                    lastCounterUpdate, COUNTER_INTERVAL - masterTimeSinceUpdate);
+static bool decodeRoleToken(const uint8_t* data, size_t len, RoleToken& token) {
+  if (len < ROLE_TOKEN_LEN || data[0] != ROLE_TOKEN_VERSION) {
+    return false;
+  }
+  token.version = data[0];
+  token.flags = data[1];
+  token.uptimeSec = 0;
+  for (int i = 0; i < 4; i++) {
+    token.uptimeSec |= (uint32_t)data[2 + i] << (8 * i);
+  }
+  return true;
+}
+
+// Transport callbacks may run on the BLE host task, so apart from onRead()
+// they only queue an event; loop() drains the queue and handles it. Link
+// events may use the BLESYNC_EVENT_RESERVE cells the rest leave free: a
+// lost disconnect would leave a dead peer in peerTable or us stuck as a
+// client, while anything else is repeated or caught up on later.
+bool BLESyncNode::post(BLESyncEventType type, const std::string& address, BLESyncChar id,
+                       const uint8_t* data, size_t len, int32_t count) {
+  BLESyncEvent event;
+  event.type = type;
+  event.id = id;
+  event.count = count;
+  event.atUs = transport.micros();
+  strncpy(event.address, address.c_str(), sizeof(event.address) - 1);
+  event.address[sizeof(event.address) - 1] = '\0';
+  event.len = 0;
+  size_t reserve = type <= EVT_CLIENT_DISCONNECT ? 0 : BLESYNC_EVENT_RESERVE;
+  if (len > sizeof(event.data) || !events.push(event.withData(data, len), reserve)) {
+    syncStats.eventsDropped++;
+    return false;
+  }
+  if (wakeHook) {
+    wakeHook(wakeHookContext);
+  }
+  return true;
+}
+
+void BLESyncNode::onServerConnect(const std::string& address) {
+  post(EVT_SERVER_CONNECT, address);
+}
+
+void BLESyncNode::onServerDisconnect(const std::string& address) {
+  post(EVT_SERVER_DISCONNECT, address);
+}
+
+void BLESyncNode::onClientConnect(const std::string& address) {
+  post(EVT_CLIENT_CONNECT, address);
+}
+
+void BLESyncNode::onClientDisconnect(const std::string& address) {
+  post(EVT_CLIENT_DISCONNECT, address);
+}
+
+void BLESyncNode::onScanResult(const std::string& address, const uint8_t* token, size_t tokenLen) {
+  post(EVT_SCAN_RESULT, address, CHAR_COUNTER, token, tokenLen);
+}
+
+void BLESyncNode::onScanComplete(int deviceCount) {
+  post(EVT_SCAN_COMPLETE, std::string(), CHAR_COUNTER, nullptr, 0, deviceCount);
+}
+
+void BLESyncNode::onWrite(BLESyncChar id, const uint8_t* data, size_t len) {
+  post(EVT_WRITE, std::string(), id, data, len);
+}
+
+// A client's counter goes through its mailbox, so only the latest value
+// of a burst is handled
+void BLESyncNode::onNotify(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) {
+  uint32_t tag = traceAddressTag(address);
+  if (id == CHAR_COUNTER && len == 4 && tag != 0) {
+    uint32_t counter;
+    memcpy(&counter, data, 4);
+    for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+      NotifyMailbox& box = notifyMail[i];
+      if (box.addressTag.load(std::memory_order_acquire) != tag) {
+        continue;
+      }
+      box.counter.store(counter, std::memory_order_relaxed);
+      if (!box.pending.exchange(true, std::memory_order_acq_rel) &&
+          !post(EVT_NOTIFY, address, id, nullptr, 0, i)) {
+        box.pending.store(false, std::memory_order_relaxed);
+      }
+      return;
     }
-};
+  }
+  post(EVT_NOTIFY, address, id, data, len, -1);
+}
 
-// Advertised device scanner
-class MyAdvertisedDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
-    void onResult(BLEAdvertisedDevice advertisedDevice) {
-      if (advertisedDevice.haveServiceUUID() && 
-          advertisedDevice.isAdvertisingService(BLEUUID(SERVICE_UUID))) {
-        Serial.printf("Found target device: %s\n", advertisedDevice.getAddress().toString().c_str());
-        if (!clientConnected || (serverConnected && !roleAssigned)) {
-          BLEDevice::getScan()->stop();
-          if (targetDevice != nullptr) {
-            delete targetDevice;
-            targetDevice = nullptr;
-          }
-          targetDevice = new BLEAdvertisedDevice(advertisedDevice);
-          String localMac = BLEDevice::getAddress().toString().c_str();
-          String remoteMac = advertisedDevice.getAddress().toString().c_str();
-          if (localMac < remoteMac) {
-            Serial.println("Delaying connection to avoid collision (smaller MAC)");
-            delay(1000);
-          }
-          doConnect = true;
-          doScan = false;
-        } else {
-          Serial.println("Already properly connected, ignoring found device");
+// Takes the latest counter from the event's mailbox; false if the slot has
+// since been given to another peer
+bool BLESyncNode::collectNotify(BLESyncEvent& event) {
+  if (event.count < 0 || event.count >= BLESYNC_MAX_PEERS) {
+    return true;
+  }
+  NotifyMailbox& box = notifyMail[event.count];
+  // Cleared before the read, so a value stored after it queues again
+  box.pending.exchange(false, std::memory_order_acq_rel);
+  if (peerTable[event.count].address != event.address) {
+    return false;
+  }
+  uint32_t counter = box.counter.load(std::memory_order_relaxed);
+  memcpy(event.data, &counter, 4);
+  event.len = 4;
+  return true;
+}
+
+void BLESyncNode::drainEvents() {
+  BLESyncEvent event;
+  while (events.pop(event)) {
+    std::string address(event.address);
+    switch (event.type) {
+      case EVT_SERVER_CONNECT:    handleServerConnect(address); break;
+      case EVT_SERVER_DISCONNECT: handleServerDisconnect(address); break;
+      case EVT_CLIENT_CONNECT:    break;
+      case EVT_CLIENT_DISCONNECT: handleClientDisconnect(address); break;
+      case EVT_SCAN_RESULT:       handleScanResult(address, event.data, event.len); break;
+      case EVT_SCAN_COMPLETE:     handleScanComplete(event.count); break;
+      case EVT_WRITE:             handleWrite((BLESyncChar)event.id, event.data, event.len, event.atUs); break;
+      case EVT_NOTIFY:
+        if (collectNotify(event)) {
+          handleNotify(address, (BLESyncChar)event.id, event.data, event.len);
         }
+        break;
+      case EVT_TICK:
+        tickPending.store(false, std::memory_order_relaxed);
+        handleTick(event.atUs);
+        break;
+    }
+  }
+}
+
+// Server callbacks
+void BLESyncNode::handleServerConnect(const std::string& address) {
+  eventTrace.add(TRACE_LINK_UP, transport.micros(), 0, 0, traceAddressTag(address));
+  serverConnected = true;
+  serverConnectUs = transport.micros();
+  if (master()) {
+    // Both sides connected on stale tokens; the smaller MAC keeps the role
+    if (transport.localAddress() < address) {
+      BLESYNC_LOGI("Server: Competing master %s connected, keeping master role", address.c_str());
+      return;
+    }
+    BLESYNC_LOGI("Server: Competing master %s connected, yielding master role", address.c_str());
+    disconnectPeers();
+  }
+  transitionTo(LINK_CLIENT);
+}
+
+void BLESyncNode::handleServerDisconnect(const std::string& address) {
+  eventTrace.add(TRACE_LINK_DOWN, transport.micros(), 0, 0, traceAddressTag(address));
+  serverConnected = false;
+  serverConnectUs = 0;
+  recordLinkLost();
+  if (linkState == LINK_CLIENT) {
+    BLESYNC_LOGI("Server: Client lost master, resetting roles and restarting advertising");
+    transitionTo(LINK_BACKOFF);
+    // Give the master the first go at reconnecting before we scan and
+    // perhaps take the role ourselves
+    if (config.directReconnect) {
+      armStateTimer(RECONNECT_WAIT_MS + random(BACKOFF_MIN, BACKOFF_MAX));
+    }
+  }
+  transport.startAdvertising();
+  BLESYNC_LOGI("Server: Restarted advertising after client disconnect");
+}
+
+// A master keeps its role while it still holds at least one client. The
+// transport keeps a dropped link's slot until we release it here.
+void BLESyncNode::handleClientDisconnect(const std::string& address) {
+  transport.disconnect(address);
+  SyncPeer* peer = findPeer(address);
+  if (peer == nullptr) {
+    return;   // already dropped by disconnectPeers()
+  }
+  eventTrace.add(TRACE_LINK_DOWN, transport.micros(), 1, 0, traceAddressTag(address));
+  notifyMail[peer - peerTable].addressTag.store(0, std::memory_order_relaxed);
+  peer->address.clear();
+  peerCount--;
+  recordLinkLost();
+  // A connect already under way carries on, and tries the lost client
+  // when it is done
+  bool between = linkState == LINK_MASTER || linkState == LINK_SCANNING;
+  if (config.directReconnect) {
+    queueReconnect(address);
+  }
+  if (peerCount > 0) {
+    BLESYNC_LOGI("Client: Lost client %s, %d remaining", address.c_str(), peerCount);
+    if (config.directReconnect && between) {
+      transitionTo(LINK_RECONNECTING);
+    }
+    return;
+  }
+  if (between) {
+    BLESYNC_LOGI("Client: Master lost last client, resetting role assignment");
+    transitionTo(config.directReconnect ? LINK_RECONNECTING : LINK_BACKOFF);
+  }
+  transport.startAdvertising();
+  BLESYNC_LOGI("Client: Restarted server advertising and scanning after disconnect");
+}
+
+// Sync characteristic writes. atUs is when the write arrived, which can be
+// well before loop() gets to it.
+void BLESyncNode::handleWrite(BLESyncChar id, const uint8_t* data, size_t len, uint64_t atUs) {
+  if (id != CHAR_SYNC) {
+    return;
+  }
+  SyncFrame frame;
+  if (!decodeSyncFrame(data, len, frame)) {
+    syncStats.framesRejected++;
+    healthMetrics.count(METRIC_FRAMES_REJECTED);
+    BLESYNC_LOGW("Timing Sync: Rejected malformed frame (%u bytes)", (unsigned)len);
+    return;
+  }
+  if (haveAppliedFrame && frame.epoch == appliedEpoch && frame.seq == appliedSeq) {
+    syncStats.framesRejected++;
+    healthMetrics.count(METRIC_FRAMES_REJECTED);
+    BLESYNC_LOGD("Timing Sync: Dropped duplicate frame seq=%u", frame.seq);
+    return;
+  }
+  haveAppliedFrame = true;
+  appliedEpoch = frame.epoch;
+  appliedSeq = frame.seq;
+  visibleAppliedSeq.store(frame.seq, std::memory_order_relaxed);
+  // A correction only means something on the grid we were already following
+  bool sameGrid = scheduleEpoch == frame.epoch;
+  uint64_t previousTickUs = tickSchedule.tickUs(frame.counter);
+  scheduleEpoch = frame.epoch;
+  eventTrace.add(TRACE_SYNC_APPLIED, atUs, frame.flags, frame.seq, frame.epoch, frame.counter);
+  uint64_t tickUs;
+  if (frame.flags & SYNC_FLAG_CLIENT_CLOCK) {
+    tickUs = widenUs(frame.phaseUs, atUs);
+  } else {
+    tickUs = atUs - frame.phaseUs;
+  }
+  if (config.driftCompensation) {
+    drift.update(frame.epoch, frame.counter, tickUs, COUNTER_INTERVAL_US);
+  }
+  setSchedule(frame.counter, tickUs, drift.intervalUs(COUNTER_INTERVAL_US));
+  healthMetrics.count(METRIC_SYNCS_APPLIED);
+  if (sameGrid) {
+    uint64_t correction = tickUs > previousTickUs ? tickUs - previousTickUs : previousTickUs - tickUs;
+    healthMetrics.record(METRIC_TICK_CORRECTION_US, (unsigned long)std::min(correction, (uint64_t)UINT32_MAX));
+  }
+  uint64_t currentTime = transport.now();
+  recordSyncApplied(currentTime);
+  BLESYNC_LOGD("Timing Sync: Counter=%u, Current=%llu, Seq=%u, %s phase",
+               frame.counter, (unsigned long long)currentTime, frame.seq,
+               (frame.flags & SYNC_FLAG_CLIENT_CLOCK) ? "offset-corrected" : "uncorrected");
+  BLESYNC_LOGD("Timing Sync: Set lastCounterUpdateUs to %llu (next increment in %lld us)",
+               (unsigned long long)lastCounterUpdateUs,
+               (long long)(tickSchedule.tickUs(localCounter + 1) - transport.micros()));
+}
+
+// Moves the counter onto a new tick grid and re-arms the tick timer for
+// the next tick on it
+void BLESyncNode::setSchedule(uint32_t counter, uint64_t tickUs, uint32_t intervalUs) {
+  uint64_t nowUs = transport.micros();
+  tickSchedule.anchorCounter = counter;
+  tickSchedule.anchorUs = tickUs;
+  tickSchedule.intervalUs = intervalUs;
+  publishedSchedule.publish(tickSchedule);
+  localCounter = tickSchedule.counterAt(nowUs);
+  lastCounterUpdateUs = tickSchedule.tickUs(localCounter);
+  visibleCounter.store(localCounter, std::memory_order_relaxed);
+  if (config.timerTicks) {
+    transport.armTimer(tickSchedule.tickUs(localCounter + 1));
+  }
+}
+
+// Runs on the timer task, not in loop(): the counter moves on time here
+// and the tick is handed to loop() through the event queue for the GATT
+// update and notification. A schedule published since we read it gets
+// re-applied when loop() handles the tick.
+void BLESyncNode::onTickTimer(void* context, uint64_t firedUs) {
+  BLESyncNode* self = (BLESyncNode*)context;
+  TickSchedule schedule = self->publishedSchedule.read();
+  uint32_t counter = schedule.counterAt(firedUs);
+  self->visibleCounter.store(counter, std::memory_order_relaxed);
+  self->transport.armTimer(schedule.tickUs(counter + 1));
+  if (!self->tickPending.exchange(true, std::memory_order_relaxed) &&
+      !self->post(EVT_TICK, std::string(), CHAR_COUNTER, nullptr, 0, (int32_t)counter)) {
+    self->tickPending.store(false, std::memory_order_relaxed);
+  }
+}
+
+// firedUs is when the tick took effect: the timer's expiry, or now when
+// loop() polls for ticks. Either way the counter follows the current
+// schedule and jumps if ticks were missed.
+void BLESyncNode::handleTick(uint64_t firedUs) {
+  uint64_t nowUs = transport.micros();
+  uint32_t counter = tickSchedule.counterAt(nowUs);
+  if (counter == localCounter) {
+    return;
+  }
+  uint64_t dueUs = tickSchedule.tickUs(counter);
+  syncStats.tickLateness.record((unsigned long)(firedUs - tickSchedule.tickUs(tickSchedule.counterAt(firedUs))));
+  syncStats.tickNotifyDelay.record((unsigned long)(nowUs - dueUs));
+  localCounter = counter;
+  lastCounterUpdateUs = dueUs;
+  visibleCounter.store(counter, std::memory_order_relaxed);
+  eventTrace.add(TRACE_TICK, dueUs, 0, 0, scheduleEpoch, counter);
+  updateCounter();
+}
+
+// Timed reads of CHAR_TIMESTAMP sample our clock (see sampleClock). This one
+// is answered in place, on the BLE host task, because the stamp has to be
+// taken while the read is being served.
+void BLESyncNode::onRead(BLESyncChar id) {
+  if (id == CHAR_TIMESTAMP) {
+    publishTimestamp();
+  }
+}
+
+// CHAR_TIMESTAMP: u64 micros() now, u64 micros() at our last tick, u32
+// counter, u16 seq of the last sync frame we applied, all little-endian.
+// 22 bytes still fits one read response at the default MTU.
+#define TIMESTAMP_LEN 22
+#define TIMESTAMP_LEN_NO_SEQ 20   // older firmware: no applied seq
+#define TIMESTAMP_LEN_32BIT 12    // older still: the clock fields as u32
+
+// Runs only from onRead(), so the host task is the value's one writer. It
+// reads nothing loop() writes directly: the tick and counter both come
+// from one read of the published schedule, so they can't tear or belong
+// to different ticks, and the applied seq is its own atomic.
+void BLESyncNode::publishTimestamp() {
+  uint64_t nowUs = transport.micros();
+  TickSchedule schedule = publishedSchedule.read();
+  uint32_t counter = schedule.counterAt(nowUs);
+  uint8_t stamp[TIMESTAMP_LEN];
+  putU64(stamp, nowUs);
+  putU64(stamp + 8, schedule.tickUs(counter));
+  putU32(stamp + 16, counter);
+  putU16(stamp + 20, visibleAppliedSeq.load(std::memory_order_relaxed));
+  transport.setLocalValue(CHAR_TIMESTAMP, stamp, sizeof(stamp));
+}
+
+// One NTP-style exchange: our clock either side of a read of the peer's.
+// The same read returns where the peer's last tick fell.
+bool BLESyncNode::sampleClock(SyncPeer& peer) {
+  uint64_t t1 = transport.micros();
+  std::string value;
+  if (!transport.read(peer.address, CHAR_TIMESTAMP, value) || value.length() < 4) {
+    return false;
+  }
+  uint64_t t4 = transport.micros();
+  const uint8_t* stamp = (const uint8_t*)value.data();
+  uint64_t t2;
+  if (value.length() >= TIMESTAMP_LEN_NO_SEQ) {
+    t2 = getU64(stamp);
+    peer.haveTick = true;
+    peer.tickUs = getU64(stamp + 8);
+    peer.lastCounter = getU32(stamp + 16);
+    peer.haveAppliedSeq = value.length() >= TIMESTAMP_LEN;
+    if (peer.haveAppliedSeq) {
+      peer.appliedSeq = getU16(stamp + 20);
+    }
+  } else {
+    // A 32-bit stamp only pins the offset modulo 2^32 us; widen it next to
+    // the estimate so far so it stays continuous across the peer's wrap
+    t2 = widenUs(getU32(stamp), t1 + peer.clock.offsetUs());
+    peer.haveTick = value.length() >= TIMESTAMP_LEN_32BIT;
+    if (peer.haveTick) {
+      peer.tickUs = widenUs(getU32(stamp + 4), t2);
+      peer.lastCounter = getU32(stamp + 8);
+    }
+  }
+  peer.clock.add(t1, t2, t4);
+  healthMetrics.record(METRIC_SYNC_RTT_US, (unsigned long)(t4 - t1));
+  int64_t offset = (int64_t)(t2 - t1) - (int64_t)(t4 - t1) / 2;
+  offset = std::max(std::min(offset, (int64_t)INT32_MAX), (int64_t)-INT32_MAX);
+  eventTrace.add(TRACE_CLOCK_SAMPLE, t1, (uint8_t)(&peer - peerTable), 0, (uint32_t)(int32_t)offset,
+                 (uint32_t)(t4 - t1));
+  return true;
+}
+
+// Our last tick minus the peer's matching tick, on the peer's clock
+int32_t BLESyncNode::phaseError(const SyncPeer& peer) const {
+  uint64_t masterTick = lastCounterUpdateUs + peer.clock.offsetUs();
+  int64_t ticksAhead = (int32_t)(localCounter - peer.lastCounter);
+  int64_t error = (int64_t)(masterTick - peer.tickUs) - ticksAhead * (int64_t)COUNTER_INTERVAL_US;
+  if (error > INT32_MAX) return INT32_MAX;
+  if (error < -INT32_MAX) return -INT32_MAX;
+  return (int32_t)error;
+}
+
+// Halve on a large correction, back off exponentially while the peer
+// stays aligned. Errors within the round-trip jitter are measurement
+// noise, which more frequent syncs can't fix.
+void BLESyncNode::adaptSyncInterval(SyncPeer& peer, int32_t errorUs) {
+  uint32_t magnitude = errorUs < 0 ? -(uint32_t)errorUs : (uint32_t)errorUs;
+  uint32_t noise = peer.clock.delayJitterUs();
+  syncStats.syncCorrection.record(magnitude);
+  if (magnitude > SYNC_ERROR_HIGH_US + 2 * noise) {
+    peer.syncIntervalMs = std::max(peer.syncIntervalMs / 2, config.syncIntervalMinMs);
+  } else if (magnitude < SYNC_ERROR_LOW_US + noise) {
+    peer.syncIntervalMs = std::min(peer.syncIntervalMs * 2, config.syncIntervalMaxMs);
+  }
+}
+
+// The client notifies its counter on every tick. The master compares it to
+// its own and pushes a sync straight away instead of waiting for
+// the sync interval; ticks landing either side of ours differ by one.
+void BLESyncNode::handleNotify(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) {
+  SyncPeer* peer = findPeer(address);
+  if (id != CHAR_COUNTER || len != 4 || !master() || peer == nullptr) {
+    return;
+  }
+  uint32_t counter;
+  memcpy(&counter, data, 4);
+  peer->lastCounter = counter;
+  int32_t diff = (int32_t)(counter - localCounter);
+  if (diff > 1 || diff < -1) {
+    BLESYNC_LOGI("Master: Client %s counter %u diverged from %u, syncing now",
+                 address.c_str(), counter, localCounter);
+    peer->syncPending = true;
+    doSyncNow = true;
+  }
+}
+
+// Longer uptime wins, as before; an existing master beats an unassigned
+// node. Uptimes within ROLE_UPTIME_MARGIN (token staleness) and competing
+// masters fall back to the MAC tiebreaker.
+bool BLESyncNode::winsAgainst(const RoleToken& peer, const std::string& peerAddress, bool& tieBroken) {
+  tieBroken = false;
+  bool localMaster = master();
+  bool peerMaster = (peer.flags & ROLE_FLAG_MASTER) != 0;
+  if (localMaster != peerMaster) {
+    return localMaster;
+  }
+  if (!localMaster) {
+    uint32_t localUptime = (uint32_t)(transport.now() / 1000);
+    if (localUptime > peer.uptimeSec + ROLE_UPTIME_MARGIN) {
+      return true;
+    }
+    if (peer.uptimeSec > localUptime + ROLE_UPTIME_MARGIN) {
+      return false;
+    }
+  }
+  tieBroken = true;
+  return transport.localAddress() < peerAddress;
+}
+
+SyncPeer* BLESyncNode::findPeer(const std::string& address) {
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (!peerTable[i].address.empty() && peerTable[i].address == address) {
+      return &peerTable[i];
+    }
+  }
+  return nullptr;
+}
+
+SyncPeer* BLESyncNode::addPeer(const std::string& address) {
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (peerTable[i].address.empty()) {
+      peerTable[i] = SyncPeer();
+      peerTable[i].address = address;
+      notifyMail[i].addressTag.store(traceAddressTag(address), std::memory_order_release);
+      peerCount++;
+      if ((uint32_t)peerCount > syncStats.peakPeers) {
+        syncStats.peakPeers = peerCount;
       }
+      return &peerTable[i];
     }
-};
+  }
+  return nullptr;
+}
 
-static void setupBLEServer() {
-  pServer = BLEDevice::createServer();
-  pServer->setCallbacks(new MyServerCallbacks());
-  pService = pServer->createService(SERVICE_UUID);
-  pCounterCharacteristic = pService->createCharacteristic(
-    COUNTER_CHARACTERISTIC_UUID,
-    BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY
-  );
-  pSyncCharacteristic = pService->createCharacteristic(
-    SYNC_CHARACTERISTIC_UUID,
-    BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE
-  );
-  pTimestampCharacteristic = pService->createCharacteristic(
-    TIMESTAMP_CHARACTERISTIC_UUID,
-    BLECharacteristic::PROPERTY_READ
-  );
-  pSyncCharacteristic->setCallbacks(new MySyncCallback());
-  uint32_t initialUptime = millis();
-  pTimestampCharacteristic->setValue((uint8_t*)&initialUptime, 4);
-  pCounterCharacteristic->addDescriptor(new BLE2902());
-  pService->start();
-  BLEAdvertising* pAdvertising = BLEDevice::getAdvertising();
-  pAdvertising->addServiceUUID(SERVICE_UUID);
-  pAdvertising->setScanResponse(true);
-  pAdvertising->setMinPreferred(0x06);
-  pAdvertising->setMinPreferred(0x12);
-  pAdvertising->start();
-  Serial.println("BLE Server started and advertising");
-}
-
-static void setupBLEClient() {
-  BLEScan* pBLEScan = BLEDevice::getScan();
-  pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks());
-  pBLEScan->setInterval(1349);
-  pBLEScan->setWindow(449);
-  pBLEScan->setActiveScan(true);
-  Serial.println("BLE Client scanner configured");
-}
-
-static void performRoleNegotiation() {
-  if (!serverConnected || roleAssigned) {
+// The disconnect events that follow find no peer and are ignored
+void BLESyncNode::disconnectPeers() {
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (!peerTable[i].address.empty()) {
+      transport.disconnect(peerTable[i].address);
+      notifyMail[i].addressTag.store(0, std::memory_order_relaxed);
+      peerTable[i].address.clear();
+    }
+  }
+  peerCount = 0;
+}
+
+void BLESyncNode::advertiseRoleToken() {
+  RoleToken token;
+  token.version = ROLE_TOKEN_VERSION;
+  token.flags = master() ? ROLE_FLAG_MASTER : 0;
+  token.uptimeSec = (uint32_t)(transport.now() / 1000);
+  uint8_t encoded[ROLE_TOKEN_LEN];
+  encodeRoleToken(token, encoded);
+  transport.setAdvertisedToken(encoded, sizeof(encoded));
+  lastTokenUpdate = transport.now();
+}
+
+// Advertised device scanner
+void BLESyncNode::handleScanResult(const std::string& address, const uint8_t* token, size_t tokenLen) {
+  RoleToken peer;
+  if (!decodeRoleToken(token, tokenLen, peer)) {
+    BLESYNC_LOGD("Ignoring %s: no role token", address.c_str());
     return;
   }
-  Serial.println("Server: Connected without role assignment, forcing disconnection for proper negotiation");
-  if (pServer != nullptr) {
-    pServer->disconnect(0);
+  if (linkState == LINK_RECONNECTING) {
+    reconnectSeen(address, peer);
+    return;
   }
-  serverConnected = false;
-  roleAssigned = false;
-  isMaster = false;
-  isClient = false;
-  doScan = true;
-  Serial.println("Server: Forced disconnect complete, will scan for proper reconnection");
-}
-
-static bool connectToServer() {
-  Serial.printf("Attempting to connect to %s\n", targetDevice->getAddress().toString().c_str());
-  if (pClient != nullptr) {
-    if (pClient->isConnected()) {
-      pClient->disconnect();
-    }
-    delete pClient;
-    pClient = nullptr;
-  }
-  pClient = BLEDevice::createClient();
-  pClient->setClientCallbacks(new MyClientCallback());
-  Serial.println("Connecting to server...");
-  if (!pClient->connect(targetDevice)) {
-    Serial.println("Failed to connect to server - connection timeout or refused");
-    delete pClient;
-    pClient = nullptr;
-    doConnect = false;
-    doScan = true;
+  if (linkState != LINK_SCANNING || peerCount >= BLESYNC_MAX_PEERS) {
+    BLESYNC_LOGD("Already properly connected, ignoring found device");
+    return;
+  }
+  if (findPeer(address) != nullptr) {
+    return;
+  }
+  bool tieBroken;
+  bool wins = winsAgainst(peer, address, tieBroken);
+  eventTrace.add(TRACE_SCAN_RESULT, transport.micros(), wins, 0, traceAddressTag(address));
+  healthMetrics.count(wins ? METRIC_NEGOTIATE_WON : METRIC_NEGOTIATE_LOST);
+  if (tieBroken) {
+    healthMetrics.count(METRIC_NEGOTIATE_TIEBREAK);
+  }
+  if (!wins) {
+    BLESYNC_LOGD("Peer %s outranks us, waiting for it to connect", address.c_str());
+    return;
+  }
+  targetAddress = address;
+  unsigned long backoff = 0;
+  if (tieBroken) {
+    backoff = random(config.connectBackoffMinMs, config.connectBackoffMaxMs + 1);
+    BLESYNC_LOGI("Delaying connection by %lu ms (role decided by MAC tiebreaker)", backoff);
+  }
+  syncStats.connectBackoff.record(backoff * 1000);
+  transitionTo(LINK_NEGOTIATING);
+  armStateTimer(backoff);
+}
+
+void BLESyncNode::handleScanComplete(int deviceCount) {
+  if (linkState == LINK_SCANNING) {
+    BLESYNC_LOGI("Scan complete: Found %d devices", deviceCount);
+    settle();
+  }
+}
+
+void BLESyncNode::recordSyncApplied(uint64_t currentTime) {
+  if (syncStats.syncsApplied++ == 0) {
+    syncStats.firstSyncTime = currentTime;
+  }
+  if (serverConnectUs != 0) {
+    syncStats.connectToSync.record((unsigned long)(transport.micros() - serverConnectUs));
+    serverConnectUs = 0;
+  }
+  if (awaitingResync) {
+    uint64_t resyncUs = (currentTime - linkLostTime) * 1000;
+    syncStats.resyncLatency.record((unsigned long)std::min(resyncUs, (uint64_t)UINT32_MAX));
+    awaitingResync = false;
+  }
+}
+
+void BLESyncNode::recordLinkLost() {
+  healthMetrics.count(METRIC_LINKS_LOST);
+  if (syncStats.syncsApplied > 0 && !awaitingResync) {
+    awaitingResync = true;
+    linkLostTime = transport.now();
+  }
+}
+
+// Only the node that won on role tokens gets here, so connecting makes us
+// master; no timestamp read or forced disconnect is needed. A master keeps
+// adding clients this way until it holds BLESYNC_MAX_PEERS. A peer just
+// seen in a scan gets the stack's own connect timeout.
+bool BLESyncNode::connectToServer(unsigned long connectTimeoutMs) {
+  BLESYNC_LOGI("Attempting to connect to %s", targetAddress.c_str());
+  BLESYNC_LOGI("Connecting to server...");
+  transitionTo(LINK_CONNECTING);
+  if (!transport.connect(targetAddress, connectTimeoutMs)) {
+    BLESYNC_LOGW("Failed to connect to server - connection timeout or refused");
+    targetAddress.clear();
+    seekPeers();
     return false;
   }
-  Serial.println("Connected to server");
-  Serial.println("Getting service...");
-  pRemoteService = pClient->getService(SERVICE_UUID);
-  if (pRemoteService == nullptr) {
-    Serial.println("Failed to find service UUID");
-    pClient->disconnect();
-    delete pClient;
-    pClient = nullptr;
-    doConnect = false;
-    doScan = true;
+  BLESYNC_LOGI("Connected to server");
+  BLESYNC_LOGI("Getting service...");
+  transitionTo(LINK_DISCOVERING);
+  if (!transport.discover(targetAddress)) {
+    transport.disconnect(targetAddress);
+    targetAddress.clear();
+    seekPeers();
     return false;
   }
-  Serial.println("Found service");
-  Serial.println("Getting characteristics...");
-  pRemoteCounterCharacteristic = pRemoteService->getCharacteristic(COUNTER_CHARACTERISTIC_UUID);
-  pRemoteSyncCharacteristic = pRemoteService->getCharacteristic(SYNC_CHARACTERISTIC_UUID);
-  pRemoteTimestampCharacteristic = pRemoteService->getCharacteristic(TIMESTAMP_CHARACTERISTIC_UUID);
-  if (pRemoteCounterCharacteristic == nullptr || pRemoteSyncCharacteristic == nullptr || pRemoteTimestampCharacteristic == nullptr) {
-    Serial.println("Failed to find characteristics");
-    pClient->disconnect();
-    delete pClient;
-    pClient = nullptr;
-    doConnect = false;
-    doScan = true;
+  BLESYNC_LOGI("Found characteristics");
+  if (syncStats.connects++ == 0) {
+    syncStats.firstConnectTime = transport.now();
+  }
+  bool wasMaster = master();
+  SyncPeer* peer = findPeer(targetAddress);
+  if (peer == nullptr) {
+    peer = addPeer(targetAddress);
+  }
+  if (peer == nullptr) {
+    transport.disconnect(targetAddress);
+    targetAddress.clear();
+    settle();
     return false;
   }
-  Serial.println("Found characteristics");
-  Serial.println("Reading remote timestamp...");
-  std::string remoteTimestampData = pRemoteTimestampCharacteristic->readValue();
-  if (remoteTimestampData.length() == 4) {
-    uint32_t remoteUptime;
-    memcpy(&remoteUptime, remoteTimestampData.data(), 4);
-    uint32_t currentUptime = millis();
-    Serial.printf("Local uptime: %lu\n", currentUptime);
-    Serial.printf("Remote uptime: %lu\n", remoteUptime);
-    if (currentUptime > remoteUptime) {
-      isMaster = true;
-      isClient = false;
-      Serial.println("ROLE: This device is MASTER (later boot time - been running longer)");
-    } else if (currentUptime < remoteUptime) {
-      isMaster = false;
-      isClient = true;
-      Serial.println("ROLE: This device is CLIENT (earlier boot time - just rebooted)");
-    } else {
-      String localMac = BLEDevice::getAddress().toString().c_str();
-      String remoteMac = targetDevice->getAddress().toString().c_str();
-      if (localMac < remoteMac) {
-        isMaster = true;
-        isClient = false;
-        Serial.println("ROLE: This device is MASTER (MAC address tiebreaker)");
-      } else {
-        isMaster = false;
-        isClient = true;
-        Serial.println("ROLE: This device is CLIENT (MAC address tiebreaker)");
-      }
+  if (!wasMaster && config.directReconnect && masterEpoch != 0 && scheduleEpoch == masterEpoch) {
+    // Still on the grid we last mastered, so a client coming back after a
+    // dropout keeps its phase and learned drift
+    BLESYNC_LOGI("ROLE: This device is MASTER again, resuming epoch %u", masterEpoch);
+  } else if (!wasMaster) {
+    BLESYNC_LOGI("ROLE: This device is MASTER (won on role token)");
+    // Our clock is now the reference
+    drift.reset();
+    setSchedule(localCounter, lastCounterUpdateUs, COUNTER_INTERVAL_US);
+    masterEpoch = (uint32_t)random(1, 0x7fffffff);
+    scheduleEpoch = masterEpoch;
+  }
+  // The first client stands for the rest, which keeps NVS writes down
+  // when several come back in a different order
+  if (config.directReconnect && peerCount == 1) {
+    transport.rememberPeer(targetAddress);
+  }
+  eventTrace.add(TRACE_LINK_UP, transport.micros(), 1, 0, traceAddressTag(targetAddress));
+  transitionTo(LINK_MASTER);
+  // connect() brought the link up on the sync profile; it stays there
+  // through the clock samples and first sync
+  peer->linkProfile = LINK_PROFILE_SYNC;
+  transport.linkInfo(targetAddress, peer->link);
+  BLESYNC_LOGD("Link: MTU %u, %u octets per packet, %s PHY", peer->link.attMtu, peer->link.txOctets,
+               peer->link.phy == BLE_PHY_2M ? "2M" : "1M");
+  peer->connectedAt = transport.now();
+  peer->syncIntervalMs = config.syncIntervalMs;
+  peer->lastSyncAt = peer->connectedAt;
+  if (config.clockOffsetEstimation) {
+    for (int i = 0; i < CLOCK_SAMPLES_ON_CONNECT; i++) {
+      sampleClock(*peer);
     }
-    roleAssigned = true;
+  }
+  peer->notifications = transport.subscribe(targetAddress, CHAR_COUNTER);
+  if (peer->notifications) {
+    BLESYNC_LOGI("Subscribed to client counter notifications");
   } else {
-    Serial.println("Failed to read remote timestamp");
-    pClient->disconnect();
-    delete pClient;
-    pClient = nullptr;
-    doConnect = false;
-    doScan = true;
-    return false;
+    BLESYNC_LOGI("Client refused counter notifications, syncing every sync interval only");
   }
-  if (isClient) {
-    BLEDevice::stopAdvertising();
-    clientConnected = true;
-    serverConnected = false;
-    Serial.println("Stopped advertising as server due to client role assignment");
-    BLEDevice::getScan()->stop();
-    doScan = false;
-  }  else if (isMaster) {
-    doScan = false;
-    clientConnected = true;
-    BLEDevice::getScan()->stop();
-    doConnect = false;
-    Serial.println("Stopped scanning and connecting as a client due to server role assignment");
-    BLEDevice::startAdvertising();
+  BLESYNC_LOGI("Master: %d/%d clients", peerCount, BLESYNC_MAX_PEERS);
+  advertiseRoleToken();
+  transport.startAdvertising();
+  peer->syncPending = true;
+  doSyncNow = true;
+  targetAddress.clear();
+  // Look for more clients straight away while there is room
+  if (peerCount < BLESYNC_MAX_PEERS) {
+    seekPeers();
   }
   return true;
 }
 
-static void performSync() {
-  if (clientConnected && pRemoteSyncCharacteristic != nullptr && roleAssigned) {
-    if (isMaster) {
-      struct {
-        uint32_t counter;
-        uint32_t timeSinceLastUpdate;
-      } syncPacket;
-      syncPacket.counter = localCounter;
-      syncPacket.timeSinceLastUpdate = millis() - lastCounterUpdate;
-      pRemoteSyncCharacteristic->writeValue((uint8_t*)&syncPacket, sizeof(syncPacket));
-      Serial.printf("Master: Sent timing sync - Counter: %d, TimeSinceUpdate: %lu\n", syncPacket.counter, syncPacket.timeSinceLastUpdate);
-    } else if (isClient) {
-      std::string value = pRemoteCounterCharacteristic->readValue();
-      if (value.length() == 4) {
-        memcpy(&remoteCounter, value.data(), 4);
-        Serial.printf("Client sync - Master counter: %d, Local counter: %d\n", remoteCounter, localCounter);
-        if (remoteCounter != localCounter) {
-          localCounter = remoteCounter;
-          Serial.printf("Client: Synchronized to master counter %d\n", localCounter);
-          pCounterCharacteristic->setValue((uint8_t*)&localCounter, 4);
-          if (serverConnected) {
-            pCounterCharacteristic->notify();
-          }
-        }
-      }
+// Writes the sync packet to every peer marked pending. The writes are
+// sequential, so the fan-out grows linearly with the number of clients.
+void BLESyncNode::performSync() {
+  if (!master()) {
+    return;
+  }
+  uint64_t fanoutStart = transport.micros();
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    SyncPeer& peer = peerTable[i];
+    if (peer.address.empty() || !peer.syncPending) {
+      continue;
+    }
+    // Each sync also refreshes the peer's clock filter and tells us how far
+    // its tick has wandered since the last one
+    uint64_t txStart = transport.micros();
+    bool sampled = config.clockOffsetEstimation && sampleClock(peer);
+    if (sampled && peer.haveTick && config.adaptiveSyncInterval && peer.syncsSent > 0) {
+      adaptSyncInterval(peer, phaseError(peer));
+    }
+    // The timestamp also names the last frame the client applied. A write
+    // command can go missing without an error, e.g. to a client whose
+    // characteristic doesn't take commands.
+    if (sampled && peer.haveAppliedSeq && peer.syncsSent > 0 && peer.appliedSeq != peer.lastSeq &&
+        transport.now() - peer.lastSyncAt >= SYNC_APPLY_GRACE_MS) {
+      healthMetrics.count(METRIC_SYNCS_LOST);
+      BLESYNC_LOGW("Master: %s never applied sync seq %u (last applied %u)",
+                   peer.address.c_str(), peer.lastSeq, peer.appliedSeq);
+      peer.syncsSinceAck = SYNC_ACK_EVERY;
+    }
+    SyncFrame frame;
+    frame.seq = ++syncSeq;
+    frame.counter = localCounter;
+    frame.epoch = masterEpoch;
+    if (peer.clock.valid()) {
+      frame.phaseUs = (uint32_t)(lastCounterUpdateUs + peer.clock.offsetUs());
+      frame.flags = SYNC_FLAG_CLIENT_CLOCK;
+    } else {
+      frame.phaseUs = (uint32_t)(transport.micros() - lastCounterUpdateUs);
+      frame.flags = 0;
+    }
+    uint8_t encoded[SYNC_FRAME_LEN];
+    size_t len = encodeSyncFrame(frame, encoded);
+    peer.syncPending = false;
+    bool acked = !config.syncWriteNoResponse || peer.syncsSinceAck >= SYNC_ACK_EVERY - 1;
+    uint64_t writeStart = transport.micros();
+    bool sent = acked ? transport.write(peer.address, CHAR_SYNC, encoded, len)
+                      : transport.writeNoResponse(peer.address, CHAR_SYNC, encoded, len);
+    syncStats.syncWrite.record((unsigned long)(transport.micros() - writeStart));
+    if (sent) {
+      peer.syncsSent++;
+      peer.lastSeq = frame.seq;
+      // ATT handles a link's PDUs in order, so a write response also means
+      // the commands before it arrived
+      peer.syncsSinceAck = acked ? 0 : peer.syncsSinceAck + 1;
+      healthMetrics.count(METRIC_SYNCS_SENT);
+    } else {
+      peer.syncsSinceAck = SYNC_ACK_EVERY;
+      healthMetrics.count(METRIC_SYNC_WRITES_FAILED);
     }
+    peer.lastSyncAt = transport.now();
+    if (config.linkProfileSwitching && timeUntil(peer.lastSyncAt, nextSyncAt(peer)) >= LINK_PROFILE_IDLE_MIN_MS) {
+      setLinkProfile(peer, LINK_PROFILE_IDLE);
+    }
+    syncStats.syncRadioUs += transport.micros() - txStart;
+    syncStats.syncTransactions++;
+    eventTrace.add(TRACE_SYNC_SENT, txStart, (uint8_t)i, frame.seq, masterEpoch, (uint32_t)(transport.micros() - txStart));
+    BLESYNC_LOGD("Master: Sent timing sync to %s - Counter: %u, Phase: %uus, Seq: %u",
+                 peer.address.c_str(), frame.counter, frame.phaseUs, frame.seq);
   }
+  syncStats.syncFanout.record((unsigned long)(transport.micros() - fanoutStart));
+}
+
+// When loop() will next mark the peer for a sync, barring a diverged
+// counter
+uint64_t BLESyncNode::nextSyncAt(const SyncPeer& peer) const {
+  bool adaptive = config.adaptiveSyncInterval && config.clockOffsetEstimation;
+  return adaptive ? peer.lastSyncAt + peer.syncIntervalMs : lastSyncTime + config.syncIntervalMs;
 }
 
-static void updateCounter() {
-  if (!roleAssigned) {
-    localCounter++;
-    Serial.printf("Standalone counter: %d\n", localCounter);
+// Idle links are brought back to the sync profile LINK_PROFILE_LEAD_MS
+// ahead of their sync, since the switch only lands six connection events
+// after it is asked for. Syncs for a diverged counter go out on whatever
+// profile the link is on. A refused switch waits LINK_PROFILE_RETRY_MS
+// before the next try, so loop() doesn't spin on it.
+void BLESyncNode::setLinkProfile(SyncPeer& peer, BLELinkProfile profile) {
+  if (peer.linkProfile == profile || transport.now() < peer.profileRetryAt) {
+    return;
+  }
+  if (transport.setLinkProfile(peer.address, profile)) {
+    peer.linkProfile = profile;
+    peer.profileRetryAt = 0;
+    BLESYNC_LOGD("Master: %s link profile %s", peer.address.c_str(), BLE_LINK_PROFILES[profile].name);
   } else {
-    if (isMaster) {
-      localCounter++;
-      Serial.printf("Master counter: %d\n", localCounter);
-    } else if (isClient) {
-      localCounter++;
-      if (clientConnected) {
-        Serial.printf("Client counter (connected): %d\n", localCounter);
-      } else {
-        Serial.printf("Client counter (standalone): %d\n", localCounter);
-      }
+    peer.profileRetryAt = transport.now() + LINK_PROFILE_RETRY_MS;
+    BLESYNC_LOGD("Master: %s link profile %s refused", peer.address.c_str(), BLE_LINK_PROFILES[profile].name);
+  }
+}
+
+void BLESyncNode::updateCounter() {
+  if (master()) {
+    BLESYNC_LOGD("Master counter: %u", localCounter);
+  } else if (linkState == LINK_CLIENT) {
+    if (serverConnected) {
+      BLESYNC_LOGD("Client counter (connected): %u", localCounter);
+    } else {
+      BLESYNC_LOGD("Client counter (standalone): %u", localCounter);
     }
+  } else {
+    BLESYNC_LOGD("Standalone counter: %u", localCounter);
   }
-  pCounterCharacteristic->setValue((uint8_t*)&localCounter, 4);
+  transport.setLocalValue(CHAR_COUNTER, (uint8_t*)&localCounter, 4);
   if (serverConnected) {
-    pCounterCharacteristic->notify();
+    transport.notify(CHAR_COUNTER);
   }
 }
 
-void resetConnectionState() {
-  Serial.println("Connection Reset: Cleaning up connection state");
-  if (pClient != nullptr) {
-    if (pClient->isConnected()) {
-      pClient->disconnect();
-    }
-    delete pClient;
-    pClient = nullptr;
-  }
-  pRemoteService = nullptr;
-  pRemoteCounterCharacteristic = nullptr;
-  pRemoteSyncCharacteristic = nullptr;
-  pRemoteTimestampCharacteristic = nullptr;
-  if (targetDevice != nullptr) {
-    delete targetDevice;
-    targetDevice = nullptr;
-  }
-  clientConnected = false;
-  doConnect = false;
-  if (roleAssigned) {
-    Serial.println("Connection Reset: Resetting role assignment");
-    roleAssigned = false;
-    isMaster = false;
-    isClient = false;
-  }
-  BLEDevice::startAdvertising();
-  doScan = true;
-  Serial.println("Connection state reset - ready for reconnection");
+void BLESyncNode::resetConnectionState() {
+  BLESYNC_LOGI("Connection Reset: Cleaning up connection state");
+  if (hasRole()) {
+    BLESYNC_LOGI("Connection Reset: Resetting role assignment");
+  }
+  disconnectPeers();
+  targetAddress.clear();
+  lostPeerCount = 0;
+  transport.startAdvertising();
+  advertiseRoleToken();
+  transitionTo(LINK_SCANNING);
+  BLESYNC_LOGI("Connection state reset - ready for reconnection");
 }
 
-void BLESync_setup() {
-  uint64_t chipid = ESP.getEfuseMac();
-  deviceName = "ESP32Counter_" + String((uint16_t)(chipid >> 32), HEX);
-  bootTimestamp = millis();
-  Serial.printf("Starting %s...\n", deviceName.c_str());
-  Serial.printf("Boot timestamp: %lu\n", bootTimestamp);
-  BLEDevice::init(deviceName.c_str());
-  setupBLEServer();
-  setupBLEClient();
-  doScan = true;
-  lastScanAttempt = millis();
-  randomSeed(esp_random());
-  Serial.println("Setup complete!");
+void BLESyncNode::setup(const std::string& name) {
+  deviceName = name;
+  bootTimestamp = transport.now();
+  transport.setTimerCallback(&BLESyncNode::onTickTimer, this);
+  BLESYNC_LOGI("Starting %s...", deviceName.c_str());
+  BLESYNC_LOGI("Boot timestamp: %llu", (unsigned long long)bootTimestamp);
+  transport.init(deviceName.c_str());
+  setSchedule(0, transport.micros(), COUNTER_INTERVAL_US);
+  publishMetrics();
+  advertiseRoleToken();
+  // Idle until the first loop(), which starts the first scan
+  stateEnteredUs = transport.micros();
+  armStateTimer(0);
+  // After a reboot, the last client we held is looked for before the
+  // first scan. Our uptime is short now, so unless it is unassigned it has
+  // likely found a master, or become one, and we leave it be.
+  std::string lastPeer;
+  if (config.directReconnect && transport.lastPeer(lastPeer)) {
+    BLESYNC_LOGI("Last peer %s, looking for it before the first scan", lastPeer.c_str());
+    queueReconnect(lastPeer);
+    transitionTo(LINK_RECONNECTING);
+  }
+  BLESYNC_LOGI("Setup complete!");
 }
 
-void BLESync_loop() {
-  unsigned long currentTime = millis();
-  if (doRoleNegotiation) {
-    performRoleNegotiation();
-    doRoleNegotiation = false;
+void BLESyncNode::loop() {
+  uint64_t loopStart = transport.micros();
+  drainEvents();
+  uint64_t currentTime = transport.now();
+  if (currentTime - lastTokenUpdate >= ROLE_TOKEN_INTERVAL && linkState != LINK_CLIENT) {
+    advertiseRoleToken();
   }
-  if (currentTime - lastCounterUpdate >= COUNTER_INTERVAL) {
-    updateCounter();
-    lastCounterUpdate = currentTime;
+  // Ticks follow the schedule rather than the time loop() noticed them,
+  // so loop latency doesn't pile up into phase error. A client's interval
+  // is the master's as measured on our clock.
+  if (!config.timerTicks) {
+    uint64_t nowUs = transport.micros();
+    if (tickSchedule.counterAt(nowUs) != localCounter) {
+      handleTick(nowUs);
+    }
   }
-  if (currentTime - lastSyncTime >= SYNC_INTERVAL) {
-    if (clientConnected && roleAssigned) {
-      performSync();
+  // The fixed schedule keeps running as a baseline for the radio-time
+  // report; with the adaptive one on, each peer is synced on its own timer
+  bool adaptive = config.adaptiveSyncInterval && config.clockOffsetEstimation;
+  if (currentTime - lastSyncTime >= config.syncIntervalMs) {
+    syncStats.fixedIntervalSyncs += peerCount;
+    for (int i = 0; i < BLESYNC_MAX_PEERS && !adaptive; i++) {
+      peerTable[i].syncPending = true;
+      doSyncNow = true;
     }
     lastSyncTime = currentTime;
   }
-  if (doScan) {
-    Serial.println("Starting BLE scan...");
-    BLEScanResults foundDevices = BLEDevice::getScan()->start(SCAN_TIME, false);
-    int deviceCount = foundDevices.getCount();
-    Serial.printf("Scan complete: Found %d devices\n", deviceCount);
-    for (int i = 0; i < deviceCount; i++) {
-      BLEAdvertisedDevice device = foundDevices.getDevice(i);
-      if (device.haveServiceUUID() && 
-          device.isAdvertisingService(BLEUUID(SERVICE_UUID))){
-        Serial.printf("Device %d: %s - Has our service\n", i, device.getAddress().toString().c_str());
-      }
+  for (int i = 0; i < BLESYNC_MAX_PEERS && adaptive; i++) {
+    SyncPeer& peer = peerTable[i];
+    if (!peer.address.empty() && currentTime - peer.lastSyncAt >= peer.syncIntervalMs) {
+      peer.syncPending = true;
+      doSyncNow = true;
     }
-    doScan = false;
-    lastScanAttempt = currentTime;
-  }
-  if (doConnect) {
-    if (connectAttemptStartTime == 0) {
-      connectAttemptStartTime = currentTime;
-      Serial.println("Starting connection attempt...");
-    }
-    if (currentTime - connectAttemptStartTime > CONNECTION_TIMEOUT) {
-      Serial.println("Connection attempt timed out, resetting...");
-      doConnect = false;
-      connectAttemptStartTime = 0;
-      doScan = true;
-      if (targetDevice != nullptr) {
-        delete targetDevice;
-        targetDevice = nullptr;
-      }
-    } else {
-      if (connectToServer()) {
-        Serial.println("Successfully connected to server and role assigned");
-        connectAttemptStartTime = 0;
-      } else {
-        Serial.println("Failed to connect to server or assign role");
-        connectAttemptStartTime = 0;
-      }
-      doConnect = false;
+  }
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    SyncPeer& peer = peerTable[i];
+    if (!peer.address.empty() && peer.linkProfile == LINK_PROFILE_IDLE &&
+        timeUntil(currentTime, nextSyncAt(peer)) <= LINK_PROFILE_LEAD_MS) {
+      setLinkProfile(peer, LINK_PROFILE_SYNC);
     }
   }
-  static unsigned long lastStatusPrint = 0;
+  if (doSyncNow) {
+    performSync();
+    doSyncNow = false;
+  }
+  serviceStateTimer(currentTime);
   if (currentTime - lastStatusPrint >= STATUS_PRINT_INTERVAL) {
-    Serial.printf("Status - Role: %s, ClientConnToServer: %s, ServerConnToClient: %s, Counter: %d, doConnect: %s, doScan: %s\n", 
-                 roleAssigned ? (isMaster ? "MASTER" : "CLIENT") : "UNASSIGNED",
-                 clientConnected ? "YES" : "NO",
-                 serverConnected ? "YES" : "NO",
-                 localCounter,
-                 doConnect ? "YES" : "NO",
-                 doScan ? "YES" : "NO");
+    printStatus();
     lastStatusPrint = currentTime;
   }
-  if ((!clientConnected && !serverConnected) || !roleAssigned) {
-    if (!doScan && !doConnect && (currentTime - lastScanAttempt >= RESCAN_INTERVAL)) {
-      Serial.println("No proper connection/role, starting periodic scan...");
-      doScan = true;
+  if (currentTime - lastMetricsPublish >= METRICS_PUBLISH_INTERVAL) {
+    publishMetrics();
+  }
+  if (metricsReportRequested.exchange(false, std::memory_order_relaxed)) {
+    printMetrics();
+  }
+  syncStats.loopLatency.record((unsigned long)(transport.micros() - loopStart));
+}
+
+void BLESyncNode::printStatus() {
+#if BLESYNC_LOG_LEVEL >= BLESYNC_LOG_INFO
+  BLESYNC_LOGI("Status - Role: %s, State: %s, Peers: %d, ServerConnToClient: %s, Counter: %u",
+               master() ? "MASTER" : (hasRole() ? "CLIENT" : "UNASSIGNED"),
+               stateName(linkState),
+               peerCount,
+               serverConnected ? "YES" : "NO",
+               localCounter);
+  char line[BLESYNC_LOG_LINE_MAX];
+  BLESYNC_LOGI("%s", syncStats.loopLatency.format(line, sizeof(line), "Loop latency"));
+#ifdef ARDUINO
+  // A minimum that keeps falling, or a largest block shrinking away from
+  // the free total, is a leak or fragmentation
+  BLESYNC_LOGI("Heap: free=%u min_free=%u largest_block=%u",
+               (unsigned)ESP.getFreeHeap(), (unsigned)ESP.getMinFreeHeap(), (unsigned)ESP.getMaxAllocHeap());
+#endif
+  size_t used = snprintf(line, sizeof(line), "State time:");
+  for (int s = 0; s < LINK_STATE_COUNT && used < sizeof(line); s++) {
+    used += snprintf(line + used, sizeof(line) - used, " %s=%llums/%u", stateName((LinkState)s),
+                     syncStats.stateTimeUs[s] / 1000, syncStats.stateEntries[s]);
+  }
+  BLESYNC_LOGI("%s", line);
+  if (master()) {
+    BLESYNC_LOGI("%s", syncStats.syncFanout.format(line, sizeof(line), "Sync fan-out"));
+    BLESYNC_LOGI("%s", syncStats.syncWrite.format(line, sizeof(line), "Sync write"));
+    BLESYNC_LOGI("%s", syncStats.syncCorrection.format(line, sizeof(line), "Sync correction"));
+    if (syncStats.syncTransactions > 0) {
+      unsigned long long perSync = syncStats.syncRadioUs / syncStats.syncTransactions;
+      unsigned long long fixedUs = perSync * syncStats.fixedIntervalSyncs;
+      BLESYNC_LOGI("Sync radio time: %llu ms in %u syncs, ~%llu ms at the fixed interval",
+                   syncStats.syncRadioUs / 1000, syncStats.syncTransactions, fixedUs / 1000);
+    }
+    for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+      SyncPeer& peer = peerTable[i];
+      if (peer.address.empty()) {
+        continue;
+      }
+      // Data length and PHY updates finish after connect returns
+      transport.linkInfo(peer.address, peer.link);
+      BLESYNC_LOGI("Peer %s link: MTU %u (%u bytes per write), %u octets per packet, %s PHY",
+                   peer.address.c_str(), peer.link.attMtu, (unsigned)attPayloadLen(peer.link.attMtu),
+                   peer.link.txOctets, peer.link.phy == BLE_PHY_2M ? "2M" : "1M");
+      if (peer.clock.valid()) {
+        BLESYNC_LOGI("Peer %s clock offset=%lldus delay=%luus jitter=%luus sync every %lums",
+                     peer.address.c_str(), (long long)peer.clock.offsetUs(),
+                     (unsigned long)peer.clock.delayUs(), (unsigned long)peer.clock.jitterUs(),
+                     peer.syncIntervalMs);
+      }
+    }
+  } else if (linkState == LINK_CLIENT) {
+    BLESYNC_LOGI("Clock drift vs master: %ld ppb", (long)drift.ppb);
+    BLESYNC_LOGI("%s", syncStats.connectToSync.format(line, sizeof(line), "Connect to first sync"));
+  }
+#endif
+}
+
+void BLESyncNode::publishMetrics() {
+  uint8_t encoded[METRICS_LEN];
+  healthMetrics.encode(encoded, (uint32_t)((transport.now() - bootTimestamp) / 1000));
+  transport.setLocalValue(CHAR_METRICS, encoded, sizeof(encoded));
+  lastMetricsPublish = transport.now();
+}
+
+void BLESyncNode::requestMetricsReport() {
+  metricsReportRequested.store(true, std::memory_order_relaxed);
+  if (wakeHook) {
+    wakeHook(wakeHookContext);
+  }
+}
+
+// Asked for, so printed whatever BLESYNC_LOG_LEVEL is
+void BLESyncNode::printMetrics() {
+  char line[BLESYNC_LOG_LINE_MAX];
+  size_t used = snprintf(line, sizeof(line), "Metrics: uptime=%lus",
+                         (unsigned long)((transport.now() - bootTimestamp) / 1000));
+  for (int i = 0; i < METRIC_COUNTER_COUNT && used < sizeof(line); i++) {
+    used += snprintf(line + used, sizeof(line) - used, " %s=%u",
+                     BLESyncMetrics::counterName((BLESyncCounterId)i), healthMetrics.counter((BLESyncCounterId)i));
+  }
+  BLESyncLog::write("%s", line);
+  for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+    BLESyncHistogramId id = (BLESyncHistogramId)i;
+    BLESyncLog::write("Metrics: %s", healthMetrics.histogram(id).format(line, sizeof(line), BLESyncMetrics::histogramName(id)));
+  }
+}
+
+// Mirrors the schedule loop() checks: the next tick, token refresh, sync,
+// state timeout, status print and metrics refresh
+uint32_t BLESyncNode::idleBudgetUs() {
+  if (doSyncNow || metricsReportRequested.load(std::memory_order_relaxed)) {
+    return 0;
+  }
+  uint64_t nowUs = transport.micros();
+  uint64_t currentTime = transport.now();
+  // Timer ticks wake us through the event queue
+  uint64_t untilTick = config.timerTicks ? UINT32_MAX : timeUntil(nowUs, tickSchedule.tickUs(localCounter + 1));
+  uint64_t ms = timeUntil(currentTime, lastStatusPrint + STATUS_PRINT_INTERVAL);
+  ms = std::min(ms, timeUntil(currentTime, lastMetricsPublish + METRICS_PUBLISH_INTERVAL));
+  ms = std::min(ms, timeUntil(currentTime, lastSyncTime + config.syncIntervalMs));
+  if (linkState != LINK_CLIENT) {
+    ms = std::min(ms, timeUntil(currentTime, lastTokenUpdate + ROLE_TOKEN_INTERVAL));
+  }
+  if (stateSpecs[linkState].onTimeout) {
+    ms = std::min(ms, timeUntil(currentTime, stateDeadline));
+  }
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    const SyncPeer& peer = peerTable[i];
+    if (!peer.address.empty()) {
+      ms = std::min(ms, timeUntil(currentTime, peer.lastSyncAt + peer.syncIntervalMs));
+    }
+    if (!peer.address.empty() && peer.linkProfile == LINK_PROFILE_IDLE) {
+      ms = std::min(ms, std::max(timeUntil(currentTime + LINK_PROFILE_LEAD_MS, nextSyncAt(peer)),
+                                 timeUntil(currentTime, peer.profileRetryAt)));
+    }
+  }
+  return (uint32_t)std::min(std::min(ms * 1000, untilTick), (uint64_t)UINT32_MAX);
+}
+
+#ifdef ARDUINO
+static BLETransportDevice deviceTransport;
+static BLESyncNode syncNode(deviceTransport);
+static BLESyncTask syncTask(syncNode);
+
+void BLESync_setup() {
+  BLESyncLog::startDrainTask();
+  uint64_t chipid = ESP.getEfuseMac();
+  String name = "ESP32Counter_" + String((uint16_t)(chipid >> 32), HEX);
+  randomSeed(esp_random());
+  syncNode.setup(name.c_str());
+  // For comparing the two stacks on the same board
+  BLESyncLog::write("BLE stack: %s, free heap after init: %u, sketch size: %u",
+                    BLESYNC_STACK_NAME, (unsigned)ESP.getFreeHeap(), (unsigned)ESP.getSketchSize());
+}
+
+// Collects a line from Serial without blocking and runs it
+static void pollSerialCommands() {
+  static char command[32];
+  static size_t used = 0;
+  while (Serial.available() > 0) {
+    char ch = (char)Serial.read();
+    if (ch != '\n' && ch != '\r') {
+      if (used < sizeof(command) - 1) {
+        command[used++] = ch;
+      }
+      continue;
+    }
+    command[used] = '\0';
+    if (strcmp(command, "metrics") == 0) {
+      syncNode.requestMetricsReport();
+    } else if (used > 0) {
+      BLESyncLog::write("Unknown command '%s' (try: metrics)", command);
     }
+    used = 0;
   }
-  if (randomScanDelay > 0 && (currentTime - scanDelayStart >= randomScanDelay)) {
-    doScan = true;
-    randomScanDelay = 0;
-    scanDelayStart = 0;
-    Serial.println("Randomized delay complete, starting scan.");
+}
+
+void BLESync_loop() {
+  pollSerialCommands();
+  if (!syncTask.running()) {
+    syncNode.loop();
   }
 }
+
+bool BLESync_startTask(const BLESyncTaskConfig& config) {
+  return syncTask.start(config);
+}
+
+void resetConnectionState() {
+  syncNode.resetConnectionState();
+}
+
+bool BLESync_saveTrace(const char* path) {
+  return syncNode.trace().save(path, deviceTransport.localAddress());
+}
+#endif
@@ -1,11 +1,381 @@
 #pragma once
-#include <Arduino.h>
+#include "BLEPlatform.h"
+#include "BLESyncLog.h"
+#include "BLESyncMetrics.h"
+#include "BLESyncTrace.h"
+#include "BLETransport.h"
+#include "ClockFilter.h"
+#include "DriftEstimator.h"
+#include "EventQueue.h"
+#include "Histogram.h"
+#include "SyncFrame.h"
+#include "TickSchedule.h"
+#include <string>
 
+// Connection and role lifecycle. BLESyncNode::stateSpecs lists which states
+// each one may move to, its timeout and its entry, exit and timeout actions.
+// A node in LINK_CLIENT is a client; a node holding clients is master,
+// including while it scans for or connects to more.
+enum LinkState {
+  LINK_IDLE,          // no role, waiting for the next periodic scan
+  LINK_SCANNING,
+  LINK_NEGOTIATING,   // won on role token, waiting out the connect backoff
+  LINK_CONNECTING,
+  LINK_DISCOVERING,
+  LINK_MASTER,
+  LINK_CLIENT,
+  LINK_BACKOFF,       // random delay before rescanning after losing a link
+  LINK_RECONNECTING,  // scanning for clients we lost, to connect straight back without negotiating
+  LINK_STATE_COUNT
+};
+
+// Called on every state change with the time spent in the state being left
+typedef void (*LinkStateHook)(void* context, LinkState from, LinkState to, uint64_t dwellUs);
+
+// Called whenever a transport callback queues an event for loop(), from
+// whichever task raised it
+typedef void (*BLESyncWakeHook)(void* context);
+
+// Counters the simulator and benches read back from a node
+struct BLESyncStats {
+  uint64_t firstConnectTime = 0;        // 0 = never connected
+  uint64_t firstSyncTime = 0;           // 0 = never synced
+  uint32_t connects = 0;
+  uint32_t syncsApplied = 0;
+  uint32_t framesRejected = 0;          // malformed or duplicate sync writes
+  uint32_t eventsDropped = 0;           // transport events lost to a full queue
+  Histogram loopLatency;                // BLESyncNode::loop() cycle time
+  Histogram connectBackoff;             // deferral applied before connecting
+  Histogram resyncLatency;              // link loss to next applied sync
+  Histogram connectToSync;              // a master connecting to us to its first sync
+  Histogram syncFanout;                 // one performSync() across all peers
+  Histogram syncWrite;                  // loop() blocked writing one sync frame
+  Histogram syncCorrection;             // |client tick phase error| found at each sync
+  Histogram tickLateness;               // counter took effect after its tick was due
+  Histogram tickNotifyDelay;            // tick due to GATT value update and notify
+  // Link time spent on syncs (timed read + frame write; blocking, so a proxy
+  // for radio-on time), and how many syncs the fixed interval would have made
+  unsigned long long syncRadioUs = 0;
+  uint32_t syncTransactions = 0;
+  uint32_t fixedIntervalSyncs = 0;
+  uint32_t peakPeers = 0;               // most clients a master held at once
+  // Completed visits to each LinkState; the current one isn't counted yet
+  unsigned long long stateTimeUs[LINK_STATE_COUNT] = {};
+  uint32_t stateEntries[LINK_STATE_COUNT] = {};
+};
+
+// Tunables; defaults match the original hard-coded behaviour
+struct BLESyncConfig {
+  // When a role is decided by the MAC tiebreaker (uptimes too close to
+  // call), the winner waits a random time in this window before connecting,
+  // so a peer that saw a clear win on a fresher token can connect first.
+  unsigned long connectBackoffMinMs = 1000;
+  unsigned long connectBackoffMaxMs = 1000;
+  // Masters time reads of each client's clock and send the tick phase in
+  // the client's timebase, removing the link delay from it
+  bool clockOffsetEstimation = true;
+  // Clients learn their skew against the master from successive syncs and
+  // stretch or shrink their tick interval to match
+  bool driftCompensation = true;
+  unsigned long syncIntervalMs = 10000;
+  // Per-peer interval halves when a sync finds a large phase error and
+  // doubles when it finds almost none, within these bounds. Needs
+  // clockOffsetEstimation; otherwise every peer syncs at syncIntervalMs.
+  bool adaptiveSyncInterval = true;
+  unsigned long syncIntervalMinMs = 2500;
+  unsigned long syncIntervalMaxMs = 160000;
+  // Ticks fire from the transport's one-shot timer rather than when loop()
+  // next polls, so counter() moves on time however busy loop() is. The
+  // GATT value and notification still go out from loop().
+  bool timerTicks = true;
+  // Masters keep each client link on LINK_PROFILE_IDLE between syncs and
+  // move it back to LINK_PROFILE_SYNC shortly before the next one. Off,
+  // links stay on LINK_PROFILE_SYNC.
+  bool linkProfileSwitching = true;
+  // Masters send sync frames as ATT write commands, which go out on the
+  // next connection event without waiting for a write response. Every
+  // SYNC_ACK_EVERY-th frame to a client still waits for one, as does the
+  // one after a frame the client reports it never applied.
+  bool syncWriteNoResponse = true;
+  // A master that loses a client looks for it first and, if its role
+  // token still lets us, connects straight back without negotiating,
+  // resuming its tick grid; after a reboot it looks for the last client it
+  // held. A client that loses its master waits RECONNECT_WAIT_MS longer
+  // before scanning, for the master to return.
+  bool directReconnect = true;
+};
+
+#define SYNC_ACK_EVERY 8
+
+// Role token carried in every advertisement, so two nodes agree on who is
+// master before either opens a connection. Only the winner connects.
+#define ROLE_TOKEN_VERSION 1
+#define ROLE_TOKEN_LEN 6
+#define ROLE_FLAG_MASTER 0x01
+
+struct RoleToken {
+  uint8_t version;
+  uint8_t flags;
+  uint32_t uptimeSec;
+};
+
+// A client held by a master. A free slot has an empty address.
+struct SyncPeer {
+  std::string address;
+  bool notifications = false;   // peer notifies its counter
+  bool syncPending = false;     // send a sync on the next loop()
+  uint32_t lastCounter = 0;
+  uint64_t tickUs = 0;          // peer's tick lastCounter on its clock, from the last timed read
+  bool haveTick = false;
+  unsigned long syncIntervalMs = 0;
+  uint64_t lastSyncAt = 0;
+  uint64_t connectedAt = 0;
+  uint32_t syncsSent = 0;
+  uint16_t lastSeq = 0;         // frame seq of the last sync we sent it
+  uint16_t appliedSeq = 0;      // last frame seq it applied, from its timestamp
+  bool haveAppliedSeq = false;
+  uint8_t syncsSinceAck = SYNC_ACK_EVERY;   // the first sync waits for its response
+  BLELinkProfile linkProfile = LINK_PROFILE_SYNC;
+  uint64_t profileRetryAt = 0;  // a refused profile switch is asked for again from here (ms)
+  BLELinkInfo link;             // as of discovery, then each status report
+  ClockFilter clock;            // peer clock minus ours
+};
+
+// Transport callbacks are turned into these on whatever task raised them
+// and handled in order by loop(). Fixed size, so queueing never allocates.
+// The link events come first and are never dropped, see post().
+enum BLESyncEventType : uint8_t {
+  EVT_SERVER_CONNECT,
+  EVT_SERVER_DISCONNECT,
+  EVT_CLIENT_CONNECT,
+  EVT_CLIENT_DISCONNECT,
+  EVT_SCAN_RESULT,
+  EVT_SCAN_COMPLETE,
+  EVT_WRITE,
+  EVT_NOTIFY,
+  EVT_TICK
+};
+
+#define BLESYNC_EVENT_DATA_MAX 32   // advertised token or characteristic value
+#define BLESYNC_EVENT_QUEUE_LEN 64
+// Cells only link events may take: one up and one down per client slot and
+// for the server side, all arriving before loop() runs
+#define BLESYNC_EVENT_RESERVE (2 * (BLESYNC_MAX_PEERS + 1))
+static_assert(BLESYNC_EVENT_RESERVE <= BLESYNC_EVENT_QUEUE_LEN / 2,
+              "BLESYNC_EVENT_QUEUE_LEN too small for BLESYNC_MAX_PEERS");
+
+struct BLESyncEvent {
+  BLESyncEventType type;
+  uint8_t id;                       // BLESyncChar for writes and notifications
+  uint8_t len;
+  char address[18];
+  uint8_t data[BLESYNC_EVENT_DATA_MAX];
+  int32_t count;                    // devices found, for EVT_SCAN_COMPLETE; counter, for EVT_TICK;
+                                    // mailbox slot or -1, for EVT_NOTIFY
+  uint64_t atUs;                    // micros() when the callback ran
+
+  const BLESyncEvent& withData(const uint8_t* bytes, size_t n) {
+    if (bytes != nullptr && n <= sizeof(data)) {
+      memcpy(data, bytes, n);
+      len = (uint8_t)n;
+    }
+    return *this;
+  }
+};
+
+// Role/sync state machine for one node, driven through a BLETransport
+class BLESyncNode : public BLETransportListener {
+public:
+  explicit BLESyncNode(BLETransport& transport);
+
+  void configure(const BLESyncConfig& cfg) { config = cfg; }
+  void setup(const std::string& name);
+  void loop();
+  void resetConnectionState();
+  // How long loop() can sleep before it has scheduled work. Events that
+  // arrive sooner call the wake hook.
+  uint32_t idleBudgetUs();
+  void setWakeHook(BLESyncWakeHook hook, void* context) { wakeHook = hook; wakeHookContext = context; }
+
+  // Counter in effect now; with timerTicks it moves on the timer, possibly
+  // before loop() has handled the tick
+  uint32_t counter() const { return visibleCounter.load(std::memory_order_relaxed); }
+  bool hasRole() const { return master() || linkState == LINK_CLIENT; }
+  bool master() const { return peerCount > 0; }
+  LinkState state() const { return linkState; }
+  static const char* stateName(LinkState state);
+  void setStateHook(LinkStateHook hook, void* context) { stateHook = hook; stateHookContext = context; }
+  const BLESyncStats& stats() const { return syncStats; }
+  const BLESyncTrace& trace() const { return eventTrace; }
+  const BLESyncMetrics& metrics() const { return healthMetrics; }
+  // Prints the metrics from the next loop(); safe from any task
+  void requestMetricsReport();
+  int peers() const { return peerCount; }
+  const SyncPeer& peerSlot(int i) const { return peerTable[i]; }
+  // micros() when counter() took effect
+  uint64_t lastTickUs() const { return publishedSchedule.read().tickUs(counter()); }
+  // Learned skew of our clock against the master's
+  int32_t driftPpb() const { return drift.ppb; }
+
+  // BLETransportListener. Apart from onRead() these only queue an event.
+  void onServerConnect(const std::string& address) override;
+  void onServerDisconnect(const std::string& address) override;
+  void onClientConnect(const std::string& address) override;
+  void onClientDisconnect(const std::string& address) override;
+  void onScanResult(const std::string& address, const uint8_t* token, size_t tokenLen) override;
+  void onScanComplete(int deviceCount) override;
+  void onWrite(BLESyncChar id, const uint8_t* data, size_t len) override;
+  void onRead(BLESyncChar id) override;
+  void onNotify(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) override;
+
+private:
+  struct LinkStateSpec {
+    const char* name;
+    uint16_t next;                     // LINK_BIT() of each allowed successor
+    unsigned long timeoutMs;           // from entry; 0 = armed by the caller or entry action
+    void (BLESyncNode::*onEnter)();
+    void (BLESyncNode::*onExit)();
+    void (BLESyncNode::*onTimeout)();  // nullptr = the state never times out
+  };
+  static const LinkStateSpec stateSpecs[];
+
+  bool transitionTo(LinkState next);
+  void settle();
+  void armStateTimer(unsigned long ms);
+  void serviceStateTimer(uint64_t currentTime);
+  void enterRest();
+  void enterScanning();
+  void exitScanning();
+  void enterClient();
+  void enterBackoff();
+  void enterReconnecting();
+  void rescanDue();
+  void scanStalled();
+  void connectDue();
+  void backoffElapsed();
+  void reconnectDue();
+  void reconnectSeen(const std::string& address, const RoleToken& peer);
+  void seekPeers();
+  void queueReconnect(const std::string& address);
+
+  bool post(BLESyncEventType type, const std::string& address, BLESyncChar id = CHAR_COUNTER,
+            const uint8_t* data = nullptr, size_t len = 0, int32_t count = 0);
+  void drainEvents();
+  bool collectNotify(BLESyncEvent& event);
+  void handleServerConnect(const std::string& address);
+  void handleServerDisconnect(const std::string& address);
+  void handleClientDisconnect(const std::string& address);
+  void handleScanResult(const std::string& address, const uint8_t* token, size_t tokenLen);
+  void handleScanComplete(int deviceCount);
+  void handleWrite(BLESyncChar id, const uint8_t* data, size_t len, uint64_t atUs);
+  void handleNotify(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len);
+  bool winsAgainst(const RoleToken& peer, const std::string& peerAddress, bool& tieBroken);
+  SyncPeer* findPeer(const std::string& address);
+  SyncPeer* addPeer(const std::string& address);
+  void disconnectPeers();
+  bool sampleClock(SyncPeer& peer);
+  int32_t phaseError(const SyncPeer& peer) const;
+  void adaptSyncInterval(SyncPeer& peer, int32_t errorUs);
+  void publishTimestamp();
+  void advertiseRoleToken();
+  bool connectToServer(unsigned long connectTimeoutMs = 0);
+  void performSync();
+  uint64_t nextSyncAt(const SyncPeer& peer) const;
+  void setLinkProfile(SyncPeer& peer, BLELinkProfile profile);
+  static void onTickTimer(void* context, uint64_t firedUs);
+  void handleTick(uint64_t firedUs);
+  void setSchedule(uint32_t counter, uint64_t tickUs, uint32_t intervalUs);
+  void updateCounter();
+  void printStatus();
+  void publishMetrics();
+  void printMetrics();
+  void recordStateMetrics(LinkState prev, LinkState next, uint64_t dwellUs);
+  void recordSyncApplied(uint64_t currentTime);
+  void recordLinkLost();
+
+  BLETransport& transport;
+  BLESyncConfig config;
+  std::string deviceName;
+  BLESyncStats syncStats;
+  BLESyncTrace eventTrace;
+  BLESyncMetrics healthMetrics;
+  std::atomic<bool> metricsReportRequested{false};
+  uint64_t lastMetricsPublish = 0;
+  bool awaitingResync = false;
+  uint64_t linkLostTime = 0;
+  uint64_t serverConnectUs = 0;         // micros() a master connected; 0 once it has synced us
+
+  // Counter as loop() last handled it, and when that value took effect
+  uint32_t localCounter = 0;
+  uint64_t lastCounterUpdateUs = 0;
+  // Owned by loop(); the tick timer reads the published copy
+  TickSchedule tickSchedule;
+  TickScheduleBuffer publishedSchedule;
+  std::atomic<uint32_t> visibleCounter{0};
+  std::atomic<uint16_t> visibleAppliedSeq{0};   // appliedSeq, for publishTimestamp() on the host task
+  DriftEstimator drift;
+  uint64_t lastSyncTime = 0;
+  uint64_t lastTokenUpdate = 0;
+  uint64_t lastScanAttempt = 0;
+  uint64_t lastStatusPrint = 0;
+  uint64_t bootTimestamp = 0;
+
+  // Sync framing: what we send as master, what we last applied as client
+  uint32_t masterEpoch = 0;
+  uint16_t syncSeq = 0;
+  bool haveAppliedFrame = false;
+  uint32_t appliedEpoch = 0;
+  uint16_t appliedSeq = 0;
+  uint32_t scheduleEpoch = 0;   // whose tick grid we follow: a master's epoch, 0 = our own
+
+  // Lifecycle state, when it was entered (us) and when its timeout fires (ms)
+  LinkState linkState = LINK_IDLE;
+  uint64_t stateEnteredUs = 0;
+  uint64_t stateDeadline = 0;
+  LinkStateHook stateHook = nullptr;
+  void* stateHookContext = nullptr;
+
+  bool serverConnected = false;
+  bool doSyncNow = false;
+  std::string targetAddress;
+
+  // Clients of this node while it is master
+  SyncPeer peerTable[BLESYNC_MAX_PEERS];
+  int peerCount = 0;
+  // Clients whose link dropped, each looked for once before a scan
+  std::string lostPeers[BLESYNC_MAX_PEERS];
+  int lostPeerCount = 0;
+
+  MpscQueue<BLESyncEvent, BLESYNC_EVENT_QUEUE_LEN> events;
+  // Set while an EVT_TICK is queued; handleTick() catches up on the rest
+  std::atomic<bool> tickPending{false};
+  // Latest counter each client notified, slot for slot with peerTable.
+  // onNotify() overwrites it and queues an EVT_NOTIFY only while none is
+  // pending, so a burst takes one queue cell per client.
+  struct NotifyMailbox {
+    std::atomic<uint32_t> addressTag{0};   // traceAddressTag() of the slot's peer, 0 = free
+    std::atomic<uint32_t> counter{0};
+    std::atomic<bool> pending{false};
+  };
+  NotifyMailbox notifyMail[BLESYNC_MAX_PEERS];
+  BLESyncWakeHook wakeHook = nullptr;
+  void* wakeHookContext = nullptr;
+};
+
+#ifdef ARDUINO
 // Call this in setup()
 void BLESync_setup();
 
-// Call this in loop()
+// Call this in loop(). Runs the engine until BLESync_startTask()
+// (BLESyncTask.h) moves it onto its own task, and either way answers
+// serial commands, one per line:
+//   metrics   print the health metrics (also readable as CHAR_METRICS)
 void BLESync_loop();
 
 // Optionally, expose resetConnectionState if needed elsewhere
 void resetConnectionState();
+
+// Write the event trace to LittleFS for the host decoder. Blocks while
+// flash is written; see BLESyncTrace::save().
+bool BLESync_saveTrace(const char* path = "/trace.bin");
+#endif
@@ -0,0 +1,58 @@
+#include "BLESyncLog.h"
+#ifdef ARDUINO
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+MpscQueue<BLESyncLogLine, BLESYNC_LOG_QUEUE_LEN> BLESyncLog::ring;
+std::atomic<uint32_t> BLESyncLog::droppedLines{0};
+uint32_t BLESyncLog::reportedDrops = 0;
+volatile bool BLESyncLog::directMode = false;
+
+void BLESyncLog::write(const char* fmt, ...) {
+  BLESyncLogLine line;
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(line.text, sizeof(line.text), fmt, args);
+  va_end(args);
+  if (directMode) {
+    Serial.printf("%s\n", line.text);
+    return;
+  }
+  if (!ring.push(line)) {
+    droppedLines.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+size_t BLESyncLog::drain() {
+  size_t printed = 0;
+  BLESyncLogLine line;
+  while (ring.pop(line)) {
+    Serial.printf("%s\n", line.text);
+    printed++;
+  }
+  uint32_t drops = dropped();
+  if (drops != reportedDrops) {
+    Serial.printf("Log: %u lines dropped\n", (unsigned)(drops - reportedDrops));
+    reportedDrops = drops;
+  }
+  return printed;
+}
+
+#ifdef ARDUINO
+static void drainTask(void* arg) {
+  for (;;) {
+    BLESyncLog::drain();
+    vTaskDelay(pdMS_TO_TICKS(BLESYNC_LOG_DRAIN_MS));
+  }
+}
+
+bool BLESyncLog::startDrainTask(uint8_t priority, uint32_t stackBytes) {
+  static TaskHandle_t handle = nullptr;
+  if (handle != nullptr) {
+    return false;
+  }
+  return xTaskCreatePinnedToCore(&drainTask, "blesync_log", stackBytes, nullptr, priority, &handle,
+                                 tskNO_AFFINITY) == pdPASS;
+}
+#endif
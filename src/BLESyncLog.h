@@ -0,0 +1,81 @@
+#pragma once
+#include "BLEPlatform.h"
+#include "EventQueue.h"
+#include <atomic>
+
+// Logging that never blocks the caller. A line is formatted where it is
+// logged, queued in a fixed ring and written to Serial later by drain():
+// on hardware from a low-priority task, on the host by whoever runs the
+// nodes. At 115200 baud a printed line costs milliseconds, which used to
+// land on whatever was logging: loop(), a BLE callback or the tick path.
+// A full ring drops lines and counts them; the next drain reports how many.
+//
+// Levels above BLESYNC_LOG_LEVEL compile out, arguments and all. Per-tick,
+// per-sync and per-scan-result lines are DEBUG, so the default build logs
+// nothing on the hot path; -DBLESYNC_LOG_LEVEL=4 brings them back.
+#define BLESYNC_LOG_NONE 0
+#define BLESYNC_LOG_ERROR 1
+#define BLESYNC_LOG_WARN 2
+#define BLESYNC_LOG_INFO 3
+#define BLESYNC_LOG_DEBUG 4
+
+#ifndef BLESYNC_LOG_LEVEL
+#define BLESYNC_LOG_LEVEL BLESYNC_LOG_INFO
+#endif
+
+#define BLESYNC_LOG_LINE_MAX 192   // including the terminator; longer lines are cut
+#define BLESYNC_LOG_QUEUE_LEN 32    // power of two
+#define BLESYNC_LOG_DRAIN_MS 20    // drain task period
+
+struct BLESyncLogLine {
+  char text[BLESYNC_LOG_LINE_MAX];
+};
+
+class BLESyncLog {
+public:
+  // One line, without the trailing newline. Safe from any task.
+  static void write(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+  // Prints queued lines, oldest first. One consumer at a time.
+  static size_t drain();
+  // Print inline instead of queueing, as before the ring existed. For
+  // chasing a crash that would take the queued lines with it.
+  static void setDirect(bool direct) { directMode = direct; }
+  static uint32_t dropped() { return droppedLines.load(std::memory_order_relaxed); }
+#ifdef ARDUINO
+  // Drains every BLESYNC_LOG_DRAIN_MS from its own task. Lines logged
+  // before it starts wait in the ring.
+  static bool startDrainTask(uint8_t priority = 1, uint32_t stackBytes = 3072);
+#endif
+
+private:
+  static MpscQueue<BLESyncLogLine, BLESYNC_LOG_QUEUE_LEN> ring;
+  static std::atomic<uint32_t> droppedLines;
+  static uint32_t reportedDrops;
+  static volatile bool directMode;
+};
+
+#define BLESYNC_LOG_SKIP() do {} while (0)
+
+#if BLESYNC_LOG_LEVEL >= BLESYNC_LOG_ERROR
+#define BLESYNC_LOGE(...) BLESyncLog::write(__VA_ARGS__)
+#else
+#define BLESYNC_LOGE(...) BLESYNC_LOG_SKIP()
+#endif
+
+#if BLESYNC_LOG_LEVEL >= BLESYNC_LOG_WARN
+#define BLESYNC_LOGW(...) BLESyncLog::write(__VA_ARGS__)
+#else
+#define BLESYNC_LOGW(...) BLESYNC_LOG_SKIP()
+#endif
+
+#if BLESYNC_LOG_LEVEL >= BLESYNC_LOG_INFO
+#define BLESYNC_LOGI(...) BLESyncLog::write(__VA_ARGS__)
+#else
+#define BLESYNC_LOGI(...) BLESYNC_LOG_SKIP()
+#endif
+
+#if BLESYNC_LOG_LEVEL >= BLESYNC_LOG_DEBUG
+#define BLESYNC_LOGD(...) BLESyncLog::write(__VA_ARGS__)
+#else
+#define BLESYNC_LOGD(...) BLESYNC_LOG_SKIP()
+#endif
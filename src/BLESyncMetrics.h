@@ -0,0 +1,111 @@
+#pragma once
+#include "BLEPlatform.h"
+#include "Histogram.h"
+#include "SyncFrame.h"
+#include <algorithm>
+
+// Runtime health counters and histograms, for watching a fleet without
+// parsing log text. loop() owns the registry and republishes it every
+// METRICS_PUBLISH_INTERVAL as the CHAR_METRICS value (encode()); the
+// "metrics" serial command prints it.
+enum BLESyncCounterId : uint8_t {
+  METRIC_NEGOTIATE_WON,        // scan result we outranked; we connect
+  METRIC_NEGOTIATE_LOST,       // peer outranked us; we wait for it
+  METRIC_NEGOTIATE_TIEBREAK,   // either of the above, decided by MAC
+  METRIC_CONNECT_FAILED,
+  METRIC_DISCOVER_FAILED,
+  METRIC_SYNCS_SENT,
+  METRIC_SYNC_WRITES_FAILED,
+  METRIC_SYNCS_APPLIED,
+  METRIC_SYNCS_LOST,           // sent without error, but the client never applied it
+  METRIC_FRAMES_REJECTED,
+  METRIC_LINKS_LOST,
+  METRIC_DIRECT_RECONNECTS,    // lost client back through LINK_RECONNECTING, without a scan
+  METRIC_COUNTER_COUNT
+};
+
+enum BLESyncHistogramId : uint8_t {
+  METRIC_SCAN_US,              // time in SCANNING
+  METRIC_CONNECT_US,           // time in CONNECTING, whether or not it connected
+  METRIC_DISCOVER_US,          // time in DISCOVERING, likewise
+  METRIC_SYNC_RTT_US,          // round trip of each timed read of a peer's clock
+  METRIC_TICK_CORRECTION_US,   // how far an applied sync moved our ticks
+  METRIC_HISTOGRAM_COUNT
+};
+
+// CHAR_METRICS value, little-endian. Counts are since boot; a bucket
+// count sticks at 0xffff rather than wrapping.
+//
+//   0  u8   version        METRICS_VERSION
+//   1  u8   counters       METRIC_COUNTER_COUNT
+//   2  u8   histograms     METRIC_HISTOGRAM_COUNT
+//   3  u8   buckets        HISTOGRAM_BUCKETS (bounds as in Histogram.h)
+//   4  u32  uptime s
+//   8  u32  counter, per BLESyncCounterId
+//      then per BLESyncHistogramId: u16 per bucket, u32 mean us, u32 max us
+//
+// 176 bytes, more than one read response at the default MTU; GATT
+// clients fetch it with a long read.
+#define METRICS_VERSION 1
+#define METRICS_HEADER_LEN 8
+#define METRICS_HISTOGRAM_LEN (HISTOGRAM_BUCKETS * 2 + 8)
+#define METRICS_LEN (METRICS_HEADER_LEN + METRIC_COUNTER_COUNT * 4 + METRIC_HISTOGRAM_COUNT * METRICS_HISTOGRAM_LEN)
+
+class BLESyncMetrics {
+public:
+  void count(BLESyncCounterId id, uint32_t n = 1) { counters[id] += n; }
+  void record(BLESyncHistogramId id, unsigned long us) { histograms[id].record(us); }
+  uint32_t counter(BLESyncCounterId id) const { return counters[id]; }
+  const Histogram& histogram(BLESyncHistogramId id) const { return histograms[id]; }
+
+  void merge(const BLESyncMetrics& other) {
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+      counters[i] += other.counters[i];
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+      histograms[i].merge(other.histograms[i]);
+    }
+  }
+
+  static const char* counterName(BLESyncCounterId id) {
+    static const char* names[METRIC_COUNTER_COUNT] = {
+      "negotiate_won", "negotiate_lost", "negotiate_tiebreak", "connect_failed", "discover_failed",
+      "syncs_sent", "sync_writes_failed", "syncs_applied", "syncs_lost", "frames_rejected",
+      "links_lost", "direct_reconnects"
+    };
+    return names[id];
+  }
+
+  static const char* histogramName(BLESyncHistogramId id) {
+    static const char* names[METRIC_HISTOGRAM_COUNT] = {
+      "scan", "connect", "discover", "sync_rtt", "tick_correction"
+    };
+    return names[id];
+  }
+
+  // Fills out with METRICS_LEN bytes
+  void encode(uint8_t* out, uint32_t uptimeSec) const {
+    out[0] = METRICS_VERSION;
+    out[1] = METRIC_COUNTER_COUNT;
+    out[2] = METRIC_HISTOGRAM_COUNT;
+    out[3] = HISTOGRAM_BUCKETS;
+    putU32(out + 4, uptimeSec);
+    uint8_t* p = out + METRICS_HEADER_LEN;
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++, p += 4) {
+      putU32(p, counters[i]);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+      const Histogram& h = histograms[i];
+      for (int b = 0; b < HISTOGRAM_BUCKETS; b++, p += 2) {
+        putU16(p, (uint16_t)std::min(h.buckets[b], (uint32_t)0xffff));
+      }
+      putU32(p, (uint32_t)std::min(h.mean(), (unsigned long)UINT32_MAX));
+      putU32(p + 4, (uint32_t)std::min(h.maxValue, (unsigned long)UINT32_MAX));
+      p += 8;
+    }
+  }
+
+private:
+  uint32_t counters[METRIC_COUNTER_COUNT] = { 0 };
+  Histogram histograms[METRIC_HISTOGRAM_COUNT];
+};
@@ -0,0 +1,116 @@
+#include "BLESyncTask.h"
+#include <algorithm>
+
+#ifdef ARDUINO
+bool BLESyncTask::start(const BLESyncTaskConfig& cfg) {
+  if (started) {
+    return false;
+  }
+  config = cfg;
+  stopRequested = false;
+  started = true;
+  node.setWakeHook(&BLESyncTask::wake, this);
+  BaseType_t core = config.core < 0 ? tskNO_AFFINITY : config.core;
+  if (xTaskCreatePinnedToCore(&BLESyncTask::taskMain, "blesync", config.stackBytes, this,
+                              config.priority, &handle, core) != pdPASS) {
+    BLESYNC_LOGE("BLESync: Failed to create sync task");
+    node.setWakeHook(nullptr, nullptr);
+    started = false;
+    return false;
+  }
+  BLESYNC_LOGI("BLESync: Sync task running on core %d at priority %u", config.core, config.priority);
+  return true;
+}
+
+void BLESyncTask::stop() {
+  if (!started) {
+    return;
+  }
+  stopRequested = true;
+  xTaskNotifyGive(handle);
+  while (started) {
+    vTaskDelay(1);
+  }
+  node.setWakeHook(nullptr, nullptr);
+}
+
+void BLESyncTask::wake(void* context) {
+  BLESyncTask* self = (BLESyncTask*)context;
+  if (self->handle != nullptr) {
+    xTaskNotifyGive(self->handle);
+  }
+}
+
+void BLESyncTask::taskMain(void* arg) {
+  BLESyncTask* self = (BLESyncTask*)arg;
+  self->run();
+  self->handle = nullptr;
+  self->started = false;
+  vTaskDelete(nullptr);
+}
+
+// Sleeps are rounded up to whole RTOS ticks, so scheduled work runs up to
+// one tick late but never early
+void BLESyncTask::run() {
+  while (!stopRequested) {
+    node.loop();
+    loopCount++;
+    uint32_t sleepUs = std::min(node.idleBudgetUs(), config.maxSleepMs * 1000);
+    TickType_t ticks = (sleepUs + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+    ulTaskNotifyTake(pdTRUE, ticks);
+  }
+}
+#else
+bool BLESyncTask::start(const BLESyncTaskConfig& cfg) {
+  if (started) {
+    return false;
+  }
+  config = cfg;
+  stopRequested = false;
+  woken = false;
+  started = true;
+  node.setWakeHook(&BLESyncTask::wake, this);
+  thread = std::thread(&BLESyncTask::run, this);
+  return true;
+}
+
+void BLESyncTask::stop() {
+  if (!started) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(wakeMutex);
+    stopRequested = true;
+  }
+  wakeCv.notify_one();
+  thread.join();
+  node.setWakeHook(nullptr, nullptr);
+  started = false;
+}
+
+void BLESyncTask::wake(void* context) {
+  BLESyncTask* self = (BLESyncTask*)context;
+  {
+    std::lock_guard<std::mutex> guard(self->wakeMutex);
+    self->woken = true;
+  }
+  self->wakeCv.notify_one();
+}
+
+void BLESyncTask::run() {
+  for (;;) {
+    uint32_t sleepUs;
+    if (outerLock) outerLock->lock();
+    node.loop();
+    loopCount++;
+    sleepUs = std::min(node.idleBudgetUs(), config.maxSleepMs * 1000);
+    if (outerLock) outerLock->unlock();
+    std::unique_lock<std::mutex> guard(wakeMutex);
+    wakeCv.wait_for(guard, std::chrono::microseconds(sleepUs), [this] { return woken || stopRequested; });
+    woken = false;
+    if (stopRequested) {
+      return;
+    }
+  }
+}
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+#include "BLESync.h"
+#ifdef ARDUINO
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+// Runs a BLESyncNode on its own task instead of from the sketch's loop(),
+// so application work there can't hold up ticks or syncs. Between loop()
+// calls the task sleeps until the node's next scheduled work, or until a
+// transport event wakes it. On the host the task is a std::thread.
+struct BLESyncTaskConfig {
+  uint32_t stackBytes = 8192;
+  uint8_t priority = 3;          // the Arduino loop task runs at 1
+  int8_t core = 0;               // the BLE controller and host run on core 0; -1 = any. Ignored on the host.
+  uint32_t maxSleepMs = 1000;    // cap on one sleep
+};
+
+class BLESyncTask {
+public:
+  explicit BLESyncTask(BLESyncNode& node) : node(node) {}
+  ~BLESyncTask() { stop(); }
+
+  // False if already running or the task couldn't be created
+  bool start(const BLESyncTaskConfig& config = BLESyncTaskConfig());
+  // Returns once the task has finished its current loop()
+  void stop();
+  bool running() const { return started; }
+  uint32_t loops() const { return loopCount; }
+
+#ifndef ARDUINO
+  // Held around each loop(), for hosts that step shared state (such as a
+  // loopback medium) from another thread
+  void setLock(std::mutex* lock) { outerLock = lock; }
+#endif
+
+private:
+  static void wake(void* context);
+  void run();
+
+  BLESyncNode& node;
+  BLESyncTaskConfig config;
+  volatile bool started = false;
+  volatile bool stopRequested = false;
+  volatile uint32_t loopCount = 0;
+#ifdef ARDUINO
+  static void taskMain(void* arg);
+  TaskHandle_t handle = nullptr;
+#else
+  std::thread thread;
+  std::mutex* outerLock = nullptr;
+  std::mutex wakeMutex;
+  std::condition_variable wakeCv;
+  bool woken = false;
+#endif
+};
+
+#ifdef ARDUINO
+// Call after BLESync_setup() to run the sync engine on its own task
+bool BLESync_startTask(const BLESyncTaskConfig& config = BLESyncTaskConfig());
+#endif
@@ -0,0 +1,65 @@
+#include "BLESyncTrace.h"
+#ifdef ARDUINO
+#include <LittleFS.h>
+#endif
+
+size_t BLESyncTrace::snapshot(TraceRecord* out, size_t max) const {
+  uint32_t end = head.load(std::memory_order_acquire);
+  uint32_t held = end < BLESYNC_TRACE_LEN ? end : BLESYNC_TRACE_LEN;
+  size_t count = 0;
+  for (uint32_t position = end - held; position != end && count < max; position++) {
+    const Slot& slot = slots[position & (BLESYNC_TRACE_LEN - 1)];
+    uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    TraceRecord record = slot.record;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq != position + 1 || slot.seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+    record.seq = seq;
+    out[count++] = record;
+  }
+  return count;
+}
+
+bool BLESyncTrace::save(const char* path, const std::string& nodeAddress) const {
+  static TraceRecord records[BLESYNC_TRACE_LEN];   // too big for a task stack
+  size_t count = snapshot(records, BLESYNC_TRACE_LEN);
+  uint32_t total = recorded();
+  uint8_t header[TRACE_HEADER_LEN] = {};
+  memcpy(header, "BSTR", 4);
+  header[4] = TRACE_FILE_VERSION;
+  header[5] = TRACE_RECORD_LEN;
+  putU32(header + 8, (uint32_t)count);
+  putU32(header + 12, total - (uint32_t)count);
+  strncpy((char*)header + 16, nodeAddress.c_str(), 31);
+
+#ifdef ARDUINO
+  if (!LittleFS.begin(true)) {
+    return false;
+  }
+  File file = LittleFS.open(path, "w");
+  if (!file) {
+    return false;
+  }
+  bool ok = file.write(header, sizeof(header)) == sizeof(header);
+  for (size_t i = 0; i < count && ok; i++) {
+    uint8_t encoded[TRACE_RECORD_LEN];
+    encodeTraceRecord(records[i], encoded);
+    ok = file.write(encoded, sizeof(encoded)) == sizeof(encoded);
+  }
+  file.close();
+  return ok;
+#else
+  FILE* file = fopen(path, "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+  for (size_t i = 0; i < count && ok; i++) {
+    uint8_t encoded[TRACE_RECORD_LEN];
+    encodeTraceRecord(records[i], encoded);
+    ok = fwrite(encoded, sizeof(encoded), 1, file) == 1;
+  }
+  return fclose(file) == 0 && ok;
+#endif
+}
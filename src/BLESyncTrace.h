@@ -0,0 +1,126 @@
+#pragma once
+#include "BLEPlatform.h"
+#include "SyncFrame.h"
+#include <atomic>
+#include <string>
+
+// Binary flight recorder for post-mortem timing analysis. Each event is a
+// fixed 24-byte record in a RAM ring that keeps the newest
+// BLESYNC_TRACE_LEN; recording one is an atomic increment and a few
+// stores, cheap enough for the tick and sync paths and safe from any
+// task. save() writes the ring to a file (LittleFS on hardware) for the
+// host decoder, which turns files from several boards into one Chrome
+// trace (see TraceJson.h).
+#ifndef BLESYNC_TRACE_LEN
+#define BLESYNC_TRACE_LEN 256   // records; power of two
+#endif
+
+enum TraceEvent : uint8_t {
+  TRACE_STATE = 1,      // a: from LinkState, b: to LinkState
+  TRACE_TICK,           // at the tick's due time. c: schedule epoch (0 = own), d: counter
+  TRACE_SYNC_SENT,      // a: peer slot, b: frame seq, c: epoch, d: write duration us
+  TRACE_SYNC_APPLIED,   // at arrival. a: frame flags, b: frame seq, c: epoch, d: counter
+  TRACE_CLOCK_SAMPLE,   // a: peer slot, c: offset us (int32, clamped), d: round trip us
+  TRACE_LINK_UP,        // a: 1 we connected out (master side), 0 a peer connected in. c: peer tag
+  TRACE_LINK_DOWN,      // as TRACE_LINK_UP
+  TRACE_SCAN_RESULT     // a: 1 we outrank the peer. c: peer tag
+};
+
+struct TraceRecord {
+  uint64_t atUs;        // node micros()
+  uint32_t seq;         // position in the node's trace, from 1
+  uint8_t event;
+  uint8_t a;
+  uint16_t b;
+  uint32_t c;
+  uint32_t d;
+};
+
+// File layout, little-endian: a TRACE_HEADER_LEN header, then count
+// records of TRACE_RECORD_LEN, oldest first.
+//
+//   0  char[4] magic         "BSTR"
+//   4  u8      version       TRACE_FILE_VERSION
+//   5  u8      record length TRACE_RECORD_LEN
+//   8  u32     count
+//  12  u32     overwritten   records lost to the ring wrapping
+//  16  char[32] node address, NUL-padded
+//
+// A record is u64 atUs, u32 seq, u8 event, u8 a, u16 b, u32 c, u32 d.
+#define TRACE_FILE_VERSION 1
+#define TRACE_HEADER_LEN 48
+#define TRACE_RECORD_LEN 24
+
+// Low four bytes of a MAC address string, to name a peer in a record
+static inline uint32_t traceAddressTag(const std::string& address) {
+  uint32_t tag = 0;
+  size_t start = address.length() > 11 ? address.length() - 11 : 0;
+  for (size_t i = start; i < address.length(); i++) {
+    char ch = address[i];
+    int nibble = ch >= '0' && ch <= '9' ? ch - '0' : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 :
+                 ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+    if (nibble >= 0) {
+      tag = (tag << 4) | (uint32_t)nibble;
+    }
+  }
+  return tag;
+}
+
+static inline void encodeTraceRecord(const TraceRecord& record, uint8_t* out) {
+  putU64(out, record.atUs);
+  putU32(out + 8, record.seq);
+  out[12] = record.event;
+  out[13] = record.a;
+  putU16(out + 14, record.b);
+  putU32(out + 16, record.c);
+  putU32(out + 20, record.d);
+}
+
+static inline void decodeTraceRecord(const uint8_t* in, TraceRecord& record) {
+  record.atUs = getU64(in);
+  record.seq = getU32(in + 8);
+  record.event = in[12];
+  record.a = in[13];
+  record.b = getU16(in + 14);
+  record.c = getU32(in + 16);
+  record.d = getU32(in + 20);
+}
+
+class BLESyncTrace {
+public:
+  void add(TraceEvent event, uint64_t atUs, uint8_t a = 0, uint16_t b = 0, uint32_t c = 0, uint32_t d = 0) {
+    uint32_t position = head.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots[position & (BLESYNC_TRACE_LEN - 1)];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.record.atUs = atUs;
+    slot.record.event = event;
+    slot.record.a = a;
+    slot.record.b = b;
+    slot.record.c = c;
+    slot.record.d = d;
+    slot.seq.store(position + 1, std::memory_order_release);
+  }
+
+  // Copies out the records currently held, oldest first. A record being
+  // written while we copy is left out.
+  size_t snapshot(TraceRecord* out, size_t max) const;
+  uint32_t recorded() const { return head.load(std::memory_order_relaxed); }
+
+  // Writes the file described above. On hardware path is on LittleFS,
+  // which is mounted (and formatted if needed) on first use. Flash writes
+  // stall both cores, so save between syncs rather than in the middle of
+  // a timing measurement. One save() at a time.
+  bool save(const char* path, const std::string& nodeAddress) const;
+
+private:
+  static_assert((BLESYNC_TRACE_LEN & (BLESYNC_TRACE_LEN - 1)) == 0, "BLESYNC_TRACE_LEN must be a power of two");
+
+  struct Slot {
+    std::atomic<uint32_t> seq{0};   // 0 while being written
+    TraceRecord record;
+  };
+
+  Slot slots[BLESYNC_TRACE_LEN];
+  std::atomic<uint32_t> head{0};
+};
@@ -0,0 +1,161 @@
+#pragma once
+#include "BLEPlatform.h"
+#include <string>
+
+// Upper bound on simultaneous client links a master keeps. The controller's
+// own connection limit (CONFIG_BT_ACL_CONNECTIONS / BTDM_CTRL_BLE_MAX_CONN)
+// must be raised to match on hardware.
+#ifndef BLESYNC_MAX_PEERS
+#define BLESYNC_MAX_PEERS 8
+#endif
+
+// Characteristics exposed by the sync service. The transport maps these to
+// SERVICE_UUID / *_CHARACTERISTIC_UUID on real hardware.
+enum BLESyncChar {
+  CHAR_COUNTER = 0,
+  CHAR_SYNC,
+  CHAR_TIMESTAMP,
+  CHAR_METRICS,     // read-only health snapshot; optional when discovering a peer
+  CHAR_COUNT
+};
+
+// Connection parameters a master asks for on a client link. The central
+// sets them, so they only apply to our client links; as a server we just
+// advertise LINK_PROFILE_SYNC's interval as our preferred one.
+enum BLELinkProfile : uint8_t {
+  LINK_PROFILE_SYNC,   // connecting, discovery and sync exchanges
+  LINK_PROFILE_IDLE,   // between syncs: slower events the peripheral may sleep through
+  LINK_PROFILE_COUNT
+};
+
+// Units as on the air: interval 1.25 ms, supervision timeout 10 ms.
+// The timeout has to exceed (1 + latency) * maxInterval * 2.
+struct BLELinkParams {
+  const char* name;
+  uint16_t minInterval;
+  uint16_t maxInterval;
+  uint16_t latency;     // connection events the peripheral may skip
+  uint16_t timeout;
+};
+
+static const BLELinkParams BLE_LINK_PROFILES[LINK_PROFILE_COUNT] = {
+  { "sync", 6, 12, 0, 400 },     // 7.5-15 ms, every event, 4 s
+  { "idle", 80, 160, 4, 600 }    // 100-200 ms, listens every 1 s at worst, 6 s
+};
+
+// What connect() asks for on each link: a 247-byte ATT MTU plus the
+// 4-byte L2CAP header fills exactly one 251-octet LL data packet, so a
+// full-MTU write or notification goes out as a single packet. The 2M PHY
+// is asked for only where the controller has it (ESP32-S3).
+#define BLE_ATT_MTU_DEFAULT 23
+#define BLE_LL_OCTETS_DEFAULT 27
+#define BLESYNC_ATT_MTU 247
+#define BLESYNC_LL_OCTETS 251
+
+enum BLEPhy : uint8_t {
+  BLE_PHY_1M = 1,
+  BLE_PHY_2M = 2
+};
+
+// A link's effective packet sizes. Each starts at the spec default and
+// changes when the peer answers the request connect() made.
+struct BLELinkInfo {
+  uint16_t attMtu = BLE_ATT_MTU_DEFAULT;
+  uint16_t txOctets = BLE_LL_OCTETS_DEFAULT;   // LL payload per packet we send
+  BLEPhy phy = BLE_PHY_1M;
+};
+
+// Events raised by a transport. On hardware these arrive from the BLE host
+// task; the loopback transport raises them synchronously.
+class BLETransportListener {
+public:
+  virtual ~BLETransportListener() {}
+  // A remote client connected to / disconnected from our GATT server
+  virtual void onServerConnect(const std::string& address) = 0;
+  virtual void onServerDisconnect(const std::string& address) = 0;
+  // One of our GATT client links to a remote server went up / down
+  virtual void onClientConnect(const std::string& address) = 0;
+  virtual void onClientDisconnect(const std::string& address) = 0;
+  // A device advertising the sync service was seen while scanning. token is
+  // the payload it set with setAdvertisedToken (empty if it set none).
+  virtual void onScanResult(const std::string& address, const uint8_t* token, size_t tokenLen) = 0;
+  // A scan ran for its full duration. Not raised after stopScan().
+  virtual void onScanComplete(int deviceCount) = 0;
+  // A remote client wrote one of our characteristics
+  virtual void onWrite(BLESyncChar id, const uint8_t* data, size_t len) = 0;
+  // A remote client is reading one of our characteristics; setLocalValue()
+  // from here changes what it receives
+  virtual void onRead(BLESyncChar id) = 0;
+  // A remote server notified a characteristic we subscribed to
+  virtual void onNotify(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) = 0;
+};
+
+// One-shot timer expiry, with the micros() time it fired
+typedef void (*BLETimerCallback)(void* context, uint64_t firedUs);
+
+// Everything BLESync needs from the radio: advertise, scan, connect and
+// read/write/notify the sync characteristics. Also owns the node's clock so
+// simulated nodes can each run on their own timeline.
+class BLETransport {
+public:
+  virtual ~BLETransport() {}
+
+  virtual void setListener(BLETransportListener* listener) = 0;
+  virtual void init(const char* deviceName) = 0;
+  virtual std::string localAddress() = 0;
+
+  // Clock: 64-bit time since boot, so neither reading wraps (32-bit
+  // millis() does after 49.7 days, micros() after 71.6 minutes)
+  virtual uint64_t now() = 0;
+  virtual uint64_t micros() = 0;
+  virtual void delay(unsigned long ms) = 0;
+  // One-shot timer on the micros() clock for counter ticks. The callback
+  // runs outside loop() (the esp_timer task on hardware) and may re-arm;
+  // an arm from anywhere else replaces a pending expiry.
+  virtual void setTimerCallback(BLETimerCallback callback, void* context) = 0;
+  virtual void armTimer(uint64_t dueUs) = 0;
+
+  // Server side
+  virtual void startAdvertising() = 0;
+  virtual void stopAdvertising() = 0;
+  virtual void setLocalValue(BLESyncChar id, const uint8_t* data, size_t len) = 0;
+  virtual void notify(BLESyncChar id) = 0;
+  // Carry a small opaque payload in every advertisement (manufacturer data
+  // on hardware); may be called again at any time to update it
+  virtual void setAdvertisedToken(const uint8_t* data, size_t len) = 0;
+
+  // Scanning. Returns immediately; matches arrive through onScanResult and
+  // the end of the scan through onScanComplete.
+  virtual bool startScan(unsigned long durationMs) = 0;
+  virtual void stopScan() = 0;
+
+  // Client side. Up to BLESYNC_MAX_PEERS links, each addressed by the
+  // peer's address; connect() fails once every slot is in use. It blocks
+  // until the link is up or timeoutMs has passed; 0 leaves the stack's
+  // own limit, about 30 s on NimBLE and none on Bluedroid.
+  virtual bool connect(const std::string& address, unsigned long timeoutMs) = 0;
+  virtual bool discover(const std::string& address) = 0;
+  virtual bool read(const std::string& address, BLESyncChar id, std::string& value) = 0;
+  virtual bool write(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) = 0;
+  // ATT write command: returns once the stack has queued it, without
+  // waiting for the peer, so true doesn't mean it arrived. A characteristic
+  // known not to take commands gets an ordinary write instead.
+  virtual bool writeNoResponse(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) = 0;
+  // Enable notifications (CCCD write). False if the peer doesn't allow it.
+  virtual bool subscribe(const std::string& address, BLESyncChar id) = 0;
+  // Ask for new connection parameters on a link. connect() starts every
+  // link on LINK_PROFILE_SYNC. The change takes effect a few connection
+  // events later, after the call has returned; false if it couldn't be
+  // requested.
+  virtual bool setLinkProfile(const std::string& address, BLELinkProfile profile) = 0;
+  virtual bool linkInfo(const std::string& address, BLELinkInfo& info) = 0;
+  virtual void disconnect(const std::string& address) = 0;
+  virtual bool isConnected(const std::string& address) = 0;
+
+  // The server we last connected out to, kept across a reboot (in NVS on
+  // hardware) along with its cached attribute handles, so the next connect
+  // to it can skip discovery. Remembering "" forgets it. Nothing is
+  // written unless the record changed.
+  virtual bool lastPeer(std::string& address) = 0;
+  virtual void rememberPeer(const std::string& address) = 0;
+};
@@ -0,0 +1,642 @@
+#if defined(ARDUINO) && !defined(BLESYNC_NIMBLE)
+#include "BLETransportArduino.h"
+#include <BLEDevice.h>
+#include <BLEUtils.h>
+#include <BLEServer.h>
+#include <BLEClient.h>
+#include <BLEScan.h>
+#include <BLEAdvertisedDevice.h>
+#include <BLE2902.h>
+#include <esp_gattc_api.h>
+#include "BLESyncLog.h"
+#include "GattHandleCache.h"
+
+#define RAW_GATT_TIMEOUT_MS 2000  // Wait for a handle-based ATT response
+
+static BLETransportListener* listener = nullptr;
+static std::string advName;
+
+// BLE Server components
+static BLEServer* pServer = nullptr;
+static BLEService* pService = nullptr;
+static BLECharacteristic* pLocalCharacteristics[CHAR_COUNT] = { nullptr };
+
+// BLE Client components: one slot per link a master holds, in use while
+// address is set. Each slot creates its BLEClient on first use and keeps
+// it for good, so reconnecting allocates nothing and a late callback
+// never sees a freed client. Only loop() takes or releases a slot;
+// host-task callbacks just read the plain fields (address, gattcIf,
+// handles).
+struct ClientLink {
+  BLEClient* client;
+  char address[18];                 // empty = free
+  volatile esp_gatt_if_t gattcIf;   // ESP_GATT_IF_NONE unless in cached-handle mode
+  BLERemoteService* pRemoteService;
+  BLERemoteCharacteristic* pRemoteCharacteristics[CHAR_COUNT];
+  // Reconnects to a cached peer skip discovery and talk to the attribute
+  // handles directly through the GATTC API
+  bool usingCachedHandles;
+  GattHandles handles;
+  esp_bd_addr_t bda;
+  // As the data length and PHY updates connect() asks for complete
+  volatile uint16_t txOctets;
+  volatile uint8_t phy;             // BLEPhy
+};
+static ClientLink links[BLESYNC_MAX_PEERS];
+// The data length completion does not name its link. connect() runs one
+// at a time and asks right after connecting, so it is this one.
+static ClientLink* volatile dataLenLink = nullptr;
+
+static GattHandleCache handleCache;
+static SemaphoreHandle_t rawOpDone = nullptr;
+static volatile uint16_t rawOpHandle = 0;
+static volatile esp_gatt_status_t rawOpStatus = ESP_GATT_OK;
+static std::string rawReadValue;
+
+static void clearRemoteHandles(ClientLink& link) {
+  link.gattcIf = ESP_GATT_IF_NONE;
+  link.pRemoteService = nullptr;
+  for (int i = 0; i < CHAR_COUNT; i++) {
+    link.pRemoteCharacteristics[i] = nullptr;
+  }
+  link.usingCachedHandles = false;
+}
+
+static ClientLink* findLink(const std::string& address) {
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (links[i].address[0] != '\0' && address == links[i].address) {
+      return &links[i];
+    }
+  }
+  return nullptr;
+}
+
+// A released slot's client can still report its disconnect; that finds
+// nothing here and is dropped
+static ClientLink* findLink(BLEClient* client) {
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (links[i].address[0] != '\0' && links[i].client == client) {
+      return &links[i];
+    }
+  }
+  return nullptr;
+}
+
+// Prefers a slot whose client has finished disconnecting
+static ClientLink* findFreeLink() {
+  ClientLink* fallback = nullptr;
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (links[i].address[0] != '\0') {
+      continue;
+    }
+    if (links[i].client == nullptr || !links[i].client->isConnected()) {
+      return &links[i];
+    }
+    if (fallback == nullptr) {
+      fallback = &links[i];
+    }
+  }
+  return fallback;
+}
+
+// Keeps the client for the slot's next link
+static void releaseLink(ClientLink& link) {
+  clearRemoteHandles(link);
+  if (link.client != nullptr && link.client->isConnected()) {
+    link.client->disconnect();
+  }
+  link.address[0] = '\0';
+}
+
+// Sees every GATTC event after BLEClient has; only acts for links in
+// cached-handle mode
+static void rawGattcHandler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if, esp_ble_gattc_cb_param_t* param) {
+  ClientLink* link = nullptr;
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (gattc_if != ESP_GATT_IF_NONE && links[i].gattcIf == gattc_if) {
+      link = &links[i];
+      break;
+    }
+  }
+  if (link == nullptr) {
+    return;
+  }
+  switch (event) {
+    case ESP_GATTC_READ_CHAR_EVT:
+      if (param->read.handle == rawOpHandle) {
+        rawOpStatus = param->read.status;
+        if (param->read.status == ESP_GATT_OK) {
+          rawReadValue.assign((const char*)param->read.value, param->read.value_len);
+        }
+        xSemaphoreGive(rawOpDone);
+      }
+      break;
+    case ESP_GATTC_WRITE_CHAR_EVT:
+    case ESP_GATTC_WRITE_DESCR_EVT:
+      if (param->write.handle == rawOpHandle) {
+        rawOpStatus = param->write.status;
+        xSemaphoreGive(rawOpDone);
+      }
+      break;
+    case ESP_GATTC_NOTIFY_EVT:
+      for (int i = 0; i < CHAR_COUNT; i++) {
+        if (link->handles.chars[i] == param->notify.handle) {
+          if (listener) listener->onNotify(link->address, (BLESyncChar)i, param->notify.value, param->notify.value_len);
+          break;
+        }
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+static void rawGapHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+  switch (event) {
+    case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+      if (dataLenLink != nullptr && param->pkt_data_length_cmpl.status == ESP_BT_STATUS_SUCCESS) {
+        dataLenLink->txOctets = param->pkt_data_length_cmpl.params.tx_len;
+      }
+      dataLenLink = nullptr;
+      break;
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+    case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+      for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+        if (links[i].address[0] != '\0' && param->phy_update.status == ESP_BT_STATUS_SUCCESS &&
+            memcmp(links[i].bda, param->phy_update.bda, sizeof(esp_bd_addr_t)) == 0) {
+          links[i].phy = param->phy_update.tx_phy == ESP_BLE_GAP_PHY_2M ? BLE_PHY_2M : BLE_PHY_1M;
+        }
+      }
+      break;
+#endif
+    default:
+      break;
+  }
+}
+
+static bool rawWait() {
+  return xSemaphoreTake(rawOpDone, pdMS_TO_TICKS(RAW_GATT_TIMEOUT_MS)) == pdTRUE &&
+         rawOpStatus == ESP_GATT_OK;
+}
+
+static bool rawRead(ClientLink& link, uint16_t handle, std::string& value) {
+  xSemaphoreTake(rawOpDone, 0);
+  rawOpHandle = handle;
+  if (esp_ble_gattc_read_char(link.client->getGattcIf(), link.client->getConnId(), handle,
+                              ESP_GATT_AUTH_REQ_NONE) != ESP_OK || !rawWait()) {
+    return false;
+  }
+  value = rawReadValue;
+  return true;
+}
+
+// A command (ESP_GATT_WRITE_TYPE_NO_RSP) completes as soon as the stack
+// has sent it
+static bool rawWrite(ClientLink& link, uint16_t handle, const uint8_t* data, size_t len, bool descriptor,
+                     esp_gatt_write_type_t writeType = ESP_GATT_WRITE_TYPE_RSP) {
+  xSemaphoreTake(rawOpDone, 0);
+  rawOpHandle = handle;
+  esp_gatt_if_t gattcIf = link.client->getGattcIf();
+  uint16_t connId = link.client->getConnId();
+  esp_err_t err = descriptor
+    ? esp_ble_gattc_write_char_descr(gattcIf, connId, handle, len,
+                                     (uint8_t*)data, writeType, ESP_GATT_AUTH_REQ_NONE)
+    : esp_ble_gattc_write_char(gattcIf, connId, handle, len,
+                               (uint8_t*)data, writeType, ESP_GATT_AUTH_REQ_NONE);
+  return err == ESP_OK && rawWait();
+}
+
+// Server callbacks
+class MyServerCallbacks: public BLEServerCallbacks {
+    void onConnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+      BLESYNC_LOGI("Server: Client connected");
+      if (listener) listener->onServerConnect(BLEAddress(param->connect.remote_bda).toString());
+    };
+    void onDisconnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+      BLESYNC_LOGI("Server: Client disconnected");
+      if (listener) listener->onServerDisconnect(BLEAddress(param->disconnect.remote_bda).toString());
+    }
+};
+
+// Client callbacks
+class MyClientCallback : public BLEClientCallbacks {
+  void onConnect(BLEClient* pclient) {
+    BLESYNC_LOGI("Client: Connected to server");
+    if (listener) listener->onClientConnect(pclient->getPeerAddress().toString());
+  }
+  void onDisconnect(BLEClient* pclient) {
+    BLESYNC_LOGI("Client: Disconnected from server");
+    // The slot stays allocated until loop() handles the event and calls
+    // disconnect(), so nothing here races with a GATT call in progress
+    ClientLink* link = findLink(pclient);
+    if (link != nullptr && listener) listener->onClientDisconnect(link->address);
+  }
+};
+
+// Shared by every client; it finds the link from the client it is given
+static MyClientCallback clientCallbacks;
+
+// Sync and timestamp characteristic callbacks
+class MyCharacteristicCallback: public BLECharacteristicCallbacks {
+public:
+    explicit MyCharacteristicCallback(BLESyncChar id) : id(id) {}
+    void onWrite(BLECharacteristic* pCharacteristic) {
+      std::string value = pCharacteristic->getValue();
+      if (listener) listener->onWrite(id, (const uint8_t*)value.data(), value.length());
+    }
+    // Runs before the value goes out, so a fresh setValue() is what the peer reads
+    void onRead(BLECharacteristic* pCharacteristic) {
+      if (listener) listener->onRead(id);
+    }
+private:
+    BLESyncChar id;
+};
+
+// Remote characteristic notifications
+static void notifyCallback(BLERemoteCharacteristic* pChar, uint8_t* pData, size_t length, bool isNotify) {
+  for (int l = 0; l < BLESYNC_MAX_PEERS; l++) {
+    for (int i = 0; i < CHAR_COUNT; i++) {
+      if (links[l].address[0] != '\0' && links[l].pRemoteCharacteristics[i] == pChar) {
+        if (listener) listener->onNotify(links[l].address, (BLESyncChar)i, pData, length);
+        return;
+      }
+    }
+  }
+}
+
+// Advertised device scanner
+class MyAdvertisedDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
+    void onResult(BLEAdvertisedDevice advertisedDevice) {
+      if (advertisedDevice.haveServiceUUID() &&
+          advertisedDevice.isAdvertisingService(BLEUUID(SERVICE_UUID))) {
+        BLESYNC_LOGD("Found target device: %s", advertisedDevice.getAddress().toString().c_str());
+        std::string token;
+        if (advertisedDevice.haveManufacturerData()) {
+          std::string mfr = advertisedDevice.getManufacturerData();
+          if (mfr.length() >= 2 && (uint8_t)mfr[0] == (ADV_COMPANY_ID & 0xff) &&
+              (uint8_t)mfr[1] == (ADV_COMPANY_ID >> 8)) {
+            token = mfr.substr(2);
+          }
+        }
+        if (listener) listener->onScanResult(advertisedDevice.getAddress().toString(),
+                                             (const uint8_t*)token.data(), token.length());
+      }
+    }
+};
+
+// Runs on the BLE host task when a scan reaches its duration
+static void scanComplete(BLEScanResults foundDevices) {
+  int deviceCount = foundDevices.getCount();
+#if BLESYNC_LOG_LEVEL >= BLESYNC_LOG_DEBUG
+  for (int i = 0; i < deviceCount; i++) {
+    BLEAdvertisedDevice device = foundDevices.getDevice(i);
+    if (device.haveServiceUUID() &&
+        device.isAdvertisingService(BLEUUID(SERVICE_UUID))){
+      BLESYNC_LOGD("Device %d: %s - Has our service", i, device.getAddress().toString().c_str());
+    }
+  }
+#endif
+  if (listener) listener->onScanComplete(deviceCount);
+}
+
+void BLETransportArduino::setListener(BLETransportListener* l) {
+  listener = l;
+}
+
+void BLETransportArduino::init(const char* deviceName) {
+  BLEDevice::init(deviceName);
+  // BLEClient asks each server for this in its MTU exchange on connect
+  BLEDevice::setMTU(BLESYNC_ATT_MTU);
+  advName = deviceName;
+
+  pServer = BLEDevice::createServer();
+  static MyServerCallbacks serverCallbacks;
+  pServer->setCallbacks(&serverCallbacks);
+  pService = pServer->createService(SERVICE_UUID);
+  pLocalCharacteristics[CHAR_COUNTER] = pService->createCharacteristic(
+    COUNTER_CHARACTERISTIC_UUID,
+    BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_NOTIFY
+  );
+  pLocalCharacteristics[CHAR_SYNC] = pService->createCharacteristic(
+    SYNC_CHARACTERISTIC_UUID,
+    BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_WRITE_NR
+  );
+  pLocalCharacteristics[CHAR_TIMESTAMP] = pService->createCharacteristic(
+    TIMESTAMP_CHARACTERISTIC_UUID,
+    BLECharacteristic::PROPERTY_READ
+  );
+  pLocalCharacteristics[CHAR_METRICS] = pService->createCharacteristic(
+    METRICS_CHARACTERISTIC_UUID,
+    BLECharacteristic::PROPERTY_READ
+  );
+  static MyCharacteristicCallback syncCallbacks(CHAR_SYNC);
+  static MyCharacteristicCallback timestampCallbacks(CHAR_TIMESTAMP);
+  pLocalCharacteristics[CHAR_SYNC]->setCallbacks(&syncCallbacks);
+  pLocalCharacteristics[CHAR_TIMESTAMP]->setCallbacks(&timestampCallbacks);
+  pLocalCharacteristics[CHAR_COUNTER]->addDescriptor(new BLE2902());
+  pService->start();
+  BLEAdvertising* pAdvertising = BLEDevice::getAdvertising();
+  pAdvertising->addServiceUUID(SERVICE_UUID);
+  pAdvertising->setScanResponse(true);
+  pAdvertising->setMinPreferred(BLE_LINK_PROFILES[LINK_PROFILE_SYNC].minInterval);
+  pAdvertising->setMaxPreferred(BLE_LINK_PROFILES[LINK_PROFILE_SYNC].maxInterval);
+  pAdvertising->start();
+  BLESYNC_LOGI("BLE Server started and advertising");
+
+  BLEScan* pBLEScan = BLEDevice::getScan();
+  static MyAdvertisedDeviceCallbacks scanCallbacks;
+  pBLEScan->setAdvertisedDeviceCallbacks(&scanCallbacks);
+  pBLEScan->setInterval(1349);
+  pBLEScan->setWindow(449);
+  pBLEScan->setActiveScan(true);
+  BLESYNC_LOGI("BLE Client scanner configured");
+
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    links[i].gattcIf = ESP_GATT_IF_NONE;
+  }
+  rawOpDone = xSemaphoreCreateBinary();
+  BLEDevice::setCustomGattcHandler(rawGattcHandler);
+  BLEDevice::setCustomGapHandler(rawGapHandler);
+
+  // Handles saved with the last peer let a reconnect to it after a reboot
+  // skip discovery too; discover() still validates them first
+  std::string peer;
+  GattHandles handles;
+  bool haveHandles;
+  if (loadPeerRecord(peer, handles, haveHandles) && haveHandles) {
+    handleCache.store(peer, handles);
+  }
+}
+
+std::string BLETransportArduino::localAddress() {
+  return BLEDevice::getAddress().toString();
+}
+
+void BLETransportArduino::startAdvertising() {
+  BLEDevice::startAdvertising();
+}
+
+void BLETransportArduino::stopAdvertising() {
+  BLEDevice::stopAdvertising();
+}
+
+void BLETransportArduino::setLocalValue(BLESyncChar id, const uint8_t* data, size_t len) {
+  pLocalCharacteristics[id]->setValue((uint8_t*)data, len);
+}
+
+void BLETransportArduino::notify(BLESyncChar id) {
+  pLocalCharacteristics[id]->notify();
+}
+
+// Custom advertisement data replaces what setMinPreferred() and
+// setMaxPreferred() generate, so the range goes in by hand: AD type 0x12,
+// slave connection interval range
+static std::string preferredIntervalData() {
+  const BLELinkParams& params = BLE_LINK_PROFILES[LINK_PROFILE_SYNC];
+  char data[6] = { 5, 0x12,
+                   (char)(params.minInterval & 0xff), (char)(params.minInterval >> 8),
+                   (char)(params.maxInterval & 0xff), (char)(params.maxInterval >> 8) };
+  return std::string(data, sizeof(data));
+}
+
+// Flags + 128-bit service UUID + manufacturer data fill the 31-byte
+// advertisement, so the name moves to the scan response
+void BLETransportArduino::setAdvertisedToken(const uint8_t* data, size_t len) {
+  BLEAdvertisementData advData;
+  advData.setFlags(ESP_BLE_ADV_FLAG_GEN_DISC | ESP_BLE_ADV_FLAG_BREDR_NOT_SPT);
+  advData.setCompleteServices(BLEUUID(SERVICE_UUID));
+  std::string mfr;
+  mfr += (char)(ADV_COMPANY_ID & 0xff);
+  mfr += (char)(ADV_COMPANY_ID >> 8);
+  mfr.append((const char*)data, len);
+  advData.setManufacturerData(mfr);
+  BLEAdvertisementData scanResponse;
+  scanResponse.setName(advName);
+  scanResponse.addData(preferredIntervalData());
+  BLEAdvertising* pAdvertising = BLEDevice::getAdvertising();
+  pAdvertising->setAdvertisementData(advData);
+  pAdvertising->setScanResponseData(scanResponse);
+}
+
+bool BLETransportArduino::startScan(unsigned long durationMs) {
+  // Whole seconds; rounded up so a shorter scan isn't cut
+  return BLEDevice::getScan()->start((durationMs + 999) / 1000, scanComplete, false);
+}
+
+void BLETransportArduino::stopScan() {
+  BLEDevice::getScan()->stop();
+}
+
+bool BLETransportArduino::connect(const std::string& address, unsigned long timeoutMs) {
+  ClientLink* link = findLink(address);
+  if (link != nullptr) {
+    releaseLink(*link);
+  } else {
+    link = findFreeLink();
+    if (link == nullptr) {
+      BLESYNC_LOGW("No free client link");
+      return false;
+    }
+  }
+  if (link->client == nullptr) {
+    link->client = BLEDevice::createClient();
+    link->client->setClientCallbacks(&clientCallbacks);
+  }
+  strncpy(link->address, address.c_str(), sizeof(link->address) - 1);
+  link->address[sizeof(link->address) - 1] = '\0';
+  // ESP32 peers advertise their public address, so connecting by address
+  // needs no copy of the scan result shared with the scan callback
+  BLEAddress peer(address);
+  const BLELinkParams& params = BLE_LINK_PROFILES[LINK_PROFILE_SYNC];
+  esp_ble_gap_set_prefer_conn_params(*peer.getNative(), params.minInterval, params.maxInterval,
+                                     params.latency, params.timeout);
+  memcpy(link->bda, *peer.getNative(), sizeof(esp_bd_addr_t));
+  link->txOctets = BLE_LL_OCTETS_DEFAULT;
+  link->phy = BLE_PHY_1M;
+  if (!link->client->connect(peer, BLE_ADDR_TYPE_PUBLIC, timeoutMs > 0 ? (uint32_t)timeoutMs : portMAX_DELAY)) {
+    // BLEClient gives up waiting but leaves the open pending; cancel it,
+    // or the controller may still bring the link up behind our back
+    if (timeoutMs > 0) {
+      esp_ble_gap_disconnect(link->bda);
+    }
+    releaseLink(*link);
+    return false;
+  }
+  // Full-size LL packets, and the 2M PHY where the controller has it
+  // (ESP32-S3); both finish in rawGapHandler
+  dataLenLink = link;
+  esp_ble_gap_set_pkt_data_len(link->bda, BLESYNC_LL_OCTETS);
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  esp_ble_gap_set_preferred_phy(link->bda, 0, ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_2M_PREF_MASK,
+                                ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+#endif
+  return true;
+}
+
+bool BLETransportArduino::discover(const std::string& address) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  GattHandles cached;
+  if (handleCache.lookup(address, cached)) {
+    // Validate with one cheap read: the timestamp is at least 4 bytes
+    link->handles = cached;
+    link->usingCachedHandles = true;
+    link->gattcIf = link->client->getGattcIf();
+    std::string probe;
+    if (rawRead(*link, cached.chars[CHAR_TIMESTAMP], probe) && probe.length() >= 4) {
+      BLESYNC_LOGI("Reusing cached GATT handles for %s", address.c_str());
+      return true;
+    }
+    BLESYNC_LOGI("Cached GATT handles are stale, rediscovering");
+    link->usingCachedHandles = false;
+    link->gattcIf = ESP_GATT_IF_NONE;
+    handleCache.invalidate(address);
+  }
+  // A reused client still holds the previous peer's service map, which
+  // getService() would answer from; fetch this peer's
+  link->client->getServices();
+  link->pRemoteService = link->client->getService(SERVICE_UUID);
+  if (link->pRemoteService == nullptr) {
+    BLESYNC_LOGW("Failed to find service UUID");
+    return false;
+  }
+  BLESYNC_LOGI("Found service");
+  for (int i = 0; i < CHAR_COUNT; i++) {
+    link->pRemoteCharacteristics[i] = link->pRemoteService->getCharacteristic(charUUIDs[i]);
+    // Firmware from before CHAR_METRICS doesn't have it, and sync never reads it
+    if (link->pRemoteCharacteristics[i] == nullptr && i != CHAR_METRICS) {
+      BLESYNC_LOGW("Failed to find characteristics");
+      return false;
+    }
+  }
+  for (int i = 0; i < CHAR_COUNT; i++) {
+    link->handles.chars[i] = link->pRemoteCharacteristics[i] != nullptr ? link->pRemoteCharacteristics[i]->getHandle() : 0;
+  }
+  BLERemoteDescriptor* pCccd = link->pRemoteCharacteristics[CHAR_COUNTER]->getDescriptor(BLEUUID((uint16_t)0x2902));
+  link->handles.counterCccd = pCccd != nullptr ? pCccd->getHandle() : 0;
+  handleCache.store(address, link->handles);
+  return true;
+}
+
+bool BLETransportArduino::read(const std::string& address, BLESyncChar id, std::string& value) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  if (link->usingCachedHandles) {
+    return link->handles.chars[id] != 0 && rawRead(*link, link->handles.chars[id], value);
+  }
+  if (link->pRemoteCharacteristics[id] == nullptr) {
+    return false;
+  }
+  value = link->pRemoteCharacteristics[id]->readValue();
+  return true;
+}
+
+bool BLETransportArduino::write(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  if (link->usingCachedHandles) {
+    return rawWrite(*link, link->handles.chars[id], data, len, false);
+  }
+  if (link->pRemoteCharacteristics[id] == nullptr) {
+    return false;
+  }
+  link->pRemoteCharacteristics[id]->writeValue((uint8_t*)data, len);
+  return true;
+}
+
+bool BLETransportArduino::writeNoResponse(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  if (link->usingCachedHandles) {
+    return rawWrite(*link, link->handles.chars[id], data, len, false, ESP_GATT_WRITE_TYPE_NO_RSP);
+  }
+  BLERemoteCharacteristic* pChar = link->pRemoteCharacteristics[id];
+  if (pChar == nullptr) {
+    return false;
+  }
+  pChar->writeValue((uint8_t*)data, len, !pChar->canWriteNoResponse());
+  return true;
+}
+
+bool BLETransportArduino::subscribe(const std::string& address, BLESyncChar id) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  if (link->usingCachedHandles) {
+    if (id != CHAR_COUNTER || link->handles.counterCccd == 0) {
+      return false;
+    }
+    esp_ble_gattc_register_for_notify(link->client->getGattcIf(), *link->client->getPeerAddress().getNative(),
+                                      link->handles.chars[id]);
+    static const uint8_t enableNotify[2] = { 0x01, 0x00 };
+    return rawWrite(*link, link->handles.counterCccd, enableNotify, 2, true);
+  }
+  BLERemoteCharacteristic* pChar = link->pRemoteCharacteristics[id];
+  if (pChar == nullptr || !pChar->canNotify() ||
+      pChar->getDescriptor(BLEUUID((uint16_t)0x2902)) == nullptr) {
+    return false;
+  }
+  pChar->registerForNotify(notifyCallback);
+  return true;
+}
+
+bool BLETransportArduino::setLinkProfile(const std::string& address, BLELinkProfile profile) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr || !link->client->isConnected()) {
+    return false;
+  }
+  const BLELinkParams& params = BLE_LINK_PROFILES[profile];
+  esp_ble_conn_update_params_t update = {};
+  memcpy(update.bda, *link->client->getPeerAddress().getNative(), sizeof(esp_bd_addr_t));
+  update.min_int = params.minInterval;
+  update.max_int = params.maxInterval;
+  update.latency = params.latency;
+  update.timeout = params.timeout;
+  return esp_ble_gap_update_conn_params(&update) == ESP_OK;
+}
+
+bool BLETransportArduino::linkInfo(const std::string& address, BLELinkInfo& info) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr || !link->client->isConnected()) {
+    return false;
+  }
+  info.attMtu = link->client->getMTU();
+  info.txOctets = link->txOctets;
+  info.phy = (BLEPhy)link->phy;
+  return true;
+}
+
+void BLETransportArduino::disconnect(const std::string& address) {
+  ClientLink* link = findLink(address);
+  if (link != nullptr) {
+    releaseLink(*link);
+  }
+}
+
+bool BLETransportArduino::isConnected(const std::string& address) {
+  ClientLink* link = findLink(address);
+  return link != nullptr && link->client->isConnected();
+}
+
+bool BLETransportArduino::lastPeer(std::string& address) {
+  GattHandles handles;
+  bool haveHandles;
+  return loadPeerRecord(address, handles, haveHandles);
+}
+
+// discover() left the peer's handles in the cache
+void BLETransportArduino::rememberPeer(const std::string& address) {
+  GattHandles handles;
+  bool haveHandles = !address.empty() && handleCache.peek(address, handles);
+  savePeerRecord(address, haveHandles ? &handles : nullptr);
+}
+#endif
@@ -0,0 +1,111 @@
+#ifdef ARDUINO
+#include "BLETransportEsp32.h"
+#include <esp_timer.h>
+#include <Preferences.h>
+#include "BLESyncLog.h"
+
+// esp_timer_get_time() is the 64-bit counter millis() and micros() are
+// truncated from
+uint64_t BLETransportEsp32::now() {
+  return esp_timer_get_time() / 1000;
+}
+
+uint64_t BLETransportEsp32::micros() {
+  return esp_timer_get_time();
+}
+
+void BLETransportEsp32::delay(unsigned long ms) {
+  ::delay(ms);
+}
+
+static esp_timer_handle_t tickTimer = nullptr;
+static BLETimerCallback timerCallback = nullptr;
+static void* timerContext = nullptr;
+static volatile TaskHandle_t timerTask = nullptr;
+
+static void onTickTimer(void* arg) {
+  timerTask = xTaskGetCurrentTaskHandle();
+  if (timerCallback) {
+    timerCallback(timerContext, esp_timer_get_time());
+  }
+}
+
+void BLETransportEsp32::setTimerCallback(BLETimerCallback callback, void* context) {
+  timerCallback = callback;
+  timerContext = context;
+  if (tickTimer == nullptr) {
+    esp_timer_create_args_t args = {};
+    args.callback = &onTickTimer;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "blesync_tick";
+    if (esp_timer_create(&args, &tickTimer) != ESP_OK) {
+      BLESYNC_LOGE("Failed to create tick timer");
+      tickTimer = nullptr;
+    }
+  }
+}
+
+#define PEER_NVS_NAMESPACE "blesync"
+#define PEER_NVS_ADDRESS "peer"
+#define PEER_NVS_HANDLES "peer_handles"
+
+bool BLETransportEsp32::loadPeerRecord(std::string& address, GattHandles& handles, bool& haveHandles) {
+  Preferences prefs;
+  if (!prefs.begin(PEER_NVS_NAMESPACE, true)) {
+    return false;   // namespace not created yet
+  }
+  address = prefs.getString(PEER_NVS_ADDRESS, "").c_str();
+  haveHandles = prefs.getBytes(PEER_NVS_HANDLES, &handles, sizeof(handles)) == sizeof(handles);
+  prefs.end();
+  return !address.empty();
+}
+
+// Flash sectors wear out, so an unchanged record isn't rewritten
+void BLETransportEsp32::savePeerRecord(const std::string& address, const GattHandles* handles) {
+  std::string storedAddress;
+  GattHandles storedHandles;
+  bool storedHaveHandles = false;
+  loadPeerRecord(storedAddress, storedHandles, storedHaveHandles);
+  bool sameHandles = handles == nullptr ? !storedHaveHandles
+                                        : storedHaveHandles && memcmp(handles, &storedHandles, sizeof(GattHandles)) == 0;
+  if (address == storedAddress && sameHandles) {
+    return;
+  }
+  Preferences prefs;
+  if (!prefs.begin(PEER_NVS_NAMESPACE, false)) {
+    BLESYNC_LOGW("Failed to open NVS namespace %s", PEER_NVS_NAMESPACE);
+    return;
+  }
+  if (!address.empty()) {
+    prefs.putString(PEER_NVS_ADDRESS, address.c_str());
+  } else if (!storedAddress.empty()) {
+    prefs.remove(PEER_NVS_ADDRESS);
+  }
+  if (handles != nullptr) {
+    prefs.putBytes(PEER_NVS_HANDLES, handles, sizeof(GattHandles));
+  } else if (storedHaveHandles) {
+    prefs.remove(PEER_NVS_HANDLES);
+  }
+  prefs.end();
+  BLESYNC_LOGD("Saved last peer %s to NVS", address.empty() ? "(none)" : address.c_str());
+}
+
+// A re-arm from the callback only starts the timer if nobody else has, so
+// it can't undo a newer schedule armed from loop(); an arm from loop()
+// stops whatever is pending and retries until its own start wins.
+void BLETransportEsp32::armTimer(uint64_t dueUs) {
+  if (tickTimer == nullptr) {
+    return;
+  }
+  uint64_t nowUs = esp_timer_get_time();
+  uint64_t timeoutUs = dueUs > nowUs ? dueUs - nowUs : 0;
+  if (xTaskGetCurrentTaskHandle() == timerTask) {
+    esp_timer_start_once(tickTimer, timeoutUs);
+    return;
+  }
+  esp_timer_stop(tickTimer);
+  while (esp_timer_start_once(tickTimer, timeoutUs) == ESP_ERR_INVALID_STATE) {
+    esp_timer_stop(tickTimer);
+  }
+}
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+#ifdef ARDUINO
+#include "BLETransport.h"
+#include "GattHandleCache.h"
+
+// Service and Characteristic UUIDs for counter synchronization. Both
+// ESP32 stacks use them, so Bluedroid and NimBLE boards sync together.
+#define SERVICE_UUID "21e862dc-87da-4130-9991-2a5a49b4d949"
+#define COUNTER_CHARACTERISTIC_UUID "4027ce63-bdf0-4158-9426-6c8203185e00"
+#define SYNC_CHARACTERISTIC_UUID "e0368f9c-d3d2-4588-b033-1355ac7dc562"
+#define TIMESTAMP_CHARACTERISTIC_UUID "f0368f9c-d3d2-4588-b033-1355ac7dc563"
+#define METRICS_CHARACTERISTIC_UUID "f0368f9c-d3d2-4588-b033-1355ac7dc564"
+
+#define ADV_COMPANY_ID 0xFFFF      // Manufacturer data company id (test/unassigned)
+
+static const char* const charUUIDs[CHAR_COUNT] = {
+  COUNTER_CHARACTERISTIC_UUID,
+  SYNC_CHARACTERISTIC_UUID,
+  TIMESTAMP_CHARACTERISTIC_UUID,
+  METRICS_CHARACTERISTIC_UUID
+};
+
+// Clock and tick timer on esp_timer, which doesn't depend on the BLE
+// stack. The stack-specific transports derive from this.
+class BLETransportEsp32 : public BLETransport {
+public:
+  uint64_t now() override;
+  uint64_t micros() override;
+  void delay(unsigned long ms) override;
+  void setTimerCallback(BLETimerCallback callback, void* context) override;
+  void armTimer(uint64_t dueUs) override;
+
+protected:
+  // Last-peer record in NVS (Preferences namespace "blesync"): the
+  // address, and the handles discovered on it if there were any
+  static bool loadPeerRecord(std::string& address, GattHandles& handles, bool& haveHandles);
+  static void savePeerRecord(const std::string& address, const GattHandles* handles);
+};
+#endif
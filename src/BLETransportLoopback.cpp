@@ -0,0 +1,527 @@
+#include "BLETransportLoopback.h"
+#include "SyncFrame.h"
+#include <algorithm>
+
+#define L2CAP_HEADER_LEN 4
+#define T_IFS_US 150
+
+void LoopbackMedium::advance(unsigned long ms) {
+  currentTime += ms;
+  // Indexed rather than copied: this runs every simulated millisecond, and
+  // a copy would be the simulation's own heap traffic
+  for (size_t i = 0; i < attached.size(); i++) {
+    attached[i]->service();
+  }
+}
+
+void LoopbackMedium::attach(BLETransportLoopback* node) {
+  attached.push_back(node);
+}
+
+void LoopbackMedium::detach(BLETransportLoopback* node) {
+  attached.erase(std::remove(attached.begin(), attached.end(), node), attached.end());
+}
+
+void LoopbackMedium::dropLinks() {
+  for (size_t i = 0; i < attached.size(); i++) {
+    attached[i]->disconnectAll();
+  }
+}
+
+BLETransportLoopback* LoopbackMedium::find(const std::string& address) const {
+  for (size_t i = 0; i < attached.size(); i++) {
+    if (attached[i]->localAddress() == address) {
+      return attached[i];
+    }
+  }
+  return nullptr;
+}
+
+BLETransportLoopback::BLETransportLoopback(LoopbackMedium& medium, const std::string& address, unsigned long bootTime)
+  : medium(medium), address(address), bootTime(bootTime), busyUntilUs((uint64_t)bootTime * 1000) {
+  setHandleBase(0x0029);
+  medium.attach(this);
+}
+
+void BLETransportLoopback::setHandleBase(uint16_t base) {
+  for (int i = 0; i < CHAR_COUNT; i++) {
+    localHandles.chars[i] = base + 3 * i;
+  }
+  localHandles.counterCccd = localHandles.chars[CHAR_COUNTER] + 1;
+}
+
+BLETransportLoopback::~BLETransportLoopback() {
+  // Unlink silently: listeners on either side may already be gone
+  for (size_t i = 0; i < outbound.size(); i++) {
+    outbound[i].peer->dropInbound(this);
+  }
+  for (size_t i = 0; i < inbound.size(); i++) {
+    BLETransportLoopback* client = inbound[i];
+    for (size_t j = 0; j < client->outbound.size(); j++) {
+      if (client->outbound[j].peer == this) {
+        client->outbound.erase(client->outbound.begin() + j);
+        break;
+      }
+    }
+  }
+  medium.detach(this);
+}
+
+bool BLETransportLoopback::ready() const {
+  return medium.nowUs() >= busyUntilUs;
+}
+
+void BLETransportLoopback::blockUs(uint64_t us) {
+  busyUntilUs = std::max(busyUntilUs, medium.nowUs()) + us;
+}
+
+// The first connection event at or after atUs, or with peripheralAsleep
+// the first one a peripheral sleeping through its slave latency hears. A
+// requested profile takes over at its instant, which anchors the new
+// events.
+uint64_t BLETransportLoopback::nextEventUs(Link& link, uint64_t atUs, bool peripheralAsleep) {
+  if (link.requested != link.profile && atUs >= link.updateAtUs) {
+    link.profile = link.requested;
+    link.anchorUs = link.updateAtUs;
+  }
+  const BLELinkParams& params = BLE_LINK_PROFILES[link.profile];
+  uint64_t step = params.maxInterval * 1250UL * (peripheralAsleep ? params.latency + 1 : 1);
+  if (atUs <= link.anchorUs) {
+    return link.anchorUs;
+  }
+  return link.anchorUs + (atUs - link.anchorUs + step - 1) / step * step;
+}
+
+// Air time of one data packet carrying octets of payload, with the empty
+// packet that acknowledges it and both inter-frame spaces. A byte takes
+// 8 us on 1M and 4 us on 2M; each packet adds preamble (1 byte on 1M, 2 on
+// 2M), access address, header and CRC.
+static unsigned long packetUs(size_t octets, BLEPhy phy) {
+  unsigned long overhead = phy == BLE_PHY_2M ? 11 : 10;
+  unsigned long usPerByte = phy == BLE_PHY_2M ? 4 : 8;
+  return (octets + 2 * overhead) * usPerByte + 2 * T_IFS_US;
+}
+
+// Sends attLen bytes of ATT PDU, no earlier than atUs and behind whatever
+// is already queued the same way, and returns the medium time its last
+// packet is through. Packets follow each other within an event until the
+// next one is due, then wait for it. A fresh send never catches the event
+// that is just ending, and a request waits for an event the peripheral
+// hears; the peripheral wakes for any event it has data for.
+uint64_t BLETransportLoopback::transmit(Link& link, uint64_t atUs, size_t attLen, AirQueue queue) {
+  uint64_t cursor;
+  uint64_t eventStart;
+  if (link.airFreeUs[queue] > atUs) {
+    cursor = link.airFreeUs[queue];
+    eventStart = link.eventStartUs[queue];
+  } else {
+    cursor = eventStart = nextEventUs(link, atUs + 1, queue == AIR_REQUEST);
+  }
+  size_t remaining = attLen + L2CAP_HEADER_LEN;
+  while (remaining > 0) {
+    size_t octets = std::min(remaining, (size_t)link.info.txOctets);
+    uint64_t cost = packetUs(octets, link.info.phy);
+    uint64_t eventEnd = eventStart + BLE_LINK_PROFILES[link.profile].maxInterval * 1250UL;
+    if (cursor != eventStart && cursor + cost > eventEnd) {
+      cursor = eventStart = nextEventUs(link, cursor, false);
+    }
+    cursor += cost;
+    remaining -= octets;
+  }
+  link.eventStartUs[queue] = eventStart;
+  link.airFreeUs[queue] = cursor;
+  return cursor;
+}
+
+// Charges one ATT round trip and returns the medium time (us) at which the
+// request reaches the peer. With connection events the request goes out
+// on the next event the server hears and the response on the event after
+// it arrived; otherwise each leg is half the model's RTT plus jitter.
+uint64_t BLETransportLoopback::attExchange(Link& link, size_t requestLen, size_t responseLen) {
+  uint64_t sentAt = std::max(busyUntilUs, medium.nowUs());
+  if (medium.link.connectionEvents) {
+    uint64_t arriveAt = transmit(link, sentAt, requestLen, AIR_REQUEST);
+    blockUs(transmit(link, arriveAt, responseLen, AIR_RESPONSE) - sentAt);
+    return arriveAt;
+  }
+  unsigned long half = medium.link.attRoundTripMs * 500;
+  unsigned long requestUs = half + random(0, medium.link.attJitterUs + 1);
+  unsigned long responseUs = half + random(0, medium.link.attJitterUs + 1);
+  blockUs(requestUs + responseUs);
+  return sentAt + requestUs;
+}
+
+void BLETransportLoopback::setListener(BLETransportListener* l) {
+  listener = l;
+}
+
+void BLETransportLoopback::init(const char* deviceName) {
+  initialized = true;
+  advertising = true;
+}
+
+// A node that is inside a blocking call sees its own clock run ahead of the
+// medium until the call returns. Callbacks for a remote request see the
+// time the request arrived.
+uint64_t BLETransportLoopback::micros() {
+  if (timerFiringAtUs >= 0) {
+    return timerFiringAtUs;
+  }
+  if (handlingAtUs != 0) {
+    return localTimeAt(handlingAtUs);
+  }
+  return localTimeAt(std::max(medium.nowUs(), busyUntilUs));
+}
+
+long long BLETransportLoopback::localTimeAt(long long mediumUs) const {
+  long long elapsed = mediumUs - (long long)bootTime * 1000;
+  return (long long)clockStartUs + elapsed + (long long)(elapsed * skewPpm / 1e6);
+}
+
+long long BLETransportLoopback::mediumTimeOf(long long localUs) const {
+  return (long long)bootTime * 1000 + (long long)((localUs - (long long)clockStartUs) / (1 + skewPpm / 1e6));
+}
+
+uint64_t BLETransportLoopback::now() {
+  return micros() / 1000;
+}
+
+void BLETransportLoopback::delay(unsigned long ms) {
+  block(ms);
+}
+
+void BLETransportLoopback::setTimerCallback(BLETimerCallback callback, void* context) {
+  timerCallback = callback;
+  timerContext = context;
+}
+
+void BLETransportLoopback::armTimer(uint64_t dueUs) {
+  timerArmed = true;
+  timerFireUs = dueUs + random(0, medium.link.timerLatencyUs + 1);
+}
+
+void BLETransportLoopback::startAdvertising() {
+  advertising = true;
+}
+
+void BLETransportLoopback::stopAdvertising() {
+  advertising = false;
+}
+
+void BLETransportLoopback::setLocalValue(BLESyncChar id, const uint8_t* data, size_t len) {
+  values[id].assign((const char*)data, len);
+}
+
+// With connection events a notification goes out on the link's next one,
+// which the peripheral always wakes for when it has data, behind anything
+// already queued on the link; service() delivers it when its last packet
+// is through
+void BLETransportLoopback::notify(BLESyncChar id) {
+  uint64_t sentAt = std::max(busyUntilUs, medium.nowUs());
+  for (size_t i = 0; i < inbound.size(); i++) {
+    BLETransportLoopback* client = inbound[i];
+    Link* link = client->findLink(this);
+    if (link == nullptr || !link->subscribed[id] || !client->listener) {
+      continue;
+    }
+    if (medium.link.connectionEvents) {
+      PendingNotify pending;
+      pending.server = this;
+      pending.id = id;
+      pending.value = values[id];
+      pending.dueUs = transmit(*link, sentAt, ATT_HEADER_LEN + values[id].length(), AIR_NOTIFY);
+      medium.notifyLatency[link->profile].record((unsigned long)(pending.dueUs - sentAt));
+      client->pendingNotifies.push_back(pending);
+    } else {
+      client->listener->onNotify(address, id, (const uint8_t*)values[id].data(), values[id].length());
+    }
+  }
+}
+
+void BLETransportLoopback::setAdvertisedToken(const uint8_t* data, size_t len) {
+  advToken.assign((const char*)data, len);
+}
+
+bool BLETransportLoopback::startScan(unsigned long durationMs) {
+  if (scanning) {
+    return false;
+  }
+  scanning = true;
+  scanReported = false;
+  scanFound = 0;
+  scanStart = medium.now();
+  scanEnd = scanStart + durationMs;
+  return true;
+}
+
+void BLETransportLoopback::service() {
+  long long localNow = localTimeAt(medium.nowUs());
+  if (timerArmed && localNow >= (long long)timerFireUs && timerCallback) {
+    // The callback sees the clock at the moment it fired
+    timerArmed = false;
+    timerFiringAtUs = timerFireUs;
+    timerCallback(timerContext, timerFireUs);
+    timerFiringAtUs = -1;
+  }
+  uint64_t nowUs = medium.nowUs();
+  for (size_t i = 0; i < pendingNotifies.size();) {
+    if (pendingNotifies[i].dueUs > nowUs) {
+      i++;
+      continue;
+    }
+    PendingNotify pending = pendingNotifies[i];
+    pendingNotifies.erase(pendingNotifies.begin() + i);
+    // Lost with the link if it dropped in the meantime
+    if (findLink(pending.server) != nullptr && listener) {
+      handlingAtUs = pending.dueUs;
+      listener->onNotify(pending.server->address, pending.id, (const uint8_t*)pending.value.data(), pending.value.length());
+      handlingAtUs = 0;
+    }
+  }
+  if (!scanning) {
+    return;
+  }
+  unsigned long t = medium.now();
+  if (!scanReported && t - scanStart >= medium.link.advIntervalMs) {
+    scanReported = true;
+    const std::vector<BLETransportLoopback*>& peers = medium.nodes();
+    for (size_t i = 0; i < peers.size() && scanning; i++) {
+      BLETransportLoopback* peer = peers[i];
+      if (peer == this || !peer->initialized || !peer->advertising) {
+        continue;
+      }
+      scanFound++;
+      if (listener) listener->onScanResult(peer->address, (const uint8_t*)peer->advToken.data(), peer->advToken.length());
+    }
+  }
+  if (scanning && t >= scanEnd) {
+    scanning = false;
+    if (listener) listener->onScanComplete(scanFound);
+  }
+}
+
+void BLETransportLoopback::stopScan() {
+  scanning = false;
+}
+
+BLETransportLoopback::Link* BLETransportLoopback::findLink(const std::string& peerAddress) {
+  for (size_t i = 0; i < outbound.size(); i++) {
+    if (outbound[i].peer->address == peerAddress) {
+      return &outbound[i];
+    }
+  }
+  return nullptr;
+}
+
+BLETransportLoopback::Link* BLETransportLoopback::findLink(const BLETransportLoopback* peer) {
+  for (size_t i = 0; i < outbound.size(); i++) {
+    if (outbound[i].peer == peer) {
+      return &outbound[i];
+    }
+  }
+  return nullptr;
+}
+
+// A peer that isn't there to answer holds us for the whole timeout, as
+// on the radio; without one only connectMs is charged
+bool BLETransportLoopback::connect(const std::string& peerAddress, unsigned long timeoutMs) {
+  if (findLink(peerAddress) != nullptr) {
+    disconnect(peerAddress);
+  }
+  block(medium.link.connectMs);
+  if (outbound.size() >= BLESYNC_MAX_PEERS) {
+    return false;
+  }
+  BLETransportLoopback* peer = medium.find(peerAddress);
+  if (peer == nullptr || peer == this || !peer->initialized || !peer->advertising) {
+    if (timeoutMs > medium.link.connectMs) {
+      block(timeoutMs - medium.link.connectMs);
+    }
+    return false;
+  }
+  Link link;
+  link.peer = peer;
+  link.discovered = false;
+  for (int i = 0; i < CHAR_COUNT; i++) {
+    link.subscribed[i] = false;
+  }
+  link.profile = LINK_PROFILE_SYNC;
+  link.requested = LINK_PROFILE_SYNC;
+  link.updateAtUs = 0;
+  link.anchorUs = busyUntilUs;
+  // The MTU exchange and data length and PHY updates are not charged
+  link.info.attMtu = medium.link.attMtu;
+  link.info.txOctets = medium.link.llOctets;
+  link.info.phy = medium.link.phy;
+  for (int queue = 0; queue < AIR_QUEUE_COUNT; queue++) {
+    link.eventStartUs[queue] = link.airFreeUs[queue] = link.anchorUs;
+  }
+  outbound.push_back(link);
+  peer->inbound.push_back(this);
+  // Like the ESP32 stack, a server stops advertising once a client connects
+  peer->advertising = false;
+  if (peer->listener) peer->listener->onServerConnect(address);
+  if (listener) listener->onClientConnect(peerAddress);
+  return true;
+}
+
+bool BLETransportLoopback::discover(const std::string& peerAddress) {
+  Link* link = findLink(peerAddress);
+  if (link == nullptr) {
+    return false;
+  }
+  // A cached layout costs one validation read instead of full discovery
+  BLETransportLoopback* peer = link->peer;
+  GattHandles cached;
+  if (gattCache.lookup(peer->address, cached)) {
+    attExchange(*link, ATT_HEADER_LEN, 3);
+    if (memcmp(&cached, &peer->localHandles, sizeof(cached)) == 0) {
+      link->discovered = true;
+      return true;
+    }
+    gattCache.invalidate(peer->address);
+  }
+  block(medium.link.discoveryMs);
+  gattCache.store(peer->address, peer->localHandles);
+  link->discovered = true;
+  return true;
+}
+
+bool BLETransportLoopback::read(const std::string& peerAddress, BLESyncChar id, std::string& value) {
+  Link* link = findLink(peerAddress);
+  if (link == nullptr || !link->discovered) {
+    return false;
+  }
+  BLETransportLoopback* peer = link->peer;
+  size_t len = peer->values[id].length();
+  size_t chunk = link->info.attMtu - 1;
+  peer->handlingAtUs = attExchange(*link, ATT_HEADER_LEN, 1 + std::min(len, chunk));
+  if (peer->listener) peer->listener->onRead(id);
+  peer->handlingAtUs = 0;
+  value = peer->values[id];
+  // The rest of a long value comes in read blob requests
+  for (size_t offset = chunk; offset < len; offset += chunk) {
+    attExchange(*link, ATT_HEADER_LEN + 2, 1 + std::min(len - offset, chunk));
+  }
+  return true;
+}
+
+bool BLETransportLoopback::write(const std::string& peerAddress, BLESyncChar id, const uint8_t* data, size_t len) {
+  Link* link = findLink(peerAddress);
+  if (link == nullptr || !link->discovered) {
+    return false;
+  }
+  BLETransportLoopback* peer = link->peer;
+  uint64_t sentAt = std::max(busyUntilUs, medium.nowUs());
+  peer->handlingAtUs = attExchange(*link, ATT_HEADER_LEN + len, 1);
+  if (medium.link.connectionEvents) {
+    medium.writeLatency[link->profile].record((unsigned long)(peer->handlingAtUs - sentAt));
+  }
+  peer->values[id].assign((const char*)data, len);
+  if (peer->listener) peer->listener->onWrite(id, data, len);
+  peer->handlingAtUs = 0;
+  return true;
+}
+
+// Arrives as a write request would, but the caller goes on at once
+bool BLETransportLoopback::writeNoResponse(const std::string& peerAddress, BLESyncChar id, const uint8_t* data, size_t len) {
+  Link* link = findLink(peerAddress);
+  if (link == nullptr || !link->discovered) {
+    return false;
+  }
+  BLETransportLoopback* peer = link->peer;
+  uint64_t sentAt = std::max(busyUntilUs, medium.nowUs());
+  if (medium.link.connectionEvents) {
+    peer->handlingAtUs = transmit(*link, sentAt, ATT_HEADER_LEN + len, AIR_REQUEST);
+    medium.writeLatency[link->profile].record((unsigned long)(peer->handlingAtUs - sentAt));
+  } else {
+    peer->handlingAtUs = sentAt + medium.link.attRoundTripMs * 500 + random(0, medium.link.attJitterUs + 1);
+  }
+  peer->values[id].assign((const char*)data, len);
+  if (peer->listener) peer->listener->onWrite(id, data, len);
+  peer->handlingAtUs = 0;
+  return true;
+}
+
+bool BLETransportLoopback::subscribe(const std::string& peerAddress, BLESyncChar id) {
+  Link* link = findLink(peerAddress);
+  if (link == nullptr || !link->discovered) {
+    return false;
+  }
+  attExchange(*link, ATT_HEADER_LEN + 2, 1);
+  if (!medium.link.cccdWritable || id != CHAR_COUNTER) {
+    return false;
+  }
+  link->subscribed[id] = true;
+  return true;
+}
+
+// Updates go out on the next event the peripheral hears and take effect
+// six events later, the soonest instant the spec allows
+bool BLETransportLoopback::setLinkProfile(const std::string& peerAddress, BLELinkProfile profile) {
+  Link* link = findLink(peerAddress);
+  if (link == nullptr) {
+    return false;
+  }
+  if (!medium.link.connectionEvents) {
+    link->profile = profile;
+    link->requested = profile;
+    return true;
+  }
+  uint64_t sentAt = nextEventUs(*link, std::max(busyUntilUs, medium.nowUs()), true);
+  link->requested = profile;
+  link->updateAtUs = sentAt + 6 * BLE_LINK_PROFILES[link->profile].maxInterval * 1250UL;
+  return true;
+}
+
+bool BLETransportLoopback::linkInfo(const std::string& peerAddress, BLELinkInfo& info) {
+  Link* link = findLink(peerAddress);
+  if (link == nullptr) {
+    return false;
+  }
+  info = link->info;
+  return true;
+}
+
+void BLETransportLoopback::dropInbound(BLETransportLoopback* client) {
+  inbound.erase(std::remove(inbound.begin(), inbound.end(), client), inbound.end());
+}
+
+void BLETransportLoopback::unlink(BLETransportLoopback* peer) {
+  for (size_t i = 0; i < outbound.size(); i++) {
+    if (outbound[i].peer == peer) {
+      outbound.erase(outbound.begin() + i);
+      break;
+    }
+  }
+  peer->dropInbound(this);
+  if (peer->listener) peer->listener->onServerDisconnect(address);
+  if (listener) listener->onClientDisconnect(peer->address);
+}
+
+void BLETransportLoopback::disconnect(const std::string& peerAddress) {
+  Link* link = findLink(peerAddress);
+  if (link != nullptr) {
+    unlink(link->peer);
+  }
+}
+
+// Held in memory, standing in for NVS. It survives a simulated reboot
+// because rebootMaster() (native_main.cpp) carries it over to the new node.
+bool BLETransportLoopback::lastPeer(std::string& peerAddress) {
+  peerAddress = rememberedPeer;
+  return !peerAddress.empty();
+}
+
+void BLETransportLoopback::rememberPeer(const std::string& peerAddress) {
+  if (peerAddress != rememberedPeer) {
+    rememberedPeer = peerAddress;
+    peerRecordWrites++;
+  }
+}
+
+void BLETransportLoopback::disconnectAll() {
+  while (!outbound.empty()) {
+    unlink(outbound.front().peer);
+  }
+}
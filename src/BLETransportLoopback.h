@@ -0,0 +1,211 @@
+#pragma once
+#include "BLETransport.h"
+#include "GattHandleCache.h"
+#include "Histogram.h"
+#include <vector>
+
+class BLETransportLoopback;
+
+// Latency the loopback charges for each blocking radio operation, in ms
+struct LoopbackLinkModel {
+  unsigned long connectMs = 30;
+  unsigned long discoveryMs = 60;
+  unsigned long attRoundTripMs = 15;
+  unsigned long attJitterUs = 0;       // random extra delay on each leg of an ATT exchange
+  unsigned long advIntervalMs = 100;   // time for a scan to see an advertiser
+  bool cccdWritable = true;            // false: peers refuse notification subscriptions
+  unsigned long timerLatencyUs = 50;   // tick timer fires up to this late (esp_timer task dispatch)
+  // ATT traffic and notifications wait for the link's connection events,
+  // spaced by its BLELinkProfile, instead of costing attRoundTripMs.
+  // Off, setLinkProfile() is only recorded.
+  bool connectionEvents = false;
+  // What connect() settles on, both ends being alike. With
+  // connectionEvents, ATT PDUs are cut into packets of llOctets that each
+  // take air time on phy, back to back within an event.
+  uint16_t attMtu = BLESYNC_ATT_MTU;
+  uint16_t llOctets = BLESYNC_LL_OCTETS;
+  BLEPhy phy = BLE_PHY_1M;
+};
+
+// Shared "air" that loopback transports advertise, scan and connect over.
+// Time only moves when the owner calls advance(), which also delivers any
+// asynchronous events (scan results, scan completion) that have come due.
+class LoopbackMedium {
+public:
+  LoopbackLinkModel link;
+
+  unsigned long now() const { return currentTime; }
+  uint64_t nowUs() const { return (uint64_t)currentTime * 1000; }
+  void advance(unsigned long ms);
+
+  void attach(BLETransportLoopback* node);
+  void detach(BLETransportLoopback* node);
+  BLETransportLoopback* find(const std::string& address) const;
+  // Drop every client link at once, as an RF dropout would
+  void dropLinks();
+  const std::vector<BLETransportLoopback*>& nodes() const { return attached; }
+
+  // With link.connectionEvents, from a notify() to the client's onNotify
+  // and from a write() to the server's onWrite, by the link's profile
+  // when it was sent
+  Histogram notifyLatency[LINK_PROFILE_COUNT];
+  Histogram writeLatency[LINK_PROFILE_COUNT];
+
+private:
+  unsigned long currentTime = 0;
+  std::vector<BLETransportLoopback*> attached;
+};
+
+// In-process BLETransport: every node is an object on a LoopbackMedium and
+// GATT operations are direct calls into the peer. Blocking operations mark
+// the node busy for the link model's latency instead of sleeping.
+class BLETransportLoopback : public BLETransport {
+public:
+  BLETransportLoopback(LoopbackMedium& medium, const std::string& address, unsigned long bootTime);
+  ~BLETransportLoopback();
+
+  // True once the node's boot time has passed and no blocking call is pending
+  bool ready() const;
+
+  void setListener(BLETransportListener* listener) override;
+  void init(const char* deviceName) override;
+  std::string localAddress() override { return address; }
+
+  uint64_t now() override;
+  uint64_t micros() override;
+  void delay(unsigned long ms) override;
+  void setTimerCallback(BLETimerCallback callback, void* context) override;
+  void armTimer(uint64_t dueUs) override;
+
+  void startAdvertising() override;
+  void stopAdvertising() override;
+  void setLocalValue(BLESyncChar id, const uint8_t* data, size_t len) override;
+  void notify(BLESyncChar id) override;
+  void setAdvertisedToken(const uint8_t* data, size_t len) override;
+
+  bool startScan(unsigned long durationMs) override;
+  void stopScan() override;
+
+  bool connect(const std::string& address, unsigned long timeoutMs) override;
+  bool discover(const std::string& address) override;
+  bool read(const std::string& address, BLESyncChar id, std::string& value) override;
+  bool write(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) override;
+  bool writeNoResponse(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) override;
+  bool subscribe(const std::string& address, BLESyncChar id) override;
+  bool setLinkProfile(const std::string& address, BLELinkProfile profile) override;
+  bool linkInfo(const std::string& address, BLELinkInfo& info) override;
+  void disconnect(const std::string& address) override;
+  bool isConnected(const std::string& address) override { return findLink(address) != nullptr; }
+  bool lastPeer(std::string& address) override;
+  void rememberPeer(const std::string& address) override;
+
+  // Drop every client link we hold
+  void disconnectAll();
+  // Hold the node as a blocking call would, e.g. a UART write
+  void blockUs(uint64_t us);
+
+  // Deliver asynchronous events that are due at the medium's current time.
+  // The tick timer fires here too, so on its own timeline rather than
+  // when the node next gets to run.
+  void service();
+
+  // Handle layout of this node's GATT server. Changing it makes cached
+  // handles on peers stale, as a firmware update would.
+  void setHandleBase(uint16_t base);
+  unsigned long bootTimeMs() const { return bootTime; }
+
+  // Crystal error: this node's clock runs (1 + ppm / 1e6) times the medium's
+  void setClockSkewPpm(double ppm) { skewPpm = ppm; }
+  double clockSkewPpm() const { return skewPpm; }
+  // micros() reads startUs at boot instead of 0, e.g. to start a node just
+  // short of where a 32-bit clock would wrap
+  void setClockStartUs(uint64_t startUs) { clockStartUs = startUs; }
+  // This node's micros() reading at a medium time, and the inverse
+  long long localTimeAt(long long mediumUs) const;
+  long long mediumTimeOf(long long localUs) const;
+  const GattHandleCache& handleCache() const { return gattCache; }
+  // What a peer reading id would get, without the ATT exchange
+  const std::string& localValue(BLESyncChar id) const { return values[id]; }
+  // Notifications on their way to our client side
+  size_t notificationsInFlight() const { return pendingNotifies.size(); }
+  // Remote clients linked to our server side
+  size_t inboundLinks() const { return inbound.size(); }
+  // Times rememberPeer() changed the record, i.e. NVS writes on hardware
+  uint32_t peerRecordWriteCount() const { return peerRecordWrites; }
+
+private:
+  // Traffic on a link, each kind with its own packets in flight. They
+  // share connection events but not packets: data rides on the
+  // acknowledgements, and the peripheral's notifications stay clear of
+  // responses that an exchange still waiting for its event has booked.
+  enum AirQueue {
+    AIR_REQUEST,    // central to peripheral
+    AIR_RESPONSE,
+    AIR_NOTIFY,
+    AIR_QUEUE_COUNT
+  };
+
+  // One of our client links to a remote server
+  struct Link {
+    BLETransportLoopback* peer;
+    bool discovered;
+    bool subscribed[CHAR_COUNT];
+    BLELinkProfile profile;
+    BLELinkProfile requested;     // takes over at updateAtUs
+    uint64_t updateAtUs;
+    uint64_t anchorUs;            // medium time of a connection event
+    BLELinkInfo info;
+    // Per AirQueue, the event its last packet went in and when it was through
+    uint64_t eventStartUs[AIR_QUEUE_COUNT];
+    uint64_t airFreeUs[AIR_QUEUE_COUNT];
+  };
+
+  // A notification waiting for its connection event
+  struct PendingNotify {
+    BLETransportLoopback* server;
+    BLESyncChar id;
+    std::string value;
+    uint64_t dueUs;
+  };
+
+  void block(unsigned long ms) { blockUs(ms * 1000); }
+  uint64_t attExchange(Link& link, size_t requestLen, size_t responseLen);
+  static uint64_t nextEventUs(Link& link, uint64_t atUs, bool peripheralAsleep);
+  static uint64_t transmit(Link& link, uint64_t atUs, size_t attLen, AirQueue queue);
+  void dropInbound(BLETransportLoopback* client);
+  Link* findLink(const std::string& address);
+  Link* findLink(const BLETransportLoopback* peer);
+  void unlink(BLETransportLoopback* peer);
+
+  LoopbackMedium& medium;
+  std::string address;
+  unsigned long bootTime;
+  uint64_t busyUntilUs;
+  uint64_t handlingAtUs = 0;   // medium time of the remote request being handled
+  double skewPpm = 0;
+  uint64_t clockStartUs = 0;
+  BLETransportListener* listener = nullptr;
+  bool initialized = false;
+  bool advertising = false;
+  bool scanning = false;
+  bool scanReported = false;
+  unsigned long scanStart = 0;
+  unsigned long scanEnd = 0;
+  int scanFound = 0;
+  BLETimerCallback timerCallback = nullptr;
+  void* timerContext = nullptr;
+  bool timerArmed = false;
+  uint64_t timerFireUs = 0;         // local time, latency included
+  long long timerFiringAtUs = -1;   // local time while the callback runs
+  GattHandles localHandles;
+  GattHandleCache gattCache;
+  std::string values[CHAR_COUNT];
+  std::string advToken;
+  std::string rememberedPeer;
+  uint32_t peerRecordWrites = 0;
+
+  // Remote servers our client is linked to, and remote clients linked to us
+  std::vector<Link> outbound;
+  std::vector<BLETransportLoopback*> inbound;
+  std::vector<PendingNotify> pendingNotifies;   // to our client side, oldest first
+};
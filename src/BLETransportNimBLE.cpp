@@ -0,0 +1,566 @@
+#if defined(ARDUINO) && defined(BLESYNC_NIMBLE)
+#include "BLETransportNimBLE.h"
+#include <NimBLEDevice.h>
+#include <soc/soc_caps.h>
+#include "BLESyncLog.h"
+#include "GattHandleCache.h"
+
+#define RAW_GATT_TIMEOUT_MS 2000  // Wait for a handle-based ATT response
+#define CONNECT_TIMEOUT_S 30        // NimBLEClient's own, for connect() without a timeout
+
+static BLETransportListener* listener = nullptr;
+static std::string advName;
+
+// BLE Server components
+static NimBLEServer* pServer = nullptr;
+static NimBLEService* pService = nullptr;
+static NimBLECharacteristic* pLocalCharacteristics[CHAR_COUNT] = { nullptr };
+
+// BLE Client components, pooled as in BLETransportArduino: one slot per
+// link, in use while address is set, each keeping its NimBLEClient for
+// good. Only loop() takes or releases a slot.
+struct ClientLink {
+  NimBLEClient* client;
+  char address[18];                 // empty = free
+  NimBLERemoteService* pRemoteService;
+  NimBLERemoteCharacteristic* pRemoteCharacteristics[CHAR_COUNT];
+  // Reconnects to a cached peer skip discovery and talk to the attribute
+  // handles directly through the host's GATT client API
+  volatile bool usingCachedHandles;
+  GattHandles handles;
+  uint16_t txOctets;                // data length asked for after connect
+};
+static ClientLink links[BLESYNC_MAX_PEERS];
+
+static GattHandleCache handleCache;
+static SemaphoreHandle_t rawOpDone = nullptr;
+static volatile int rawOpStatus = 0;
+static std::string rawReadValue;
+
+static void clearRemoteHandles(ClientLink& link) {
+  link.pRemoteService = nullptr;
+  for (int i = 0; i < CHAR_COUNT; i++) {
+    link.pRemoteCharacteristics[i] = nullptr;
+  }
+  link.usingCachedHandles = false;
+}
+
+static ClientLink* findLink(const std::string& address) {
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (links[i].address[0] != '\0' && address == links[i].address) {
+      return &links[i];
+    }
+  }
+  return nullptr;
+}
+
+// A released slot's client can still report its disconnect; that finds
+// nothing here and is dropped
+static ClientLink* findLink(NimBLEClient* client) {
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (links[i].address[0] != '\0' && links[i].client == client) {
+      return &links[i];
+    }
+  }
+  return nullptr;
+}
+
+// Prefers a slot whose client has finished disconnecting
+static ClientLink* findFreeLink() {
+  ClientLink* fallback = nullptr;
+  for (int i = 0; i < BLESYNC_MAX_PEERS; i++) {
+    if (links[i].address[0] != '\0') {
+      continue;
+    }
+    if (links[i].client == nullptr || !links[i].client->isConnected()) {
+      return &links[i];
+    }
+    if (fallback == nullptr) {
+      fallback = &links[i];
+    }
+  }
+  return fallback;
+}
+
+// Keeps the client for the slot's next link
+static void releaseLink(ClientLink& link) {
+  clearRemoteHandles(link);
+  if (link.client != nullptr && link.client->isConnected()) {
+    link.client->disconnect();
+  }
+  link.address[0] = '\0';
+}
+
+// NimBLEClient only routes notifications for attributes it discovered, so
+// links in cached-handle mode pick theirs up here; sees every GAP event
+static int rawGapHandler(ble_gap_event* event, void* arg) {
+  if (event->type != BLE_GAP_EVENT_NOTIFY_RX) {
+    return 0;
+  }
+  for (int l = 0; l < BLESYNC_MAX_PEERS; l++) {
+    ClientLink& link = links[l];
+    if (link.address[0] == '\0' || !link.usingCachedHandles ||
+        link.client->getConnId() != event->notify_rx.conn_handle) {
+      continue;
+    }
+    for (int i = 0; i < CHAR_COUNT; i++) {
+      if (link.handles.chars[i] == event->notify_rx.attr_handle) {
+        uint8_t value[32];
+        uint16_t len = OS_MBUF_PKTLEN(event->notify_rx.om);
+        if (len <= sizeof(value) && os_mbuf_copydata(event->notify_rx.om, 0, len, value) == 0) {
+          if (listener) listener->onNotify(link.address, (BLESyncChar)i, value, len);
+        }
+        break;
+      }
+    }
+    break;
+  }
+  return 0;
+}
+
+static int onRawRead(uint16_t connHandle, const ble_gatt_error* error, ble_gatt_attr* attr, void* arg) {
+  rawOpStatus = error->status;
+  if (error->status == 0 && attr != nullptr) {
+    uint16_t len = OS_MBUF_PKTLEN(attr->om);
+    rawReadValue.resize(len);
+    os_mbuf_copydata(attr->om, 0, len, &rawReadValue[0]);
+  }
+  xSemaphoreGive(rawOpDone);
+  return 0;
+}
+
+static int onRawWrite(uint16_t connHandle, const ble_gatt_error* error, ble_gatt_attr* attr, void* arg) {
+  rawOpStatus = error->status;
+  xSemaphoreGive(rawOpDone);
+  return 0;
+}
+
+static bool rawWait() {
+  return xSemaphoreTake(rawOpDone, pdMS_TO_TICKS(RAW_GATT_TIMEOUT_MS)) == pdTRUE &&
+         rawOpStatus == 0;
+}
+
+static bool rawRead(ClientLink& link, uint16_t handle, std::string& value) {
+  xSemaphoreTake(rawOpDone, 0);
+  if (ble_gattc_read(link.client->getConnId(), handle, onRawRead, nullptr) != 0 || !rawWait()) {
+    return false;
+  }
+  value = rawReadValue;
+  return true;
+}
+
+static bool rawWrite(ClientLink& link, uint16_t handle, const uint8_t* data, size_t len) {
+  xSemaphoreTake(rawOpDone, 0);
+  return ble_gattc_write_flat(link.client->getConnId(), handle, data, len, onRawWrite, nullptr) == 0 &&
+         rawWait();
+}
+
+// Server callbacks
+class MyServerCallbacks: public NimBLEServerCallbacks {
+    void onConnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {
+      BLESYNC_LOGI("Server: Client connected");
+      if (listener) listener->onServerConnect(NimBLEAddress(desc->peer_ota_addr).toString());
+    }
+    void onDisconnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {
+      BLESYNC_LOGI("Server: Client disconnected");
+      if (listener) listener->onServerDisconnect(NimBLEAddress(desc->peer_ota_addr).toString());
+    }
+};
+
+// Client callbacks
+class MyClientCallback : public NimBLEClientCallbacks {
+  void onConnect(NimBLEClient* pclient) {
+    BLESYNC_LOGI("Client: Connected to server");
+    if (listener) listener->onClientConnect(pclient->getPeerAddress().toString());
+  }
+  void onDisconnect(NimBLEClient* pclient) {
+    BLESYNC_LOGI("Client: Disconnected from server");
+    // The slot stays allocated until loop() handles the event and calls
+    // disconnect(), so nothing here races with a GATT call in progress
+    ClientLink* link = findLink(pclient);
+    if (link != nullptr && listener) listener->onClientDisconnect(link->address);
+  }
+};
+
+// Shared by every client; it finds the link from the client it is given
+static MyClientCallback clientCallbacks;
+
+// Sync and timestamp characteristic callbacks
+class MyCharacteristicCallback: public NimBLECharacteristicCallbacks {
+public:
+    explicit MyCharacteristicCallback(BLESyncChar id) : id(id) {}
+    void onWrite(NimBLECharacteristic* pCharacteristic) {
+      NimBLEAttValue value = pCharacteristic->getValue();
+      if (listener) listener->onWrite(id, value.data(), value.length());
+    }
+    // Runs before the value goes out, so a fresh setValue() is what the peer reads
+    void onRead(NimBLECharacteristic* pCharacteristic) {
+      if (listener) listener->onRead(id);
+    }
+private:
+    BLESyncChar id;
+};
+
+// Remote characteristic notifications
+static void notifyCallback(NimBLERemoteCharacteristic* pChar, uint8_t* pData, size_t length, bool isNotify) {
+  for (int l = 0; l < BLESYNC_MAX_PEERS; l++) {
+    for (int i = 0; i < CHAR_COUNT; i++) {
+      if (links[l].address[0] != '\0' && links[l].pRemoteCharacteristics[i] == pChar) {
+        if (listener) listener->onNotify(links[l].address, (BLESyncChar)i, pData, length);
+        return;
+      }
+    }
+  }
+}
+
+// Scan results aren't kept (setMaxResults(0)), so matches are counted
+// here for onScanComplete
+static volatile int scanMatches = 0;
+// NimBLEScan::stop() runs the completion callback too; the interface
+// promises no onScanComplete after stopScan()
+static volatile bool scanStopped = false;
+
+// Advertised device scanner
+class MyAdvertisedDeviceCallbacks: public NimBLEAdvertisedDeviceCallbacks {
+    void onResult(NimBLEAdvertisedDevice* advertisedDevice) {
+      if (advertisedDevice->isAdvertisingService(NimBLEUUID(SERVICE_UUID))) {
+        BLESYNC_LOGD("Found target device: %s", advertisedDevice->getAddress().toString().c_str());
+        scanMatches++;
+        std::string token;
+        if (advertisedDevice->haveManufacturerData()) {
+          std::string mfr = advertisedDevice->getManufacturerData();
+          if (mfr.length() >= 2 && (uint8_t)mfr[0] == (ADV_COMPANY_ID & 0xff) &&
+              (uint8_t)mfr[1] == (ADV_COMPANY_ID >> 8)) {
+            token = mfr.substr(2);
+          }
+        }
+        if (listener) listener->onScanResult(advertisedDevice->getAddress().toString(),
+                                             (const uint8_t*)token.data(), token.length());
+      }
+    }
+};
+
+// Runs on the BLE host task when a scan ends
+static void scanComplete(NimBLEScanResults foundDevices) {
+  if (scanStopped) {
+    return;
+  }
+  if (listener) listener->onScanComplete(scanMatches);
+}
+
+void BLETransportNimBLE::setListener(BLETransportListener* l) {
+  listener = l;
+}
+
+void BLETransportNimBLE::init(const char* deviceName) {
+  NimBLEDevice::init(deviceName);
+  // The client exchanges this with each server as it connects
+  NimBLEDevice::setMTU(BLESYNC_ATT_MTU);
+  advName = deviceName;
+
+  pServer = NimBLEDevice::createServer();
+  static MyServerCallbacks serverCallbacks;
+  pServer->setCallbacks(&serverCallbacks, false);
+  pService = pServer->createService(SERVICE_UUID);
+  // NimBLE adds the CCCD to a NOTIFY characteristic itself
+  pLocalCharacteristics[CHAR_COUNTER] = pService->createCharacteristic(
+    COUNTER_CHARACTERISTIC_UUID,
+    NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY
+  );
+  pLocalCharacteristics[CHAR_SYNC] = pService->createCharacteristic(
+    SYNC_CHARACTERISTIC_UUID,
+    NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_NR
+  );
+  pLocalCharacteristics[CHAR_TIMESTAMP] = pService->createCharacteristic(
+    TIMESTAMP_CHARACTERISTIC_UUID,
+    NIMBLE_PROPERTY::READ
+  );
+  pLocalCharacteristics[CHAR_METRICS] = pService->createCharacteristic(
+    METRICS_CHARACTERISTIC_UUID,
+    NIMBLE_PROPERTY::READ
+  );
+  static MyCharacteristicCallback syncCallbacks(CHAR_SYNC);
+  static MyCharacteristicCallback timestampCallbacks(CHAR_TIMESTAMP);
+  pLocalCharacteristics[CHAR_SYNC]->setCallbacks(&syncCallbacks);
+  pLocalCharacteristics[CHAR_TIMESTAMP]->setCallbacks(&timestampCallbacks);
+  pService->start();
+  NimBLEAdvertising* pAdvertising = NimBLEDevice::getAdvertising();
+  pAdvertising->addServiceUUID(SERVICE_UUID);
+  pAdvertising->setScanResponse(true);
+  pAdvertising->setMinPreferred(BLE_LINK_PROFILES[LINK_PROFILE_SYNC].minInterval);
+  pAdvertising->setMaxPreferred(BLE_LINK_PROFILES[LINK_PROFILE_SYNC].maxInterval);
+  pAdvertising->start();
+  BLESYNC_LOGI("BLE Server started and advertising");
+
+  NimBLEScan* pBLEScan = NimBLEDevice::getScan();
+  static MyAdvertisedDeviceCallbacks scanCallbacks;
+  pBLEScan->setAdvertisedDeviceCallbacks(&scanCallbacks, false);
+  pBLEScan->setInterval(1349);
+  pBLEScan->setWindow(449);
+  pBLEScan->setActiveScan(true);
+  pBLEScan->setMaxResults(0);
+  BLESYNC_LOGI("BLE Client scanner configured");
+
+  rawOpDone = xSemaphoreCreateBinary();
+  NimBLEDevice::setCustomGapHandler(rawGapHandler);
+
+  // Handles saved with the last peer let a reconnect to it after a reboot
+  // skip discovery too; discover() still validates them first
+  std::string peer;
+  GattHandles handles;
+  bool haveHandles;
+  if (loadPeerRecord(peer, handles, haveHandles) && haveHandles) {
+    handleCache.store(peer, handles);
+  }
+}
+
+std::string BLETransportNimBLE::localAddress() {
+  return NimBLEDevice::getAddress().toString();
+}
+
+void BLETransportNimBLE::startAdvertising() {
+  NimBLEDevice::startAdvertising();
+}
+
+void BLETransportNimBLE::stopAdvertising() {
+  NimBLEDevice::stopAdvertising();
+}
+
+void BLETransportNimBLE::setLocalValue(BLESyncChar id, const uint8_t* data, size_t len) {
+  pLocalCharacteristics[id]->setValue(data, len);
+}
+
+void BLETransportNimBLE::notify(BLESyncChar id) {
+  pLocalCharacteristics[id]->notify();
+}
+
+// Flags + 128-bit service UUID + manufacturer data fill the 31-byte
+// advertisement, so the name moves to the scan response
+void BLETransportNimBLE::setAdvertisedToken(const uint8_t* data, size_t len) {
+  NimBLEAdvertisementData advData;
+  advData.setFlags(BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP);
+  advData.setCompleteServices(NimBLEUUID(SERVICE_UUID));
+  std::string mfr;
+  mfr += (char)(ADV_COMPANY_ID & 0xff);
+  mfr += (char)(ADV_COMPANY_ID >> 8);
+  mfr.append((const char*)data, len);
+  advData.setManufacturerData(mfr);
+  NimBLEAdvertisementData scanResponse;
+  scanResponse.setName(advName);
+  const BLELinkParams& params = BLE_LINK_PROFILES[LINK_PROFILE_SYNC];
+  scanResponse.setPreferredParams(params.minInterval, params.maxInterval);
+  NimBLEAdvertising* pAdvertising = NimBLEDevice::getAdvertising();
+  pAdvertising->setAdvertisementData(advData);
+  pAdvertising->setScanResponseData(scanResponse);
+}
+
+bool BLETransportNimBLE::startScan(unsigned long durationMs) {
+  scanMatches = 0;
+  scanStopped = false;
+  // Whole seconds; rounded up so a shorter scan isn't cut
+  return NimBLEDevice::getScan()->start((durationMs + 999) / 1000, scanComplete, false);
+}
+
+void BLETransportNimBLE::stopScan() {
+  scanStopped = true;
+  NimBLEDevice::getScan()->stop();
+}
+
+bool BLETransportNimBLE::connect(const std::string& address, unsigned long timeoutMs) {
+  ClientLink* link = findLink(address);
+  if (link != nullptr) {
+    releaseLink(*link);
+  } else {
+    link = findFreeLink();
+    if (link == nullptr) {
+      BLESYNC_LOGW("No free client link");
+      return false;
+    }
+  }
+  if (link->client == nullptr) {
+    link->client = NimBLEDevice::createClient();
+    link->client->setClientCallbacks(&clientCallbacks, false);
+    const BLELinkParams& params = BLE_LINK_PROFILES[LINK_PROFILE_SYNC];
+    link->client->setConnectionParams(params.minInterval, params.maxInterval, params.latency, params.timeout);
+  }
+  strncpy(link->address, address.c_str(), sizeof(link->address) - 1);
+  link->address[sizeof(link->address) - 1] = '\0';
+  // ESP32 peers advertise their public address, so connecting by address
+  // needs no copy of the scan result shared with the scan callback.
+  // Dropping the previous peer's attributes makes discover() fetch this one's.
+  // The timeout is whole seconds here; the host cancels the attempt at it.
+  link->client->setConnectTimeout(timeoutMs > 0 ? (uint8_t)((timeoutMs + 999) / 1000) : CONNECT_TIMEOUT_S);
+  if (!link->client->connect(NimBLEAddress(address), true)) {
+    releaseLink(*link);
+    return false;
+  }
+  // Full-size LL packets, and the 2M PHY where the controller has it
+  // (ESP32-S3). The host does not pass the data length outcome on, so
+  // linkInfo() reports what we asked for; a peer that settles on less
+  // only costs throughput.
+  link->client->setDataLen(BLESYNC_LL_OCTETS);
+  link->txOctets = BLESYNC_LL_OCTETS;
+#if SOC_BLE_50_SUPPORTED
+  ble_gap_set_prefered_le_phy(link->client->getConnId(), BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+                              BLE_GAP_LE_PHY_CODED_ANY);
+#endif
+  return true;
+}
+
+bool BLETransportNimBLE::discover(const std::string& address) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  GattHandles cached;
+  if (handleCache.lookup(address, cached)) {
+    // Validate with one cheap read: the timestamp is at least 4 bytes
+    link->handles = cached;
+    link->usingCachedHandles = true;
+    std::string probe;
+    if (rawRead(*link, cached.chars[CHAR_TIMESTAMP], probe) && probe.length() >= 4) {
+      BLESYNC_LOGI("Reusing cached GATT handles for %s", address.c_str());
+      return true;
+    }
+    BLESYNC_LOGI("Cached GATT handles are stale, rediscovering");
+    link->usingCachedHandles = false;
+    handleCache.invalidate(address);
+  }
+  link->pRemoteService = link->client->getService(SERVICE_UUID);
+  if (link->pRemoteService == nullptr) {
+    BLESYNC_LOGW("Failed to find service UUID");
+    return false;
+  }
+  BLESYNC_LOGI("Found service");
+  for (int i = 0; i < CHAR_COUNT; i++) {
+    link->pRemoteCharacteristics[i] = link->pRemoteService->getCharacteristic(charUUIDs[i]);
+    // Firmware from before CHAR_METRICS doesn't have it, and sync never reads it
+    if (link->pRemoteCharacteristics[i] == nullptr && i != CHAR_METRICS) {
+      BLESYNC_LOGW("Failed to find characteristics");
+      return false;
+    }
+  }
+  for (int i = 0; i < CHAR_COUNT; i++) {
+    link->handles.chars[i] = link->pRemoteCharacteristics[i] != nullptr ? link->pRemoteCharacteristics[i]->getHandle() : 0;
+  }
+  NimBLERemoteDescriptor* pCccd = link->pRemoteCharacteristics[CHAR_COUNTER]->getDescriptor(NimBLEUUID((uint16_t)0x2902));
+  link->handles.counterCccd = pCccd != nullptr ? pCccd->getHandle() : 0;
+  handleCache.store(address, link->handles);
+  return true;
+}
+
+bool BLETransportNimBLE::read(const std::string& address, BLESyncChar id, std::string& value) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  if (link->usingCachedHandles) {
+    return link->handles.chars[id] != 0 && rawRead(*link, link->handles.chars[id], value);
+  }
+  if (link->pRemoteCharacteristics[id] == nullptr) {
+    return false;
+  }
+  NimBLEAttValue remote = link->pRemoteCharacteristics[id]->readValue();
+  value.assign((const char*)remote.data(), remote.length());
+  return true;
+}
+
+bool BLETransportNimBLE::write(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  if (link->usingCachedHandles) {
+    return rawWrite(*link, link->handles.chars[id], data, len);
+  }
+  if (link->pRemoteCharacteristics[id] == nullptr) {
+    return false;
+  }
+  return link->pRemoteCharacteristics[id]->writeValue(data, len, true);
+}
+
+bool BLETransportNimBLE::writeNoResponse(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  if (link->usingCachedHandles) {
+    return ble_gattc_write_no_rsp_flat(link->client->getConnId(), link->handles.chars[id], data, len) == 0;
+  }
+  NimBLERemoteCharacteristic* pChar = link->pRemoteCharacteristics[id];
+  if (pChar == nullptr) {
+    return false;
+  }
+  return pChar->writeValue(data, len, !pChar->canWriteNoResponse());
+}
+
+bool BLETransportNimBLE::subscribe(const std::string& address, BLESyncChar id) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr) {
+    return false;
+  }
+  if (link->usingCachedHandles) {
+    if (id != CHAR_COUNTER || link->handles.counterCccd == 0) {
+      return false;
+    }
+    static const uint8_t enableNotify[2] = { 0x01, 0x00 };
+    return rawWrite(*link, link->handles.counterCccd, enableNotify, 2);
+  }
+  NimBLERemoteCharacteristic* pChar = link->pRemoteCharacteristics[id];
+  if (pChar == nullptr || !pChar->canNotify()) {
+    return false;
+  }
+  return pChar->subscribe(true, notifyCallback, true);
+}
+
+bool BLETransportNimBLE::setLinkProfile(const std::string& address, BLELinkProfile profile) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr || !link->client->isConnected()) {
+    return false;
+  }
+  const BLELinkParams& params = BLE_LINK_PROFILES[profile];
+  return link->client->updateConnParams(params.minInterval, params.maxInterval, params.latency, params.timeout);
+}
+
+bool BLETransportNimBLE::linkInfo(const std::string& address, BLELinkInfo& info) {
+  ClientLink* link = findLink(address);
+  if (link == nullptr || !link->client->isConnected()) {
+    return false;
+  }
+  info.attMtu = link->client->getMTU();
+  info.txOctets = link->txOctets;
+  info.phy = BLE_PHY_1M;
+#if SOC_BLE_50_SUPPORTED
+  uint8_t txPhy, rxPhy;
+  if (ble_gap_read_le_phy(link->client->getConnId(), &txPhy, &rxPhy) == 0 && txPhy == BLE_GAP_LE_PHY_2M) {
+    info.phy = BLE_PHY_2M;
+  }
+#endif
+  return true;
+}
+
+void BLETransportNimBLE::disconnect(const std::string& address) {
+  ClientLink* link = findLink(address);
+  if (link != nullptr) {
+    releaseLink(*link);
+  }
+}
+
+bool BLETransportNimBLE::isConnected(const std::string& address) {
+  ClientLink* link = findLink(address);
+  return link != nullptr && link->client->isConnected();
+}
+
+bool BLETransportNimBLE::lastPeer(std::string& address) {
+  GattHandles handles;
+  bool haveHandles;
+  return loadPeerRecord(address, handles, haveHandles);
+}
+
+// discover() left the peer's handles in the cache
+void BLETransportNimBLE::rememberPeer(const std::string& address) {
+  GattHandles handles;
+  bool haveHandles = !address.empty() && handleCache.peek(address, handles);
+  savePeerRecord(address, haveHandles ? &handles : nullptr);
+}
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+#if defined(ARDUINO) && defined(BLESYNC_NIMBLE)
+#include "BLETransportEsp32.h"
+
+// BLETransport backed by NimBLE-Arduino, selected with -DBLESYNC_NIMBLE.
+// Same service, advertisement and behaviour as BLETransportArduino, on a
+// host stack that needs far less RAM and flash. NimBLEDevice is a
+// singleton, so only one instance may exist.
+class BLETransportNimBLE : public BLETransportEsp32 {
+public:
+  void setListener(BLETransportListener* listener) override;
+  void init(const char* deviceName) override;
+  std::string localAddress() override;
+
+  void startAdvertising() override;
+  void stopAdvertising() override;
+  void setLocalValue(BLESyncChar id, const uint8_t* data, size_t len) override;
+  void notify(BLESyncChar id) override;
+  void setAdvertisedToken(const uint8_t* data, size_t len) override;
+
+  bool startScan(unsigned long durationMs) override;
+  void stopScan() override;
+
+  bool connect(const std::string& address, unsigned long timeoutMs) override;
+  bool discover(const std::string& address) override;
+  bool read(const std::string& address, BLESyncChar id, std::string& value) override;
+  bool write(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) override;
+  bool writeNoResponse(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) override;
+  bool subscribe(const std::string& address, BLESyncChar id) override;
+  bool setLinkProfile(const std::string& address, BLELinkProfile profile) override;
+  bool linkInfo(const std::string& address, BLELinkInfo& info) override;
+  void disconnect(const std::string& address) override;
+  bool isConnected(const std::string& address) override;
+  bool lastPeer(std::string& address) override;
+  void rememberPeer(const std::string& address) override;
+};
+#endif
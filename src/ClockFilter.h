@@ -0,0 +1,99 @@
+#pragma once
+#include "BLEPlatform.h"
+#include <math.h>
+
+// NTP-style clock filter for one peer. Each sample is a timed read of the
+// peer's micros(): t1 and t4 on our clock around the read, t2 stamped by
+// the peer while serving it. Assuming symmetric legs,
+//
+//   delay  = (t4 - t1) / 2
+//   offset = t2 - (t1 + delay)      peer clock minus ours
+//
+// Queueing only ever lengthens a leg, so the sample with the shortest round
+// trip is the most trustworthy; its offset is the estimate. Clocks drift
+// apart between samples, so older samples are charged CLOCK_FILTER_AGE_PPM
+// of their age on top of their round trip. Jitter is the RMS spread of the
+// other samples around the chosen one.
+#define CLOCK_FILTER_SIZE 8
+#define CLOCK_FILTER_AGE_PPM 100
+
+struct ClockFilter {
+  int64_t offsets[CLOCK_FILTER_SIZE];
+  uint32_t rtts[CLOCK_FILTER_SIZE];
+  uint64_t takenAt[CLOCK_FILTER_SIZE];
+  uint8_t count = 0;
+  uint8_t next = 0;
+
+  void add(uint64_t t1, uint64_t t2, uint64_t t4) {
+    uint32_t rtt = (uint32_t)(t4 - t1);
+    offsets[next] = (int64_t)(t2 - (t1 + rtt / 2));
+    rtts[next] = rtt;
+    takenAt[next] = t4;
+    latest = t4;
+    next = (next + 1) % CLOCK_FILTER_SIZE;
+    if (count < CLOCK_FILTER_SIZE) {
+      count++;
+    }
+  }
+
+  bool valid() const { return count > 0; }
+
+  int64_t offsetUs() const { return valid() ? offsets[best()] : 0; }
+  uint32_t delayUs() const { return valid() ? rtts[best()] / 2 : 0; }
+
+  uint32_t jitterUs() const {
+    if (count < 2) {
+      return 0;
+    }
+    int64_t center = offsets[best()];
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+      double d = (double)(offsets[i] - center);
+      sum += d * d;
+    }
+    return (uint32_t)sqrt(sum / (count - 1));
+  }
+
+  // RMS of how much longer each round trip was than the shortest, halved:
+  // the offset error queueing can cause. Unlike jitterUs() it doesn't grow
+  // when the clocks drift apart between samples.
+  uint32_t delayJitterUs() const {
+    if (count < 2) {
+      return 0;
+    }
+    uint32_t fastest = rtts[0];
+    for (int i = 1; i < count; i++) {
+      if (rtts[i] < fastest) {
+        fastest = rtts[i];
+      }
+    }
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+      double d = (rtts[i] - fastest) / 2.0;
+      sum += d * d;
+    }
+    return (uint32_t)sqrt(sum / (count - 1));
+  }
+
+  void reset() {
+    count = 0;
+    next = 0;
+  }
+
+private:
+  uint32_t score(int i) const {
+    return rtts[i] + (uint32_t)((uint64_t)(latest - takenAt[i]) * CLOCK_FILTER_AGE_PPM / 1000000);
+  }
+
+  int best() const {
+    int b = 0;
+    for (int i = 1; i < count; i++) {
+      if (score(i) < score(b)) {
+        b = i;
+      }
+    }
+    return b;
+  }
+
+  uint64_t latest = 0;
+};
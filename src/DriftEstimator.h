@@ -0,0 +1,69 @@
+#pragma once
+#include "BLEPlatform.h"
+
+// Learns how fast our clock runs against the master's from successive sync
+// frames. The master ticks every interval on its own clock, so the span
+// between two of its ticks, measured on ours, is ticks * interval * (1 + skew).
+// Measuring from an anchor frame makes the estimate sharpen as the span
+// grows. The anchor moves every DRIFT_REANCHOR_TICKS, carrying the
+// estimate so far as a prior.
+#define DRIFT_MAX_PPM 500          // larger implied skew means the master's tick grid moved
+#define DRIFT_REANCHOR_TICKS 600
+#define DRIFT_PRIOR_MAX_TICKS 6000 // cap so the estimate can still follow temperature
+
+struct DriftEstimator {
+  int32_t ppb = 0;   // our rate minus the master's, parts per billion
+
+  // tickUs: the master's tick `counter` on our clock
+  void update(uint32_t epoch, uint32_t counter, uint64_t tickUs, uint32_t intervalUs) {
+    if (!anchored || epoch != anchorEpoch) {
+      reset();
+      anchor(epoch, counter, tickUs);
+      return;
+    }
+    uint32_t ticks = counter - anchorCounter;
+    if (ticks == 0 || ticks > 0x7fffffffUL / intervalUs) {
+      return;
+    }
+    int64_t expected = (int64_t)ticks * intervalUs;
+    int64_t measured = (int64_t)(tickUs - anchorUs);
+    int64_t spanPpb = (measured - expected) * 1000000000LL / expected;
+    if (spanPpb > DRIFT_MAX_PPM * 1000LL || spanPpb < -DRIFT_MAX_PPM * 1000LL) {
+      anchor(epoch, counter, tickUs);
+      return;
+    }
+    ppb = (int32_t)((priorPpb * priorTicks + spanPpb * ticks) / (int64_t)(priorTicks + ticks));
+    if (ticks >= DRIFT_REANCHOR_TICKS) {
+      priorPpb = ppb;
+      priorTicks = priorTicks + ticks > DRIFT_PRIOR_MAX_TICKS ? DRIFT_PRIOR_MAX_TICKS : priorTicks + ticks;
+      anchor(epoch, counter, tickUs);
+    }
+  }
+
+  // The master's tick interval expressed on our clock
+  uint32_t intervalUs(uint32_t nominalUs) const {
+    return nominalUs + (int32_t)((int64_t)nominalUs * ppb / 1000000000LL);
+  }
+
+  void reset() {
+    ppb = 0;
+    priorPpb = 0;
+    priorTicks = 0;
+    anchored = false;
+  }
+
+private:
+  void anchor(uint32_t epoch, uint32_t counter, uint64_t tickUs) {
+    anchored = true;
+    anchorEpoch = epoch;
+    anchorCounter = counter;
+    anchorUs = tickUs;
+  }
+
+  bool anchored = false;
+  uint32_t anchorEpoch = 0;
+  uint32_t anchorCounter = 0;
+  uint64_t anchorUs = 0;
+  int64_t priorPpb = 0;
+  uint32_t priorTicks = 0;
+};
@@ -0,0 +1,75 @@
+#pragma once
+#include "BLEPlatform.h"
+#include <atomic>
+
+// Bounded multi-producer, single-consumer ring of fixed-size items. BLE
+// callbacks push from the host task (and, for a few, from whichever task
+// made the blocking call); loop() pops. Nothing blocks or allocates.
+//
+// Each cell carries a sequence number, so a producer claims a slot with one
+// compare-exchange and publishes it with a release store; the consumer
+// never sees a claimed cell before its item is written. N must be a power
+// of two.
+template <typename T, size_t N>
+class MpscQueue {
+public:
+  MpscQueue() {
+    for (size_t i = 0; i < N; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // False when full, or when fewer than reserve cells would be left free
+  // after this one. Producers that must not be dropped push with no
+  // reserve and so can still use the cells the others leave.
+  bool push(const T& item, size_t reserve = 0) {
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+      cell = &cells[pos & (N - 1)];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (reserve > 0 && pos - dequeuePos.load(std::memory_order_relaxed) + reserve >= N) {
+          return false;
+        }
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->item = item;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side only
+  bool pop(T& item) {
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    Cell* cell = &cells[pos & (N - 1)];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+      return false;
+    }
+    item = cell->item;
+    cell->sequence.store(pos + N, std::memory_order_release);
+    dequeuePos.store(pos + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+private:
+  static_assert((N & (N - 1)) == 0, "MpscQueue size must be a power of two");
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T item;
+  };
+
+  Cell cells[N];
+  std::atomic<size_t> enqueuePos{0};
+  std::atomic<size_t> dequeuePos{0};   // read by producers for the reserve check
+};
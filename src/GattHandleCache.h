@@ -0,0 +1,87 @@
+#pragma once
+#include "BLETransport.h"
+
+// Attribute handles discovered on a peer's sync service
+struct GattHandles {
+  uint16_t chars[CHAR_COUNT];
+  uint16_t counterCccd;   // BLE2902 descriptor on CHAR_COUNTER, 0 if absent
+};
+
+// Small LRU of GattHandles keyed by peer address, so a reconnect to a known
+// peer can skip service discovery. Fixed size, no heap. It holds one entry
+// per client slot, so a full master's reconnects don't evict each other.
+#define GATT_CACHE_SIZE BLESYNC_MAX_PEERS
+
+class GattHandleCache {
+public:
+  uint32_t hits = 0;
+  uint32_t misses = 0;
+  uint32_t stale = 0;   // hits that failed validation
+
+  bool lookup(const std::string& address, GattHandles& handles) {
+    Entry* e = find(address);
+    if (e == nullptr) {
+      misses++;
+      return false;
+    }
+    hits++;
+    e->lastUsed = ++useCounter;
+    handles = e->handles;
+    return true;
+  }
+
+  // As lookup(), without counting or refreshing the entry
+  bool peek(const std::string& address, GattHandles& handles) {
+    Entry* e = find(address);
+    if (e == nullptr) {
+      return false;
+    }
+    handles = e->handles;
+    return true;
+  }
+
+  void store(const std::string& address, const GattHandles& handles) {
+    Entry* e = find(address);
+    if (e == nullptr) {
+      e = &entries[0];
+      for (int i = 1; i < GATT_CACHE_SIZE; i++) {
+        if (!entries[i].valid || (e->valid && entries[i].lastUsed < e->lastUsed)) {
+          e = &entries[i];
+        }
+      }
+      strncpy(e->address, address.c_str(), sizeof(e->address) - 1);
+      e->address[sizeof(e->address) - 1] = '\0';
+      e->valid = true;
+    }
+    e->handles = handles;
+    e->lastUsed = ++useCounter;
+  }
+
+  void invalidate(const std::string& address) {
+    Entry* e = find(address);
+    if (e != nullptr) {
+      e->valid = false;
+      stale++;
+    }
+  }
+
+private:
+  struct Entry {
+    char address[18] = { 0 };
+    GattHandles handles;
+    uint32_t lastUsed = 0;
+    bool valid = false;
+  };
+
+  Entry* find(const std::string& address) {
+    for (int i = 0; i < GATT_CACHE_SIZE; i++) {
+      if (entries[i].valid && address == entries[i].address) {
+        return &entries[i];
+      }
+    }
+    return nullptr;
+  }
+
+  Entry entries[GATT_CACHE_SIZE];
+  uint32_t useCounter = 0;
+};
@@ -0,0 +1,69 @@
+#pragma once
+#include "BLEPlatform.h"
+
+// Fixed-bucket latency histogram. Bucket i counts samples below
+// HISTOGRAM_BOUNDS_US[i]; the last bucket collects everything larger.
+#define HISTOGRAM_BUCKETS 8
+static const unsigned long HISTOGRAM_BOUNDS_US[HISTOGRAM_BUCKETS - 1] = {
+  100, 1000, 10000, 100000, 1000000, 5000000, 10000000
+};
+
+struct Histogram {
+  uint32_t buckets[HISTOGRAM_BUCKETS] = { 0 };
+  uint32_t samples = 0;
+  unsigned long maxValue = 0;
+  unsigned long long total = 0;
+
+  void record(unsigned long us) {
+    int i = 0;
+    while (i < HISTOGRAM_BUCKETS - 1 && us >= HISTOGRAM_BOUNDS_US[i]) {
+      i++;
+    }
+    buckets[i]++;
+    samples++;
+    total += us;
+    if (us > maxValue) {
+      maxValue = us;
+    }
+  }
+
+  unsigned long mean() const {
+    return samples ? (unsigned long)(total / samples) : 0;
+  }
+
+  void merge(const Histogram& other) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      buckets[i] += other.buckets[i];
+    }
+    samples += other.samples;
+    total += other.total;
+    if (other.maxValue > maxValue) {
+      maxValue = other.maxValue;
+    }
+  }
+
+  void reset() {
+    *this = Histogram();
+  }
+
+  // One line: "<label>: <100us:N <1ms:N ... >=10s:N mean=Nus max=Nus",
+  // cut to fit n. Returns out.
+  const char* format(char* out, size_t n, const char* label) const {
+    static const char* names[HISTOGRAM_BUCKETS] = {
+      "<100us", "<1ms", "<10ms", "<100ms", "<1s", "<5s", "<10s", ">=10s"
+    };
+    size_t used = snprintf(out, n, "%s:", label);
+    for (int i = 0; i < HISTOGRAM_BUCKETS && used < n; i++) {
+      used += snprintf(out + used, n - used, " %s:%u", names[i], buckets[i]);
+    }
+    if (used < n) {
+      snprintf(out + used, n - used, " mean=%luus max=%luus", mean(), maxValue);
+    }
+    return out;
+  }
+
+  void print(const char* label) const {
+    char line[256];
+    Serial.printf("%s\n", format(line, sizeof(line), label));
+  }
+};
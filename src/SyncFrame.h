@@ -0,0 +1,111 @@
+#pragma once
+#include "BLEPlatform.h"
+
+// Sync frame the master writes to CHAR_SYNC. Little-endian, fixed layout:
+//
+//   0  u8   version      SYNC_FRAME_VERSION
+//   1  u8   length       total frame length, >= SYNC_FRAME_LEN
+//   2  u16  seq          per-master sequence number
+//   4  u32  counter      master counter
+//   8  u32  epoch        random id picked each time a node becomes master
+//  12  u32  phaseUs      master's last counter increment, see flags
+//  16  u8   flags        SYNC_FLAG_*
+//
+// Decoders accept their own version only, so versions must match exactly
+// across a fleet: a v1 client drops every v2 frame. The version changes
+// when an existing field moves or changes meaning, as v2 did (offset 12
+// went from ms to us). Within a version, new fields go on the end and
+// bump SYNC_FRAME_LEN, and decoders skip bytes past the fields they know.
+// 17 bytes fits one ATT write at the default 23-byte MTU.
+#define SYNC_FRAME_VERSION 2
+#define SYNC_FRAME_LEN 17
+
+// A write or notification carries the link's ATT MTU less the opcode and
+// handle. Anything longer than a sync frame (batched state, snapshots)
+// should size itself to the MTU the link settled on (BLELinkInfo) rather
+// than rely on a long write.
+#define ATT_HEADER_LEN 3
+
+static inline size_t attPayloadLen(uint16_t attMtu) {
+  return attMtu > ATT_HEADER_LEN ? attMtu - ATT_HEADER_LEN : 0;
+}
+
+// phaseUs is the master's last tick on the client's micros() clock, from a
+// measured offset. Without it, phaseUs is the time since that tick when
+// the frame was built, and the client can't correct for link delay.
+// Clock times travel as their low 32 bits; the client widens them against
+// its own 64-bit clock (see widenUs), which is exact within 35 minutes.
+// Carrying all 64 would push the frame past one ATT write.
+#define SYNC_FLAG_CLIENT_CLOCK 0x01
+
+struct SyncFrame {
+  uint16_t seq;
+  uint32_t counter;
+  uint32_t epoch;
+  uint32_t phaseUs;
+  uint8_t flags;
+};
+
+static inline void putU16(uint8_t* out, uint16_t v) {
+  out[0] = (uint8_t)v;
+  out[1] = (uint8_t)(v >> 8);
+}
+
+static inline void putU32(uint8_t* out, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = (uint8_t)(v >> (8 * i));
+  }
+}
+
+static inline void putU64(uint8_t* out, uint64_t v) {
+  putU32(out, (uint32_t)v);
+  putU32(out + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint16_t getU16(const uint8_t* in) {
+  return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static inline uint32_t getU32(const uint8_t* in) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t)in[i] << (8 * i);
+  }
+  return v;
+}
+
+static inline uint64_t getU64(const uint8_t* in) {
+  return getU32(in) | ((uint64_t)getU32(in + 4) << 32);
+}
+
+// The 64-bit time nearest reference whose low 32 bits are low
+static inline uint64_t widenUs(uint32_t low, uint64_t reference) {
+  return reference + (int64_t)(int32_t)(low - (uint32_t)reference);
+}
+
+// Writes SYNC_FRAME_LEN bytes to out
+static inline size_t encodeSyncFrame(const SyncFrame& frame, uint8_t* out) {
+  out[0] = SYNC_FRAME_VERSION;
+  out[1] = SYNC_FRAME_LEN;
+  putU16(out + 2, frame.seq);
+  putU32(out + 4, frame.counter);
+  putU32(out + 8, frame.epoch);
+  putU32(out + 12, frame.phaseUs);
+  out[16] = frame.flags;
+  return SYNC_FRAME_LEN;
+}
+
+// Rejects any other version and frames shorter than they claim to be or
+// than the fields this build reads
+static inline bool decodeSyncFrame(const uint8_t* data, size_t len, SyncFrame& frame) {
+  if (data == nullptr || len < SYNC_FRAME_LEN || data[0] != SYNC_FRAME_VERSION ||
+      data[1] < SYNC_FRAME_LEN || data[1] > len) {
+    return false;
+  }
+  frame.seq = getU16(data + 2);
+  frame.counter = getU32(data + 4);
+  frame.epoch = getU32(data + 8);
+  frame.phaseUs = getU32(data + 12);
+  frame.flags = data[16];
+  return true;
+}
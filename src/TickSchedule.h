@@ -0,0 +1,73 @@
+#pragma once
+#include "BLEPlatform.h"
+#include <atomic>
+
+// Where counter ticks fall on our micros() clock: anchorCounter took effect
+// at anchorUs and each later value intervalUs after the one before.
+struct TickSchedule {
+  uint32_t anchorCounter = 0;
+  uint64_t anchorUs = 0;
+  uint32_t intervalUs = 1;
+
+  // Counter in effect at us
+  uint32_t counterAt(uint64_t us) const {
+    int64_t elapsed = (int64_t)(us - anchorUs);
+    if (elapsed >= 0) {
+      return anchorCounter + (uint32_t)(elapsed / intervalUs);
+    }
+    return anchorCounter - (uint32_t)((-elapsed + intervalUs - 1) / intervalUs);
+  }
+
+  // When counter took effect
+  uint64_t tickUs(uint32_t counter) const {
+    return anchorUs + (int64_t)(int32_t)(counter - anchorCounter) * intervalUs;
+  }
+};
+
+// Hands the schedule from loop() to the tick timer callback without a
+// lock. publish() fills the slot current readers aren't using, then bumps
+// the generation; read() retries if the generation moved while it copied.
+// A reader never waits on the writer, which it may have preempted. The
+// 64-bit anchor is stored as two words: 64-bit atomics take a lock on the
+// ESP32, and the generation check already catches a torn pair.
+class TickScheduleBuffer {
+public:
+  // Single writer
+  void publish(const TickSchedule& schedule) {
+    uint32_t next = generation.load(std::memory_order_relaxed) + 1;
+    std::atomic_thread_fence(std::memory_order_release);
+    Slot& slot = slots[next & 1];
+    slot.anchorCounter.store(schedule.anchorCounter, std::memory_order_relaxed);
+    slot.anchorUsLow.store((uint32_t)schedule.anchorUs, std::memory_order_relaxed);
+    slot.anchorUsHigh.store((uint32_t)(schedule.anchorUs >> 32), std::memory_order_relaxed);
+    slot.intervalUs.store(schedule.intervalUs, std::memory_order_relaxed);
+    generation.store(next, std::memory_order_release);
+  }
+
+  TickSchedule read() const {
+    TickSchedule schedule;
+    for (;;) {
+      uint32_t seen = generation.load(std::memory_order_acquire);
+      const Slot& slot = slots[seen & 1];
+      schedule.anchorCounter = slot.anchorCounter.load(std::memory_order_relaxed);
+      schedule.anchorUs = slot.anchorUsLow.load(std::memory_order_relaxed) |
+                          (uint64_t)slot.anchorUsHigh.load(std::memory_order_relaxed) << 32;
+      schedule.intervalUs = slot.intervalUs.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (generation.load(std::memory_order_relaxed) == seen) {
+        return schedule;
+      }
+    }
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint32_t> anchorCounter{0};
+    std::atomic<uint32_t> anchorUsLow{0};
+    std::atomic<uint32_t> anchorUsHigh{0};
+    std::atomic<uint32_t> intervalUs{1};
+  };
+
+  Slot slots[2];
+  std::atomic<uint32_t> generation{0};
+};
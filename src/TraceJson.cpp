@@ -0,0 +1,326 @@
+#ifndef ARDUINO
+#include "TraceJson.h"
+#include "BLESync.h"
+#include <algorithm>
+#include <map>
+#include <math.h>
+#include <queue>
+#include <utility>
+
+namespace {
+
+struct BoardTrace {
+  std::string path;
+  std::string address;
+  uint32_t overwritten = 0;
+  std::vector<TraceRecord> records;
+  // Maps atUs onto the first board's clock:
+  // refAnchorUs + scale * (atUs - localAnchorUs)
+  bool aligned = false;
+  long long localAnchorUs = 0;
+  long long refAnchorUs = 0;
+  double scale = 1;
+
+  long long toReference(uint64_t atUs) const {
+    return refAnchorUs + llround(scale * (double)((long long)atUs - localAnchorUs));
+  }
+};
+
+// Chrome trace thread ids within a board's process
+enum {
+  TID_LIFECYCLE = 1,
+  TID_SYNC,
+  TID_TICKS
+};
+
+bool loadTrace(const std::string& path, BoardTrace& board, std::string& error) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    error = path + ": cannot open";
+    return false;
+  }
+  uint8_t header[TRACE_HEADER_LEN];
+  bool ok = fread(header, sizeof(header), 1, file) == 1 && memcmp(header, "BSTR", 4) == 0;
+  if (!ok || header[4] != TRACE_FILE_VERSION || header[5] != TRACE_RECORD_LEN) {
+    fclose(file);
+    error = path + ": not a version " + std::to_string(TRACE_FILE_VERSION) + " trace";
+    return false;
+  }
+  uint32_t count = getU32(header + 8);
+  board.path = path;
+  board.overwritten = getU32(header + 12);
+  board.address.assign((const char*)header + 16, strnlen((const char*)header + 16, 32));
+  board.records.resize(count);
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t encoded[TRACE_RECORD_LEN];
+    if (fread(encoded, sizeof(encoded), 1, file) != 1) {
+      fclose(file);
+      error = path + ": truncated";
+      return false;
+    }
+    decodeTraceRecord(encoded, board.records[i]);
+  }
+  fclose(file);
+  return true;
+}
+
+typedef std::pair<uint32_t, uint32_t> TickKey;   // epoch, counter
+
+std::map<TickKey, uint64_t> sharedTicks(const BoardTrace& board) {
+  std::map<TickKey, uint64_t> ticks;
+  for (size_t i = 0; i < board.records.size(); i++) {
+    const TraceRecord& record = board.records[i];
+    if (record.event == TRACE_TICK && record.c != 0) {
+      ticks[TickKey(record.c, record.d)] = record.atUs;
+    }
+  }
+  return ticks;
+}
+
+// Least-squares line through the ticks both boards recorded:
+// a's time ~= aAtUs + rate * (b's time - bAtUs). Fitting a rate as well as
+// an offset takes out crystal skew, which at tens of ppm would otherwise
+// smear a long trace by milliseconds.
+bool fitTicks(const std::map<TickKey, uint64_t>& a, const std::map<TickKey, uint64_t>& b,
+              long long& aAtUs, long long& bAtUs, double& rate) {
+  std::vector<std::pair<long long, long long> > pairs;   // (b, a)
+  for (std::map<TickKey, uint64_t>::const_iterator it = a.begin(); it != a.end(); ++it) {
+    std::map<TickKey, uint64_t>::const_iterator match = b.find(it->first);
+    if (match != b.end()) {
+      pairs.push_back(std::make_pair((long long)match->second, (long long)it->second));
+    }
+  }
+  if (pairs.empty()) {
+    return false;
+  }
+  // Work relative to the first pair; raw times can exceed a double's
+  // integer range once a clock has run for years of microseconds
+  long long b0 = pairs[0].first, a0 = pairs[0].second;
+  double meanB = 0, meanA = 0;
+  for (size_t i = 0; i < pairs.size(); i++) {
+    meanB += (double)(pairs[i].first - b0);
+    meanA += (double)(pairs[i].second - a0);
+  }
+  meanB /= pairs.size();
+  meanA /= pairs.size();
+  double covariance = 0, variance = 0;
+  for (size_t i = 0; i < pairs.size(); i++) {
+    double db = (double)(pairs[i].first - b0) - meanB;
+    covariance += db * ((double)(pairs[i].second - a0) - meanA);
+    variance += db * db;
+  }
+  rate = variance > 0 ? covariance / variance : 1;
+  bAtUs = b0 + llround(meanB);
+  aAtUs = a0 + llround(meanA);
+  return true;
+}
+
+// Puts boards sharing ticks with the first board, directly or through
+// others, on its clock. The rest keep their own, starting at 0.
+void alignBoards(std::vector<BoardTrace>& boards) {
+  std::vector<std::map<TickKey, uint64_t> > ticks;
+  for (size_t i = 0; i < boards.size(); i++) {
+    ticks.push_back(sharedTicks(boards[i]));
+  }
+  for (size_t i = 0; i < boards.size(); i++) {
+    if (!boards[i].records.empty()) {
+      boards[i].localAnchorUs = (long long)boards[i].records.front().atUs;
+    }
+  }
+  std::queue<size_t> pending;
+  boards[0].aligned = true;
+  boards[0].refAnchorUs = boards[0].localAnchorUs;
+  pending.push(0);
+  while (!pending.empty()) {
+    BoardTrace& from = boards[pending.front()];
+    const std::map<TickKey, uint64_t>& fromTicks = ticks[pending.front()];
+    pending.pop();
+    for (size_t i = 0; i < boards.size(); i++) {
+      BoardTrace& to = boards[i];
+      long long fromAtUs, toAtUs;
+      double rate;
+      if (!to.aligned && fitTicks(fromTicks, ticks[i], fromAtUs, toAtUs, rate)) {
+        to.aligned = true;
+        to.localAnchorUs = toAtUs;
+        to.refAnchorUs = from.toReference(fromAtUs);
+        to.scale = from.scale * rate;
+        pending.push(i);
+      }
+    }
+  }
+}
+
+std::string tagName(uint32_t tag) {
+  char text[12];
+  snprintf(text, sizeof(text), "%02x:%02x:%02x:%02x", (unsigned)(tag >> 24), (unsigned)((tag >> 16) & 0xff),
+           (unsigned)((tag >> 8) & 0xff), (unsigned)(tag & 0xff));
+  return text;
+}
+
+const char* stateNameOf(uint16_t state) {
+  return state < LINK_STATE_COUNT ? BLESyncNode::stateName((LinkState)state) : "UNKNOWN";
+}
+
+// Flow ids join a SYNC_SENT on the master to the SYNC_APPLIED of the same
+// frame on each client
+unsigned long long flowId(uint32_t epoch, uint16_t seq) {
+  return ((unsigned long long)epoch << 16) | seq;
+}
+
+class JsonEvents {
+public:
+  explicit JsonEvents(FILE* out) : out(out) {}
+
+  // Starts an event object; the caller adds fields and calls end()
+  void begin(const char* phase, const char* name, int pid, int tid, long long ts) {
+    fprintf(out, "%s\n{\"ph\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%lld",
+            first ? "" : ",", phase, name, pid, tid, ts);
+    first = false;
+  }
+  void field(const char* raw) { fprintf(out, ",%s", raw); }
+  void end() { fprintf(out, "}"); }
+
+  void metadata(const char* kind, int pid, int tid, const std::string& name) {
+    fprintf(out, "%s\n{\"ph\":\"M\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",", kind, pid, tid, name.c_str());
+    first = false;
+  }
+
+private:
+  FILE* out;
+  bool first = true;
+};
+
+void writeBoard(JsonEvents& events, const BoardTrace& board, int pid, long long originUs) {
+  std::string name = board.address.empty() ? board.path : board.address;
+  if (!board.aligned) {
+    name += " (own clock)";
+  }
+  if (board.overwritten > 0) {
+    name += " (" + std::to_string(board.overwritten) + " older records lost)";
+  }
+  events.metadata("process_name", pid, 0, name);
+  events.metadata("thread_name", pid, TID_LIFECYCLE, "lifecycle");
+  events.metadata("thread_name", pid, TID_SYNC, "sync");
+  events.metadata("thread_name", pid, TID_TICKS, "ticks");
+
+  char text[160];
+  long long endTs = board.records.empty() ? 0 : board.toReference(board.records.back().atUs) - originUs;
+  for (size_t i = 0; i < board.records.size(); i++) {
+    const TraceRecord& record = board.records[i];
+    long long ts = board.toReference(record.atUs) - originUs;
+    switch (record.event) {
+      case TRACE_STATE: {
+        long long untilTs = endTs;
+        for (size_t next = i + 1; next < board.records.size(); next++) {
+          if (board.records[next].event == TRACE_STATE) {
+            untilTs = board.toReference(board.records[next].atUs) - originUs;
+            break;
+          }
+        }
+        events.begin("X", stateNameOf(record.b), pid, TID_LIFECYCLE, ts);
+        snprintf(text, sizeof(text), "\"dur\":%lld,\"args\":{\"from\":\"%s\"}", untilTs - ts, stateNameOf(record.a));
+        events.field(text);
+        events.end();
+        break;
+      }
+      case TRACE_TICK:
+        events.begin("i", "tick", pid, TID_TICKS, ts);
+        snprintf(text, sizeof(text), "\"s\":\"t\",\"args\":{\"epoch\":%u,\"counter\":%u}", record.c, record.d);
+        events.field(text);
+        events.end();
+        break;
+      case TRACE_SYNC_SENT:
+        events.begin("X", "sync write", pid, TID_SYNC, ts);
+        snprintf(text, sizeof(text), "\"dur\":%u,\"args\":{\"slot\":%u,\"seq\":%u,\"epoch\":%u}",
+                 std::max(record.d, 1u), record.a, record.b, record.c);
+        events.field(text);
+        events.end();
+        events.begin("s", "sync", pid, TID_SYNC, ts);
+        snprintf(text, sizeof(text), "\"cat\":\"sync\",\"id\":%llu", flowId(record.c, record.b));
+        events.field(text);
+        events.end();
+        break;
+      case TRACE_SYNC_APPLIED:
+        // A 1 us slice rather than an instant, so the flow arrow has
+        // something to end on
+        events.begin("X", "sync applied", pid, TID_SYNC, ts);
+        snprintf(text, sizeof(text), "\"dur\":1,\"args\":{\"flags\":%u,\"seq\":%u,\"epoch\":%u,\"counter\":%u}",
+                 record.a, record.b, record.c, record.d);
+        events.field(text);
+        events.end();
+        events.begin("f", "sync", pid, TID_SYNC, ts);
+        snprintf(text, sizeof(text), "\"cat\":\"sync\",\"bp\":\"e\",\"id\":%llu", flowId(record.c, record.b));
+        events.field(text);
+        events.end();
+        break;
+      case TRACE_CLOCK_SAMPLE:
+        events.begin("X", "clock sample", pid, TID_SYNC, ts - (long long)record.d);
+        snprintf(text, sizeof(text), "\"dur\":%u,\"args\":{\"slot\":%u,\"offset_us\":%d,\"rtt_us\":%u}",
+                 record.d, record.a, (int32_t)record.c, record.d);
+        events.field(text);
+        events.end();
+        break;
+      case TRACE_LINK_UP:
+      case TRACE_LINK_DOWN:
+      case TRACE_SCAN_RESULT: {
+        const char* label = record.event == TRACE_LINK_UP ? "link up" :
+                            record.event == TRACE_LINK_DOWN ? "link down" : "scan result";
+        const char* key = record.event == TRACE_SCAN_RESULT ? "wins" : "outgoing";
+        events.begin("i", label, pid, TID_LIFECYCLE, ts);
+        snprintf(text, sizeof(text), "\"s\":\"t\",\"args\":{\"peer\":\"%s\",\"%s\":%u}",
+                 tagName(record.c).c_str(), key, record.a);
+        events.field(text);
+        events.end();
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
+
+}  // namespace
+
+bool writeChromeTrace(const std::vector<std::string>& inputs, const char* outputPath, std::string& error) {
+  if (inputs.empty()) {
+    error = "no trace files";
+    return false;
+  }
+  std::vector<BoardTrace> boards(inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (!loadTrace(inputs[i], boards[i], error)) {
+      return false;
+    }
+  }
+  alignBoards(boards);
+
+  // Timestamps start at the earliest record on the shared clock
+  bool haveOrigin = false;
+  long long originUs = 0;
+  for (size_t i = 0; i < boards.size(); i++) {
+    if (boards[i].aligned && !boards[i].records.empty()) {
+      long long firstUs = boards[i].toReference(boards[i].records.front().atUs);
+      originUs = haveOrigin ? std::min(originUs, firstUs) : firstUs;
+      haveOrigin = true;
+    }
+  }
+
+  FILE* out = fopen(outputPath, "w");
+  if (out == nullptr) {
+    error = std::string(outputPath) + ": cannot create";
+    return false;
+  }
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  JsonEvents events(out);
+  for (size_t i = 0; i < boards.size(); i++) {
+    writeBoard(events, boards[i], (int)i + 1, boards[i].aligned ? originUs : 0);
+  }
+  fprintf(out, "\n]}\n");
+  if (fclose(out) != 0) {
+    error = std::string(outputPath) + ": write failed";
+    return false;
+  }
+  return true;
+}
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+#ifndef ARDUINO
+#include <string>
+#include <vector>
+
+// Host-side decoder for BLESyncTrace files. Merges the files from several
+// boards into one Chrome trace (chrome://tracing or ui.perfetto.dev): one
+// process per board, lifecycle states as spans, ticks, clock samples and
+// links as markers, and an arrow from each sync write to the client that
+// applied it.
+//
+// Each board's trace is on its own clock. Boards that ticked on the same
+// master's grid (same epoch and counter) ticked at the same moment, so a
+// line fitted through those pairs of tick times maps one board's clock
+// onto another's, skew included; boards are chained this way from the
+// first file. A board that shares no ticks with the rest keeps its own
+// clock, starting at 0, and its process name says so.
+bool writeChromeTrace(const std::vector<std::string>& inputs, const char* outputPath, std::string& error);
+#endif
@@ -6,12 +6,17 @@ bool doRoleNegotiation = false;
 
 #include <Arduino.h>
 #include "BLESync.h"
+#include "BLESyncTask.h"
 
 
 void setup() {
   Serial.begin(115200);
   delay(1000);
   BLESync_setup();
+#ifdef BLESYNC_TASK
+  // Sync engine on its own task, next to the BLE stack; loop() is free for app work
+  BLESync_startTask();
+#endif
 }
 
 void loop() {
@@ -0,0 +1,940 @@
+#ifndef ARDUINO
+// Host-native simulator: runs BLESyncNode instances over the loopback
+// transport and reports connect-to-first-sync latency.
+//
+//   pio run -e native && .pio/build/native/program [--nodes N] [--trials N]
+//       [--seconds N] [--seed N] [--backoff-min MS] [--backoff-max MS]
+//       [--notify 0|1] [--drop-every S] [--ntp 0|1] [--att-jitter US]
+//       [--skew-ppm N] [--drift 0|1] [--sync-interval S] [--adaptive 0|1]
+//       [--driver loop|task|threads] [--app-work-ms MS] [--timer 0|1]
+//       [--rollover S] [--log async|direct] [--serial-baud N]
+//       [--trace-dir DIR] [--conn-events 0|1] [--link-profiles 0|1]
+//       [--write-nr 0|1] [--direct-reconnect 0|1] [--flood-events N]
+//       [--reboot-master S] [--verbose]
+//   .pio/build/native/program --trace-json OUT FILE...
+//   .pio/build/native/program --throughput [--seconds N]
+//
+// --skew-ppm gives each node a crystal error drawn from [-N, N] ppm.
+// --rollover starts every node's clock S seconds short of 2^32 ms, where a
+// 32-bit millis() rolls over after 49.7 days; a 32-bit micros() wraps at
+// the same instant. tick_alignment_after_rollover covers the samples taken
+// once both nodes were past it.
+// --log direct prints each log line where it is logged, as the sketch
+// used to; async (the default) queues it for BLESyncLog::drain(), which
+// runs here between medium steps as the drain task would. --serial-baud
+// makes a node wait out its own Serial writes at that rate, muted or not,
+// so loop_latency shows what inline logging costs. Build with
+// -DBLESYNC_LOG_LEVEL=N to compare levels.
+// --driver picks what calls BLESyncNode::loop():
+//   loop     the sketch's loop(), which also spends --app-work-ms on
+//            application work after each call
+//   task     a model of BLESyncTask: loop() runs only when woken by an
+//            event or when idleBudgetUs() runs out, in 1 ms RTOS ticks,
+//            with application work on the other core
+//   threads  a real BLESyncTask thread per node; the medium runs in real
+//            time, so --seconds is wall time. Blocking transport calls
+//            return at once here, so latencies mean little; it exercises
+//            the threading.
+// --trace-dir saves each node's event trace from the last trial as
+// DIR/node<i>.bin, in the format BLESyncTrace::save() writes on hardware.
+// --trace-json merges trace files, from here or pulled off boards, into
+// one Chrome trace at OUT and exits.
+// reconnect_heap (with --drop-every) tracks live C++ heap from the first
+// link drop on: growth is what is still allocated after the last drop,
+// high_water the most it reached. A reconnect soak is e.g.
+//   --nodes 2 --trials 1 --drop-every 5 --seconds 50000   (10k drops)
+// Counting needs glibc's malloc_usable_size(); elsewhere it is skipped.
+// --conn-events makes ATT traffic and notifications wait for connection
+// events spaced by each link's profile (BLE_LINK_PROFILES) and reports,
+// per profile a message was sent on, notify_to_apply (a notify() to the
+// peer's callback, where the value is timestamped and acted on) and
+// sync_write_to_apply (a sync frame write to the client applying it).
+// --link-profiles 0 keeps every link on the sync profile.
+// --write-nr 0 sends every sync frame as a write request instead of a
+// write command; sync_write_block is how long the master's loop() spent
+// in each frame write either way.
+// reconnect_path splits the time from losing a role (entering BACKOFF, or
+// RECONNECTING for a master going straight back to a lost client) to
+// holding one again by the lifecycle states it went through.
+// --direct-reconnect 0 sends both sides through BACKOFF and a scan
+// instead; gatt_cache peer_record_writes counts last-peer record changes,
+// which are NVS writes on hardware.
+// --flood-events (with --drop-every) queues N notifications from an
+// unknown address and N repeats of each client's counter on every node
+// just before each drop, so the disconnects arrive behind a full queue.
+// After each loop() the node must have no peer whose link is gone and no
+// CLIENT state without a master; peer_state_errors counts the times it
+// had, and the run exits 1 if there were any.
+// --reboot-master restarts the master holding the most clients S seconds
+// into each trial. It is down for REBOOT_DOWN_MS, long enough for its
+// clients to settle under a new master. It keeps its last-peer record, as
+// NVS would; where a former client is master by then, the record names
+// that one, the case a blind reconnect would turn into two masters.
+// reboot reports, of the trials where that happened, how often the new
+// master kept its role throughout and the rebooted node ended as a client.
+// clients_synced_per_trial then allows one more client for each of them.
+// --throughput skips the trials and measures one link over the connection
+// event model instead: a client writing full-MTU values back to back,
+// then a server notifying them with up to THROUGHPUT_NOTIFY_QUEUE in
+// flight, for --seconds each. It reports bytes/s of ATT payload per link
+// profile, at the spec's default MTU and data length and at what connect()
+// negotiates, on 1M and 2M.
+
+#include "BLESync.h"
+#include "BLESyncTask.h"
+#include "BLETransportLoopback.h"
+#include "TraceJson.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#define SIM_HEAP_WATCH 1
+#endif
+
+NativeSerial Serial;
+
+#define ROLLOVER_US (4294967296LL * 1000)   // 2^32 ms, also 1000 micros() wraps
+
+#ifdef SIM_HEAP_WATCH
+// Every C++ allocation in the process passes through here for
+// reconnect_heap
+static std::atomic<long long> heapLiveBytes{0};
+static std::atomic<long long> heapPeakBytes{0};
+static std::atomic<unsigned long long> heapAllocations{0};
+
+void* operator new(size_t size) {
+  void* p = malloc(size > 0 ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  long long live = heapLiveBytes += (long long)malloc_usable_size(p);
+  heapAllocations++;
+  long long peak = heapPeakBytes.load(std::memory_order_relaxed);
+  while (live > peak && !heapPeakBytes.compare_exchange_weak(peak, live)) {
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  if (p != nullptr) {
+    heapLiveBytes -= (long long)malloc_usable_size(p);
+    free(p);
+  }
+}
+
+void operator delete(void* p, size_t) noexcept {
+  operator delete(p);
+}
+#endif
+
+struct SimResult;
+
+struct SimNode {
+  BLETransportLoopback transport;
+  BLESyncNode node;
+  bool started = false;
+  SimResult* result = nullptr;
+  bool reconnecting = false;
+  unsigned long long pathUs[LINK_STATE_COUNT] = {};
+  bool woken = false;            // --driver task
+  long long wakeAtUs = 0;
+  BLESyncTask task;              // --driver threads
+
+  SimNode(LoopbackMedium& medium, const std::string& address, unsigned long bootTime)
+    : transport(medium, address, bootTime), node(transport), task(node) {}
+};
+
+enum SimDriverMode {
+  DRIVE_LOOP,
+  DRIVE_TASK,
+  DRIVE_THREADS
+};
+
+struct SimDriver {
+  SimDriverMode mode = DRIVE_LOOP;
+  unsigned long appWorkMs = 0;
+};
+
+#define THROUGHPUT_NOTIFY_QUEUE 8   // notifications a controller buffers for a link
+
+// Counts ATT payload bytes for --throughput
+struct ThroughputSink : public BLETransportListener {
+  unsigned long long bytes = 0;
+
+  void onServerConnect(const std::string& address) override {}
+  void onServerDisconnect(const std::string& address) override {}
+  void onClientConnect(const std::string& address) override {}
+  void onClientDisconnect(const std::string& address) override {}
+  void onScanResult(const std::string& address, const uint8_t* token, size_t tokenLen) override {}
+  void onScanComplete(int deviceCount) override {}
+  void onWrite(BLESyncChar id, const uint8_t* data, size_t len) override { bytes += len; }
+  void onRead(BLESyncChar id) override {}
+  void onNotify(const std::string& address, BLESyncChar id, const uint8_t* data, size_t len) override { bytes += len; }
+};
+
+static void measureThroughput(const LoopbackLinkModel& model, BLELinkProfile profile, unsigned long durationMs,
+                              BLELinkInfo& info, double& writeBps, double& notifyBps) {
+  LoopbackMedium medium;
+  medium.link = model;
+  medium.link.connectionEvents = true;
+  BLETransportLoopback server(medium, "AA:BB:CC:00:00:01", 0);
+  BLETransportLoopback client(medium, "AA:BB:CC:00:00:02", 0);
+  ThroughputSink serverSink, clientSink;
+  server.setListener(&serverSink);
+  client.setListener(&clientSink);
+  server.init("server");
+  client.init("client");
+  std::string address = server.localAddress();
+  writeBps = notifyBps = 0;
+  if (!client.connect(address, 0) || !client.discover(address) || !client.subscribe(address, CHAR_COUNTER)) {
+    return;
+  }
+  client.setLinkProfile(address, profile);
+  client.linkInfo(address, info);
+  // Long enough for the slowest profile update to take effect
+  for (int i = 0; i < 3000 || !client.ready(); i++) {
+    medium.advance(1);
+  }
+  std::string payload(attPayloadLen(info.attMtu), 'x');
+
+  unsigned long start = medium.now();
+  while (medium.now() - start < durationMs) {
+    if (client.ready()) {
+      client.write(address, CHAR_SYNC, (const uint8_t*)payload.data(), payload.length());
+    }
+    medium.advance(1);
+  }
+  // The last write counts once its response is back
+  while (!client.ready()) {
+    medium.advance(1);
+  }
+  writeBps = serverSink.bytes * 1000.0 / (medium.now() - start);
+
+  server.setLocalValue(CHAR_COUNTER, (const uint8_t*)payload.data(), payload.length());
+  start = medium.now();
+  while (medium.now() - start < durationMs) {
+    while (client.notificationsInFlight() < THROUGHPUT_NOTIFY_QUEUE) {
+      server.notify(CHAR_COUNTER);
+    }
+    medium.advance(1);
+  }
+  notifyBps = clientSink.bytes * 1000.0 / durationMs;
+}
+
+static void runThroughput(unsigned long seconds) {
+  struct {
+    uint16_t attMtu;
+    uint16_t llOctets;
+    BLEPhy phy;
+  } links[] = {
+    { BLE_ATT_MTU_DEFAULT, BLE_LL_OCTETS_DEFAULT, BLE_PHY_1M },
+    { BLESYNC_ATT_MTU, BLE_LL_OCTETS_DEFAULT, BLE_PHY_1M },
+    { BLESYNC_ATT_MTU, BLESYNC_LL_OCTETS, BLE_PHY_1M },
+    { BLESYNC_ATT_MTU, BLESYNC_LL_OCTETS, BLE_PHY_2M },
+  };
+  printf("throughput sim_seconds=%lu (ATT payload bytes/s)\n", seconds);
+  for (int p = 0; p < LINK_PROFILE_COUNT; p++) {
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+      LoopbackLinkModel model;
+      model.attMtu = links[i].attMtu;
+      model.llOctets = links[i].llOctets;
+      model.phy = links[i].phy;
+      BLELinkInfo info;
+      double writeBps, notifyBps;
+      measureThroughput(model, (BLELinkProfile)p, seconds * 1000, info, writeBps, notifyBps);
+      printf("throughput_%s mtu=%u octets=%u phy=%s write=%.0f notify=%.0f\n", BLE_LINK_PROFILES[p].name,
+             info.attMtu, info.txOctets, info.phy == BLE_PHY_2M ? "2M" : "1M", writeBps, notifyBps);
+    }
+  }
+}
+
+// Serial.writeHook for --serial-baud: the node in loop() is the writer
+static unsigned long serialBaud = 0;
+
+static void onSerialWrite(void* context, size_t bytes) {
+  if (context != nullptr) {
+    ((SimNode*)context)->transport.blockUs(bytes * 10 * 1000000ULL / serialBaud);
+  }
+}
+
+static void onWake(void* context) {
+  ((SimNode*)context)->woken = true;
+}
+
+struct SimResult {
+  bool synced = false;
+  unsigned long connectToSyncMs = 0;
+  unsigned long long loopCalls = 0;
+  unsigned long long logLines = 0;
+  Histogram loopLatency;
+  Histogram connectBackoff;
+  Histogram resyncLatency;
+  Histogram syncFanout;
+  Histogram syncWrite;
+  Histogram tickAlignment;
+  Histogram rolloverAlignment;
+  Histogram offsetError;
+  Histogram syncCorrection;
+  Histogram tickLateness;
+  Histogram tickNotifyDelay;
+  unsigned long long syncRadioUs = 0;
+  unsigned long long fixedRadioUs = 0;   // same per-sync cost at the fixed interval
+  uint32_t syncTransactions = 0;
+  double driftErrorPpbSum = 0;   // |learned - true| relative skew, per client
+  double driftErrorPpbMax = 0;
+  int driftSamples = 0;
+  uint32_t cacheHits = 0;
+  uint32_t cacheMisses = 0;
+  uint32_t peerRecordWrites = 0;
+  uint32_t eventsDropped = 0;
+  uint32_t peerStateErrors = 0;   // --flood-events
+  // --reboot-master: a former client was master when the node came back,
+  // whether it stayed master and whether the rebooted node joined it
+  bool rebootCase = false;
+  bool rebootMasterKept = false;
+  bool rebootJoined = false;
+  BLESyncMetrics metrics;
+  uint32_t metricsValues = 0;       // nodes whose CHAR_METRICS value decodes
+  int clientsSynced = 0;   // nodes that applied a sync from some master
+  int clientSlots = 0;     // nodes that could have: all but the master, plus one if a reboot moved the role
+  uint32_t peakPeers = 0;
+  unsigned long long stateTimeUs[LINK_STATE_COUNT] = {};
+  uint32_t stateEntries[LINK_STATE_COUNT] = {};
+  unsigned long long reconnectUs[LINK_STATE_COUNT] = {};
+  Histogram reconnectLatency;
+  Histogram notifyLatency[LINK_PROFILE_COUNT];
+  Histogram writeLatency[LINK_PROFILE_COUNT];
+  // Live heap from the first link drop on
+  uint32_t drops = 0;
+  long long heapBaselineBytes = 0;
+  long long heapLastBytes = 0;
+  long long heapPeakBytes = 0;
+  unsigned long long heapBaselineAllocs = 0;
+  unsigned long long heapAllocs = 0;
+};
+
+// A burst of traffic landing before the node's next loop()
+static void floodEvents(std::vector<SimNode*>& nodes, unsigned count) {
+  for (size_t i = 0; i < nodes.size(); i++) {
+    BLESyncNode& node = nodes[i]->node;
+    if (!nodes[i]->started) {
+      continue;
+    }
+    uint32_t counter = node.counter();
+    for (unsigned n = 0; n < count; n++) {
+      node.onNotify("fe:ed:00:00:00:00", CHAR_COUNTER, (const uint8_t*)&counter, sizeof(counter));
+      for (int p = 0; p < BLESYNC_MAX_PEERS; p++) {
+        const SyncPeer& peer = node.peerSlot(p);
+        if (!peer.address.empty()) {
+          node.onNotify(peer.address, CHAR_COUNTER, (const uint8_t*)&counter, sizeof(counter));
+        }
+      }
+    }
+  }
+}
+
+// Once loop() has handled every event so far, the peer table and role
+// match the node's links
+static bool peerStateConsistent(SimNode* sim) {
+  for (int p = 0; p < BLESYNC_MAX_PEERS; p++) {
+    const SyncPeer& peer = sim->node.peerSlot(p);
+    if (!peer.address.empty() && !sim->transport.isConnected(peer.address)) {
+      return false;
+    }
+  }
+  return sim->node.state() != LINK_CLIENT || sim->transport.inboundLinks() > 0;
+}
+
+static void sampleHeap(SimResult& result) {
+#ifdef SIM_HEAP_WATCH
+  long long live = heapLiveBytes.load();
+  if (result.drops++ == 0) {
+    result.heapBaselineBytes = live;
+    result.heapBaselineAllocs = heapAllocations.load();
+    heapPeakBytes.store(live);
+  }
+  result.heapLastBytes = live;
+  result.heapPeakBytes = heapPeakBytes.load();
+  result.heapAllocs = heapAllocations.load() - result.heapBaselineAllocs;
+#else
+  result.drops++;
+#endif
+}
+
+static void onStateChange(void* context, LinkState from, LinkState to, uint64_t dwellUs) {
+  SimNode* sim = (SimNode*)context;
+  if ((to == LINK_BACKOFF || to == LINK_RECONNECTING) && !sim->reconnecting) {
+    sim->reconnecting = true;
+    for (int s = 0; s < LINK_STATE_COUNT; s++) sim->pathUs[s] = 0;
+    return;
+  }
+  if (!sim->reconnecting) {
+    return;
+  }
+  sim->pathUs[from] += dwellUs;
+  if (to == LINK_MASTER || to == LINK_CLIENT) {
+    unsigned long long total = 0;
+    for (int s = 0; s < LINK_STATE_COUNT; s++) {
+      sim->result->reconnectUs[s] += sim->pathUs[s];
+      total += sim->pathUs[s];
+    }
+    sim->result->reconnectLatency.record((unsigned long)total);
+    sim->reconnecting = false;
+  }
+}
+
+static SimNode* findNode(const std::vector<SimNode*>& nodes, const std::string& address) {
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (nodes[i]->transport.localAddress() == address) {
+      return nodes[i];
+    }
+  }
+  return nullptr;
+}
+
+#define REBOOT_DOWN_MS 8000   // restart to setup(), with time for the clients to regroup
+
+// --reboot-master: the node's former clients, and the one of them that was
+// master when it came back
+struct SimReboot {
+  SimNode* node = nullptr;
+  std::vector<std::string> formerClients;
+  SimNode* establishedMaster = nullptr;
+};
+
+// Drops the master's links as a reset would and swaps in a fresh node at
+// its address that boots REBOOT_DOWN_MS later
+static void rebootMaster(std::vector<SimNode*>& nodes, LoopbackMedium& medium, SimReboot& reboot,
+                         long long clockStartUs) {
+  size_t index = nodes.size();
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (nodes[i]->node.master() && (index == nodes.size() || nodes[i]->node.peers() > nodes[index]->node.peers())) {
+      index = i;
+    }
+  }
+  if (index == nodes.size()) {
+    return;
+  }
+  SimNode* old = nodes[index];
+  for (int p = 0; p < BLESYNC_MAX_PEERS; p++) {
+    if (!old->node.peerSlot(p).address.empty()) {
+      reboot.formerClients.push_back(old->node.peerSlot(p).address);
+    }
+  }
+  std::string record;
+  old->transport.lastPeer(record);
+  old->transport.disconnectAll();
+  SimNode* sim = new SimNode(medium, old->transport.localAddress(), medium.now() + REBOOT_DOWN_MS);
+  sim->transport.setClockSkewPpm(old->transport.clockSkewPpm());
+  sim->transport.setClockStartUs(clockStartUs);
+  sim->transport.rememberPeer(record);
+  sim->result = old->result;
+  sim->node.setStateHook(onStateChange, sim);
+  nodes[index] = sim;
+  reboot.node = sim;
+  delete old;
+}
+
+// Just before the rebooted node's setup(): point its record at a former
+// client that has become master, if one has
+static void bootRebooted(const std::vector<SimNode*>& nodes, SimReboot& reboot) {
+  for (size_t i = 0; i < reboot.formerClients.size(); i++) {
+    SimNode* client = findNode(nodes, reboot.formerClients[i]);
+    if (client != nullptr && client->node.master()) {
+      reboot.node->transport.rememberPeer(reboot.formerClients[i]);
+      reboot.establishedMaster = client;
+      return;
+    }
+  }
+}
+
+// Compares each synced client's tick with its master's on the medium clock,
+// and the master's offset estimate with the true clock difference
+static void sampleAlignment(const std::vector<SimNode*>& nodes, long long mediumUs, SimResult& result) {
+  for (size_t i = 0; i < nodes.size(); i++) {
+    SimNode* master = nodes[i];
+    if (!master->node.master()) {
+      continue;
+    }
+    for (int p = 0; p < BLESYNC_MAX_PEERS; p++) {
+      const SyncPeer& peer = master->node.peerSlot(p);
+      if (peer.address.empty() || peer.syncsSent == 0) {
+        continue;
+      }
+      SimNode* client = findNode(nodes, peer.address);
+      if (client == nullptr || client->node.counter() != master->node.counter()) {
+        continue;   // sampled between the two ticks
+      }
+      long long masterTick = master->transport.mediumTimeOf((long long)master->node.lastTickUs());
+      long long clientTick = client->transport.mediumTimeOf((long long)client->node.lastTickUs());
+      result.tickAlignment.record((unsigned long)llabs(clientTick - masterTick));
+      if (master->transport.localTimeAt(mediumUs) >= ROLLOVER_US &&
+          client->transport.localTimeAt(mediumUs) >= ROLLOVER_US) {
+        result.rolloverAlignment.record((unsigned long)llabs(clientTick - masterTick));
+      }
+      if (peer.clock.valid()) {
+        long long trueOffset = client->transport.localTimeAt(mediumUs) - master->transport.localTimeAt(mediumUs);
+        result.offsetError.record((unsigned long)llabs(peer.clock.offsetUs() - trueOffset));
+      }
+    }
+  }
+}
+
+static SimResult runTrial(int nodeCount, unsigned long durationMs, const BLESyncConfig& config,
+                          bool pollOnly, unsigned long dropEveryMs, unsigned long attJitterUs,
+                          double skewPpm, long long clockStartUs, const SimDriver& driver,
+                          const std::string& traceDir, bool connectionEvents, unsigned floodCount,
+                          unsigned long rebootAtMs) {
+  LoopbackMedium medium;
+  medium.link.cccdWritable = !pollOnly;
+  medium.link.attJitterUs = attJitterUs;
+  medium.link.connectionEvents = connectionEvents;
+  std::vector<SimNode*> nodes;
+  for (int i = 0; i < nodeCount; i++) {
+    char address[18];
+    snprintf(address, sizeof(address), "24:0a:c4:00:%02x:%02x", (i >> 8) & 0xff, i & 0xff);
+    nodes.push_back(new SimNode(medium, address, random(0, 2000)));
+    nodes.back()->transport.setClockSkewPpm(skewPpm * (2.0 * rand() / RAND_MAX - 1));
+    nodes.back()->transport.setClockStartUs(clockStartUs);
+  }
+
+  SimResult result;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    nodes[i]->result = &result;
+    nodes[i]->node.setStateHook(onStateChange, nodes[i]);
+  }
+  SimReboot reboot;
+  // Node threads hold this around loop(); the medium steps while holding it
+  std::mutex lock;
+  auto wallStart = std::chrono::steady_clock::now();
+  while (medium.now() < durationMs) {
+    std::unique_lock<std::mutex> guard(lock);
+    for (size_t i = 0; i < nodes.size(); i++) {
+      SimNode* sim = nodes[i];
+      if (!sim->transport.ready()) {
+        continue;
+      }
+      if (!sim->started) {
+        char name[32];
+        snprintf(name, sizeof(name), "SimCounter_%u", (unsigned)i);
+        if (sim == reboot.node) {
+          bootRebooted(nodes, reboot);
+          result.rebootCase = result.rebootMasterKept = reboot.establishedMaster != nullptr;
+        }
+        sim->node.configure(config);
+        sim->node.setup(name);
+        sim->started = true;
+        if (driver.mode == DRIVE_TASK) {
+          sim->node.setWakeHook(onWake, sim);
+        } else if (driver.mode == DRIVE_THREADS) {
+          sim->task.setLock(&lock);
+          sim->task.start();
+        }
+      }
+      if (driver.mode == DRIVE_THREADS ||
+          (driver.mode == DRIVE_TASK && !sim->woken && (long long)medium.now() * 1000 < sim->wakeAtUs)) {
+        continue;
+      }
+      sim->woken = false;
+      Serial.writeHookContext = sim;
+      sim->node.loop();
+      Serial.writeHookContext = nullptr;
+      result.loopCalls++;
+      if (floodCount > 0 && !peerStateConsistent(sim)) {
+        result.peerStateErrors++;
+      }
+      if (driver.mode == DRIVE_TASK) {
+        uint32_t sleepUs = (sim->node.idleBudgetUs() + 999) / 1000 * 1000;
+        sim->wakeAtUs = sim->transport.mediumTimeOf((long long)sim->transport.micros() + sleepUs);
+      } else if (driver.appWorkMs > 0) {
+        sim->transport.delay(driver.appWorkMs);
+      }
+    }
+    medium.advance(1);
+    result.logLines += BLESyncLog::drain();
+    if (medium.now() % 1000 == 500) {
+      sampleAlignment(nodes, medium.now() * 1000LL, result);
+    }
+    if (dropEveryMs > 0 && medium.now() % dropEveryMs == 0) {
+      floodEvents(nodes, floodCount);
+      medium.dropLinks();
+      sampleHeap(result);
+    }
+    if (rebootAtMs > 0 && medium.now() == rebootAtMs) {
+      rebootMaster(nodes, medium, reboot, clockStartUs);
+    }
+    if (reboot.establishedMaster != nullptr && !reboot.establishedMaster->node.master()) {
+      result.rebootMasterKept = false;
+    }
+    if (driver.mode == DRIVE_THREADS) {
+      guard.unlock();
+      std::this_thread::sleep_until(wallStart + std::chrono::milliseconds(medium.now()));
+    }
+  }
+  for (size_t i = 0; i < nodes.size(); i++) {
+    nodes[i]->task.stop();
+    result.loopCalls += nodes[i]->task.loops();
+  }
+  for (int p = 0; p < BLESYNC_MAX_PEERS && reboot.establishedMaster != nullptr; p++) {
+    if (reboot.establishedMaster->node.peerSlot(p).address == reboot.node->transport.localAddress()) {
+      result.rebootJoined = reboot.node->node.state() == LINK_CLIENT;
+    }
+  }
+
+  for (size_t i = 0; i < nodes.size(); i++) {
+    SimNode* master = nodes[i];
+    if (!master->node.master()) {
+      continue;
+    }
+    for (int p = 0; p < BLESYNC_MAX_PEERS; p++) {
+      const SyncPeer& peer = master->node.peerSlot(p);
+      SimNode* client = peer.address.empty() ? nullptr : findNode(nodes, peer.address);
+      if (client == nullptr || peer.syncsSent < 2) {
+        continue;
+      }
+      double trueRatio = (1 + client->transport.clockSkewPpm() / 1e6) / (1 + master->transport.clockSkewPpm() / 1e6);
+      double err = fabs(client->node.driftPpb() - (trueRatio - 1) * 1e9);
+      result.driftErrorPpbSum += err;
+      result.driftErrorPpbMax = std::max(result.driftErrorPpbMax, err);
+      result.driftSamples++;
+    }
+  }
+
+  // Latency is measured on the medium's clock from the first link to the
+  // first sync applied by any node
+  unsigned long firstConnect = 0, firstSync = 0;
+  bool anyConnect = false;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const BLESyncStats& stats = nodes[i]->node.stats();
+    result.loopLatency.merge(stats.loopLatency);
+    result.connectBackoff.merge(stats.connectBackoff);
+    result.resyncLatency.merge(stats.resyncLatency);
+    result.syncFanout.merge(stats.syncFanout);
+    result.syncWrite.merge(stats.syncWrite);
+    result.syncCorrection.merge(stats.syncCorrection);
+    result.tickLateness.merge(stats.tickLateness);
+    result.tickNotifyDelay.merge(stats.tickNotifyDelay);
+    result.syncRadioUs += stats.syncRadioUs;
+    result.syncTransactions += stats.syncTransactions;
+    if (stats.syncTransactions > 0) {
+      result.fixedRadioUs += stats.syncRadioUs / stats.syncTransactions * stats.fixedIntervalSyncs;
+    }
+    result.peakPeers = std::max(result.peakPeers, stats.peakPeers);
+    for (int s = 0; s < LINK_STATE_COUNT; s++) {
+      result.stateTimeUs[s] += stats.stateTimeUs[s];
+      result.stateEntries[s] += stats.stateEntries[s];
+    }
+    if (stats.syncsApplied > 0) result.clientsSynced++;
+    result.clientSlots = (int)nodes.size() - 1 + (reboot.establishedMaster != nullptr ? 1 : 0);
+    result.cacheHits += nodes[i]->transport.handleCache().hits;
+    result.cacheMisses += nodes[i]->transport.handleCache().misses;
+    result.peerRecordWrites += nodes[i]->transport.peerRecordWriteCount();
+    result.eventsDropped += stats.eventsDropped;
+    result.metrics.merge(nodes[i]->node.metrics());
+    const std::string& value = nodes[i]->transport.localValue(CHAR_METRICS);
+    if (value.length() == METRICS_LEN && (uint8_t)value[0] == METRICS_VERSION &&
+        (uint8_t)value[1] == METRIC_COUNTER_COUNT && (uint8_t)value[2] == METRIC_HISTOGRAM_COUNT) {
+      result.metricsValues++;
+    }
+    const BLETransportLoopback& transport = nodes[i]->transport;
+    if (stats.connects > 0) {
+      unsigned long t = transport.mediumTimeOf(stats.firstConnectTime * 1000) / 1000;
+      if (!anyConnect || t < firstConnect) firstConnect = t;
+      anyConnect = true;
+    }
+    if (stats.syncsApplied > 0) {
+      unsigned long t = transport.mediumTimeOf(stats.firstSyncTime * 1000) / 1000;
+      if (!result.synced || t < firstSync) firstSync = t;
+      result.synced = true;
+    }
+  }
+  if (result.synced && anyConnect) {
+    result.connectToSyncMs = firstSync - std::min(firstConnect, firstSync);
+  }
+  for (int p = 0; p < LINK_PROFILE_COUNT; p++) {
+    result.notifyLatency[p].merge(medium.notifyLatency[p]);
+    result.writeLatency[p].merge(medium.writeLatency[p]);
+  }
+  for (size_t i = 0; i < nodes.size() && !traceDir.empty(); i++) {
+    std::string path = traceDir + "/node" + std::to_string(i) + ".bin";
+    if (!nodes[i]->node.trace().save(path.c_str(), nodes[i]->transport.localAddress())) {
+      fprintf(stderr, "%s: cannot write trace\n", path.c_str());
+    }
+  }
+  for (size_t i = 0; i < nodes.size(); i++) {
+    delete nodes[i];
+  }
+  return result;
+}
+
+int main(int argc, char** argv) {
+  int nodeCount = 2;
+  int trials = 200;
+  unsigned long seconds = 60;
+  unsigned seed = 1;
+  bool verbose = false;
+  BLESyncConfig config;
+  bool pollOnly = false;
+  unsigned long dropEverySeconds = 0;
+  unsigned long attJitterUs = 0;
+  double skewPpm = 0;
+  unsigned long rolloverSeconds = 0;
+  SimDriver driver;
+  std::string traceDir;
+  bool connectionEvents = false;
+  bool throughput = false;
+  unsigned floodCount = 0;
+  unsigned long rebootSeconds = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--verbose") {
+      verbose = true;
+      continue;
+    }
+    if (arg == "--throughput") {
+      throughput = true;
+      continue;
+    }
+    if (arg == "--trace-json" && i + 2 < argc) {
+      std::vector<std::string> inputs(argv + i + 2, argv + argc);
+      std::string error;
+      if (!writeChromeTrace(inputs, argv[i + 1], error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+      }
+      return 0;
+    }
+    if (i + 1 >= argc) break;
+    if (arg == "--nodes") nodeCount = atoi(argv[++i]);
+    else if (arg == "--trials") trials = atoi(argv[++i]);
+    else if (arg == "--seconds") seconds = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--seed") seed = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--backoff-min") config.connectBackoffMinMs = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--drop-every") dropEverySeconds = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--notify") pollOnly = atoi(argv[++i]) == 0;
+    else if (arg == "--ntp") config.clockOffsetEstimation = atoi(argv[++i]) != 0;
+    else if (arg == "--att-jitter") attJitterUs = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--skew-ppm") skewPpm = atof(argv[++i]);
+    else if (arg == "--drift") config.driftCompensation = atoi(argv[++i]) != 0;
+    else if (arg == "--adaptive") config.adaptiveSyncInterval = atoi(argv[++i]) != 0;
+    else if (arg == "--sync-interval") config.syncIntervalMs = strtoul(argv[++i], nullptr, 10) * 1000;
+    else if (arg == "--backoff-max") config.connectBackoffMaxMs = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--timer") config.timerTicks = atoi(argv[++i]) != 0;
+    else if (arg == "--app-work-ms") driver.appWorkMs = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--rollover") rolloverSeconds = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--log") BLESyncLog::setDirect(std::string(argv[++i]) == "direct");
+    else if (arg == "--serial-baud") serialBaud = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--trace-dir") traceDir = argv[++i];
+    else if (arg == "--conn-events") connectionEvents = atoi(argv[++i]) != 0;
+    else if (arg == "--link-profiles") config.linkProfileSwitching = atoi(argv[++i]) != 0;
+    else if (arg == "--write-nr") config.syncWriteNoResponse = atoi(argv[++i]) != 0;
+    else if (arg == "--direct-reconnect") config.directReconnect = atoi(argv[++i]) != 0;
+    else if (arg == "--flood-events") floodCount = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--reboot-master") rebootSeconds = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--driver") {
+      std::string mode = argv[++i];
+      driver.mode = mode == "task" ? DRIVE_TASK : mode == "threads" ? DRIVE_THREADS : DRIVE_LOOP;
+    }
+  }
+  Serial.enabled = verbose;
+  if (serialBaud > 0) {
+    Serial.writeHook = onSerialWrite;
+  }
+  srand(seed);
+  if (throughput) {
+    runThroughput(seconds);
+    return 0;
+  }
+
+  std::vector<unsigned long> latencies;
+  unsigned long long loopCalls = 0;
+  unsigned long long logLines = 0;
+  Histogram loopLatency;
+  Histogram connectBackoff;
+  Histogram resyncLatency;
+  Histogram syncFanout;
+  Histogram syncWrite;
+  Histogram tickAlignment;
+  Histogram rolloverAlignment;
+  Histogram offsetError;
+  uint32_t cacheHits = 0, cacheMisses = 0, peerRecordWrites = 0;
+  unsigned long eventsDropped = 0, peerStateErrors = 0;
+  int rebootCases = 0, rebootMastersKept = 0, rebootsJoined = 0;
+  BLESyncMetrics metrics;
+  unsigned long metricsValues = 0;
+  double driftErrorPpbSum = 0, driftErrorPpbMax = 0;
+  int driftSamples = 0;
+  Histogram syncCorrection;
+  Histogram tickLateness;
+  Histogram tickNotifyDelay;
+  unsigned long long syncRadioUs = 0, fixedRadioUs = 0;
+  unsigned long long syncTransactions = 0;
+  unsigned long clientsSynced = 0, clientSlots = 0;
+  uint32_t peakPeers = 0;
+  unsigned long long stateTimeUs[LINK_STATE_COUNT] = {};
+  unsigned long long stateEntries[LINK_STATE_COUNT] = {};
+  unsigned long long reconnectUs[LINK_STATE_COUNT] = {};
+  Histogram reconnectLatency;
+  Histogram notifyLatency[LINK_PROFILE_COUNT];
+  Histogram writeLatency[LINK_PROFILE_COUNT];
+  unsigned long drops = 0;
+  long long heapGrowth = 0, heapHighWater = 0;
+  unsigned long long heapAllocs = 0;
+  long long clockStartUs = rolloverSeconds > 0 ? ROLLOVER_US - rolloverSeconds * 1000000LL : 0;
+  auto wallStart = std::chrono::steady_clock::now();
+  for (int t = 0; t < trials; t++) {
+    SimResult r = runTrial(nodeCount, seconds * 1000, config, pollOnly, dropEverySeconds * 1000, attJitterUs, skewPpm,
+                           clockStartUs, driver, t == trials - 1 ? traceDir : std::string(), connectionEvents,
+                           floodCount, rebootSeconds * 1000);
+    loopCalls += r.loopCalls;
+    logLines += r.logLines;
+    loopLatency.merge(r.loopLatency);
+    connectBackoff.merge(r.connectBackoff);
+    resyncLatency.merge(r.resyncLatency);
+    syncFanout.merge(r.syncFanout);
+    syncWrite.merge(r.syncWrite);
+    tickAlignment.merge(r.tickAlignment);
+    rolloverAlignment.merge(r.rolloverAlignment);
+    offsetError.merge(r.offsetError);
+    driftErrorPpbSum += r.driftErrorPpbSum;
+    driftErrorPpbMax = std::max(driftErrorPpbMax, r.driftErrorPpbMax);
+    driftSamples += r.driftSamples;
+    syncCorrection.merge(r.syncCorrection);
+    tickLateness.merge(r.tickLateness);
+    tickNotifyDelay.merge(r.tickNotifyDelay);
+    syncRadioUs += r.syncRadioUs;
+    fixedRadioUs += r.fixedRadioUs;
+    syncTransactions += r.syncTransactions;
+    clientsSynced += r.clientsSynced;
+    clientSlots += r.clientSlots;
+    peakPeers = std::max(peakPeers, r.peakPeers);
+    for (int s = 0; s < LINK_STATE_COUNT; s++) {
+      stateTimeUs[s] += r.stateTimeUs[s];
+      stateEntries[s] += r.stateEntries[s];
+      reconnectUs[s] += r.reconnectUs[s];
+    }
+    reconnectLatency.merge(r.reconnectLatency);
+    for (int p = 0; p < LINK_PROFILE_COUNT; p++) {
+      notifyLatency[p].merge(r.notifyLatency[p]);
+      writeLatency[p].merge(r.writeLatency[p]);
+    }
+    drops += r.drops;
+    heapGrowth = std::max(heapGrowth, r.heapLastBytes - r.heapBaselineBytes);
+    heapHighWater = std::max(heapHighWater, r.heapPeakBytes - r.heapBaselineBytes);
+    heapAllocs += r.heapAllocs;
+    cacheHits += r.cacheHits;
+    cacheMisses += r.cacheMisses;
+    peerRecordWrites += r.peerRecordWrites;
+    eventsDropped += r.eventsDropped;
+    peerStateErrors += r.peerStateErrors;
+    rebootCases += r.rebootCase;
+    rebootMastersKept += r.rebootMasterKept;
+    rebootsJoined += r.rebootJoined;
+    metrics.merge(r.metrics);
+    metricsValues += r.metricsValues;
+    if (r.synced) latencies.push_back(r.connectToSyncMs);
+  }
+  double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  printf("nodes=%d trials=%d sim_seconds=%lu\n", nodeCount, trials, seconds);
+  printf("synced_trials=%u/%d\n", (unsigned)latencies.size(), trials);
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    unsigned long long sum = 0;
+    for (size_t i = 0; i < latencies.size(); i++) sum += latencies[i];
+    printf("connect_to_first_sync_ms min=%lu p50=%lu p95=%lu max=%lu mean=%llu\n",
+           latencies.front(),
+           latencies[latencies.size() / 2],
+           latencies[latencies.size() * 95 / 100],
+           latencies.back(),
+           sum / latencies.size());
+  }
+  Serial.enabled = true;
+  loopLatency.print("loop_latency");
+  connectBackoff.print("connect_backoff");
+  resyncLatency.print("resync_latency");
+  syncFanout.print("sync_fanout");
+  syncWrite.print("sync_write_block");
+  tickAlignment.print("tick_alignment");
+  if (rolloverSeconds > 0) {
+    rolloverAlignment.print("tick_alignment_after_rollover");
+  }
+  offsetError.print("clock_offset_error");
+  syncCorrection.print("sync_correction");
+  tickLateness.print("tick_lateness");
+  tickNotifyDelay.print("tick_notify_delay");
+  printf("sync_radio_ms=%llu syncs=%llu fixed_interval_radio_ms=%llu saved=%.0f%%\n",
+         syncRadioUs / 1000, syncTransactions, fixedRadioUs / 1000,
+         fixedRadioUs ? 100.0 * ((double)fixedRadioUs - (double)syncRadioUs) / fixedRadioUs : 0.0);
+  if (driftSamples > 0) {
+    printf("drift_estimate_error_ppb mean=%.0f max=%.0f clients=%d\n",
+           driftErrorPpbSum / driftSamples, driftErrorPpbMax, driftSamples);
+  }
+  // Where --reboot-master moved the role, the node that took over was a
+  // synced client before and the rebooted node can become one: one more
+  if (rebootSeconds > 0) {
+    printf("clients_synced_per_trial=%.2f/%.2f peak_peers=%u\n", trials ? (double)clientsSynced / trials : 0.0,
+           trials ? (double)clientSlots / trials : 0.0, peakPeers);
+  } else {
+    printf("clients_synced_per_trial=%.2f/%d peak_peers=%u\n",
+           trials ? (double)clientsSynced / trials : 0.0, nodeCount - 1, peakPeers);
+  }
+  printf("state_time_s");
+  for (int s = 0; s < LINK_STATE_COUNT; s++) {
+    printf(" %s=%.1f/%llu", BLESyncNode::stateName((LinkState)s), stateTimeUs[s] / 1e6, stateEntries[s]);
+  }
+  printf("\n");
+  reconnectLatency.print("reconnect_latency");
+  if (reconnectLatency.samples > 0) {
+    printf("reconnect_path_ms");
+    for (int s = 0; s < LINK_STATE_COUNT; s++) {
+      if (reconnectUs[s] > 0) {
+        printf(" %s=%.0f", BLESyncNode::stateName((LinkState)s), reconnectUs[s] / 1000.0 / reconnectLatency.samples);
+      }
+    }
+    printf("\n");
+  }
+  if (drops > 0) {
+#ifdef SIM_HEAP_WATCH
+    printf("reconnect_heap drops=%lu growth_bytes=%lld high_water_bytes=%lld allocs_per_drop=%.1f\n",
+           drops, heapGrowth, heapHighWater, (double)heapAllocs / drops);
+#else
+    printf("reconnect_heap drops=%lu (not counted on this platform)\n", drops);
+#endif
+  }
+  for (int p = 0; p < LINK_PROFILE_COUNT && connectionEvents; p++) {
+    std::string name = BLE_LINK_PROFILES[p].name;
+    notifyLatency[p].print(("notify_to_apply_" + name).c_str());
+    writeLatency[p].print(("sync_write_to_apply_" + name).c_str());
+  }
+  printf("gatt_cache hits=%u misses=%u peer_record_writes=%u\n", cacheHits, cacheMisses, peerRecordWrites);
+  if (rebootSeconds > 0) {
+    printf("reboot old_client_master=%d/%d master_kept=%d rebooted_joined=%d\n",
+           rebootCases, trials, rebootMastersKept, rebootsJoined);
+  }
+  if (floodCount > 0) {
+    printf("event_flood per_drop=%u events_dropped=%lu peer_state_errors=%lu\n",
+           floodCount, eventsDropped, peerStateErrors);
+  }
+  printf("metrics");
+  for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+    printf(" %s=%u", BLESyncMetrics::counterName((BLESyncCounterId)i), metrics.counter((BLESyncCounterId)i));
+  }
+  printf("\n");
+  for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+    std::string label = std::string("metric_") + BLESyncMetrics::histogramName((BLESyncHistogramId)i);
+    metrics.histogram((BLESyncHistogramId)i).print(label.c_str());
+  }
+  printf("metrics_char valid=%lu/%d bytes=%d\n", metricsValues, nodeCount * trials, METRICS_LEN);
+  printf("log_lines=%llu dropped=%u level=%d\n", logLines, (unsigned)BLESyncLog::dropped(), BLESYNC_LOG_LEVEL);
+  printf("node_seconds_per_wall_second=%.0f loop_calls=%llu wall=%.2fs\n",
+         wallSec > 0 ? (double)nodeCount * trials * seconds / wallSec : 0.0,
+         loopCalls, wallSec);
+  return peerStateErrors > 0 ? 1 : 0;
+}
+#endif